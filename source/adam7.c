@@ -0,0 +1,462 @@
+/*
+ * adam7.c
+ *
+ * Decoding interlaced images on more than one processor, when
+ * built with _PTOT_THREADS_. Each Adam7 pass is a small image
+ * of its own, filtered separately, so once inflate has produced
+ * all of a pass, it can be unfiltered by a thread of its own
+ * while inflate carries on with the next. The unfiltered passes
+ * are kept in memory rather than in pass files, so the scatter
+ * into whole rows needs no reading in order, and is split
+ * between threads, each taking a block of rows.
+ *
+ * That means holding the passes in memory twice over for a
+ * while (filtered and not), which is only done when it fits in
+ * --max-memory, or ADAM7_MEMORY if that isn't given. Otherwise,
+ * and without threads, zchunks.c does it all as it goes, through
+ * the pass files.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _PTOT_THREADS_
+#  include <pthread.h>
+#endif
+
+#include "ptot.h"
+
+#define DEFINE_ENUMS
+#include "errors.h"
+
+extern PNG_STATE ps;
+
+#ifdef _PTOT_THREADS_
+
+extern int interlace_pattern[8][8], starting_row[7], starting_col[7],
+  row_increment[7], col_increment[7];
+
+#define ADAM7_MEMORY    0x4000000L  /* 64MB */
+#define SCATTER_THREADS 4
+#define SCATTER_BAND    0x100000L   /* Bytes of rows per round */
+
+static void *unfilter_pass(void *);
+static void *scatter_rows(void *);
+static void start_pass(int, U32);
+
+static struct _adam7_state {
+    int bpp;                /* Bytes per unpacked pixel */
+    U32 rows[7], pixels[7]; /* Size of each pass */
+    size_t line_size[7];    /* Filtered bytes per row */
+    U8 *raw[7];             /* Filtered passes, as inflated */
+    size_t raw_size[7];
+    U8 *data[7];            /* Unfiltered, unpacked passes */
+    int next_pass;          /* Pass being inflated */
+    size_t raw_pos;         /* Bytes of it so far */
+    pthread_t worker[7];
+    int started[7];         /* Has a thread to join */
+    U32 done_rows[7];       /* Rows for the worker to unfilter */
+    int bad_filters[7];     /* Unknown filter types seen */
+    int err[7];
+} a7;
+
+static int pass_ids[7] = { 0, 1, 2, 3, 4, 5, 6 };
+
+/*
+ * A block of output rows for one scatter thread.
+ */
+
+typedef struct _scatter_block {
+    pthread_t thread;
+    U32 first, count;       /* Output rows */
+    U8 *out;
+} SCATTER_BLOCK;
+
+/*
+ * Called by decode_IDAT() for an interlaced image. If the
+ * passes fit in memory, allocate them and set ps.adam7, and the
+ * inflated data will come to adam7_bytes() instead of the
+ * unfilter. Not being able to is not an error.
+ */
+
+int
+start_adam7(
+    void)
+{
+    long limit, total;
+    int pass;
+
+    memset(&a7, 0, sizeof a7);
+    ps.adam7 = FALSE;
+    if (!ps.image->is_interlaced) return 0;
+
+    a7.bpp = ps.image->samples_per_pixel;
+    if (16 == ps.image->bits_per_sample) a7.bpp *= 2;
+
+    limit = (0 != opts.max_memory) ? opts.max_memory : ADAM7_MEMORY;
+    total = 0;
+    for (pass = 0; pass <= ps.last_pass; ++pass) {
+        if (ps.image->width <= starting_col[pass] ||
+          ps.image->height <= starting_row[pass]) continue;
+
+        a7.pixels[pass] = (ps.image->width - starting_col[pass] - 1) /
+          col_increment[pass] + 1;
+        a7.rows[pass] = (ps.image->height - starting_row[pass] - 1) /
+          row_increment[pass] + 1;
+        a7.line_size[pass] = new_line_size(ps.image,
+          starting_col[pass], col_increment[pass]);
+        a7.raw_size[pass] = (1 + a7.line_size[pass]) * a7.rows[pass];
+
+        total += (long)a7.raw_size[pass] + (long)a7.rows[pass] *
+          (long)a7.pixels[pass] * a7.bpp;
+        if (total > limit) return 0;
+    }
+    for (pass = 0; pass <= ps.last_pass; ++pass) {
+        if (0 == a7.rows[pass]) continue;
+        a7.raw[pass] = (U8 *)malloc(a7.raw_size[pass]);
+        a7.data[pass] = (U8 *)malloc((size_t)a7.rows[pass] *
+          a7.pixels[pass] * a7.bpp);
+        if (NULL == a7.raw[pass] || NULL == a7.data[pass]) {
+            end_adam7();
+            return 0;
+        }
+    }
+    ps.adam7 = TRUE;
+    return 0;
+}
+
+/*
+ * Unfilter a whole pass, or as many rows of it as we got, into
+ * a7.data. Runs on its own thread, and touches nothing of the
+ * pass but its own, and nothing else that changes meanwhile.
+ */
+
+static void *
+unfilter_pass(
+    void *arg)
+{
+    int pass, bits, got_bits, pixel;
+    U32 row, col;
+    size_t line_size;
+    U8 *in, *out, *cur, *prev, *temp, byte;
+
+    pass = *(int *)arg;
+    line_size = a7.line_size[pass];
+    bits = ps.image->bits_per_sample;
+    TRACE_BEGIN(TRACE_UNFILTER_PASS, pass);
+
+    cur = (U8 *)malloc(line_size);
+    prev = (U8 *)calloc(line_size, 1);
+    if (NULL == cur || NULL == prev) {
+        a7.err[pass] = ERR_MEMORY;
+        goto up_err_out;
+    }
+    in = a7.raw[pass];
+    out = a7.data[pass];
+
+    for (row = 0; row < a7.done_rows[pass]; ++row) {
+        if (*in > 4) {
+            ++a7.bad_filters[pass];
+            *in = 0;
+        }
+        (*ps.unfilter)(cur, prev, in + 1, 0, line_size, *in);
+        in += 1 + line_size;
+        /*
+         * Unpack 1, 2, and 4-bit values into whole bytes, as
+         * zchunks.c does for the pass files.
+         */
+        if (bits < 8) {
+            temp = cur;
+            got_bits = 0;
+            for (col = 0; col < a7.pixels[pass]; ++col) {
+                if (0 == got_bits) {
+                    byte = *temp++;
+                    got_bits = 8;
+                }
+                pixel = (byte >> (8 - bits)) & ((1 << bits) - 1);
+                *out++ = (U8)((pixel * 255) / ((1 << bits) - 1));
+                byte <<= bits;
+                got_bits -= bits;
+            }
+        } else {
+            memcpy(out, cur, line_size);
+            out += line_size;
+        }
+        temp = prev;
+        prev = cur;
+        cur = temp;
+    }
+up_err_out:
+    if (NULL != cur) free(cur);
+    if (NULL != prev) free(prev);
+    free(a7.raw[pass]);
+    a7.raw[pass] = NULL;
+    TRACE_END(TRACE_UNFILTER_PASS);
+    return arg;
+}
+
+/*
+ * Hand "rows" rows of a pass to a worker, or unfilter them here
+ * if there's no thread to be had.
+ */
+
+static void
+start_pass(
+    int pass,
+    U32 rows)
+{
+    a7.done_rows[pass] = rows;
+    if (0 == pthread_create(&a7.worker[pass], NULL, unfilter_pass,
+      &pass_ids[pass])) {
+        a7.started[pass] = TRUE;
+    } else {
+        unfilter_pass(&pass_ids[pass]);
+    }
+}
+
+/*
+ * Take inflated bytes from flush_window(). As each pass fills,
+ * it goes off to be unfiltered. Returns nonzero, and sets
+ * ps.stop_inflate, once the last pass we need has all come.
+ */
+
+int
+adam7_bytes(
+    U8 *data,
+    U32 size)
+{
+    size_t count;
+    int pass;
+
+    while (size > 0 && a7.next_pass <= ps.last_pass) {
+        pass = a7.next_pass;
+        count = a7.raw_size[pass] - a7.raw_pos;
+        if (count > size) count = size;
+
+        memcpy(a7.raw[pass] + a7.raw_pos, data, count);
+        a7.raw_pos += count;
+        data += count;
+        size -= (U32)count;
+
+        if (a7.raw_pos == a7.raw_size[pass]) {
+            start_pass(pass, a7.rows[pass]);
+            /*
+             * Small images may have empty passes.
+             */
+            do {
+                ++a7.next_pass;
+            } while (a7.next_pass <= ps.last_pass &&
+              0 == a7.rows[a7.next_pass]);
+            a7.raw_pos = 0;
+        }
+    }
+    if (a7.next_pass > ps.last_pass && ps.last_pass < 6) {
+        ps.stop_inflate = TRUE;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Called once inflate is done. If the data stopped short, the
+ * whole rows of the pass it stopped in are unfiltered, and the
+ * rest is left as reading the end of a pass file would give.
+ * Then wait for all the workers.
+ */
+
+int
+finish_adam7(
+    void)
+{
+    int pass, err, i;
+    size_t done;
+
+    ASSERT(ps.adam7);
+
+    if (a7.next_pass <= ps.last_pass) {
+        pass = a7.next_pass;
+        start_pass(pass, a7.raw_pos / (1 + a7.line_size[pass]));
+
+        for (; pass <= ps.last_pass; ++pass) {
+            if (0 == a7.rows[pass]) continue;
+            done = (size_t)a7.done_rows[pass] * a7.pixels[pass] *
+              a7.bpp;
+            memset(a7.data[pass] + done, 0xFF, (size_t)a7.rows[pass] *
+              a7.pixels[pass] * a7.bpp - done);
+        }
+    }
+    err = 0;
+    for (pass = 0; pass <= 6; ++pass) {
+        if (a7.started[pass]) pthread_join(a7.worker[pass], NULL);
+        a7.started[pass] = FALSE;
+        if (0 != a7.err[pass] && 0 == err) err = a7.err[pass];
+        for (i = 0; i < a7.bad_filters[pass]; ++i)
+          print_warning(WARN_FILTER);
+    }
+    return err;
+}
+
+/*
+ * Build a block of output rows from the passes. Row and column
+ * numbers are worked out as repack_tempfiles() would reach
+ * them, for cropping and thumbnails.
+ */
+
+static void *
+scatter_rows(
+    void *arg)
+{
+    SCATTER_BLOCK *block;
+    U32 i, j, row, col, width, step, pr, pc;
+    int pass;
+    U8 *out;
+
+    block = (SCATTER_BLOCK *)arg;
+    step = ps.thumb_factor;
+    width = (ps.crop_width + step - 1) / step;
+    out = block->out;
+    TRACE_BEGIN(TRACE_SCATTER_ROWS, block->first);
+
+    for (i = block->first; i < block->first + block->count; ++i) {
+        row = ((ps.crop_y + step - 1) / step + i) * step;
+        for (j = 0; j < width; ++j) {
+            col = (ps.crop_x + j) * step;
+            pass = interlace_pattern[row & 7][col & 7];
+            pr = (row - starting_row[pass]) / row_increment[pass];
+            pc = (col - starting_col[pass]) / col_increment[pass];
+            memcpy(out, a7.data[pass] + ((size_t)pr *
+              a7.pixels[pass] + pc) * a7.bpp, a7.bpp);
+            out += a7.bpp;
+        }
+    }
+    TRACE_END(TRACE_SCATTER_ROWS);
+    return arg;
+}
+
+/*
+ * Write the image, cropped or reduced, to "outf", a band of
+ * rows at a time, each band built by SCATTER_THREADS threads.
+ */
+
+int
+scatter_adam7(
+    FILE *outf)
+{
+    SCATTER_BLOCK block[SCATTER_THREADS];
+    U32 rows, first, band, count, each;
+    size_t row_bytes;
+    U8 *buf;
+    int t, started[SCATTER_THREADS], err;
+
+    ASSERT(ps.adam7);
+
+    rows = (ps.crop_y + ps.crop_height + ps.thumb_factor - 1) /
+      ps.thumb_factor - (ps.crop_y + ps.thumb_factor - 1) /
+      ps.thumb_factor;
+    row_bytes = (size_t)a7.bpp *
+      ((ps.crop_width + ps.thumb_factor - 1) / ps.thumb_factor);
+
+    band = (U32)(SCATTER_BAND / row_bytes);
+    if (band < SCATTER_THREADS) band = SCATTER_THREADS;
+    if (band > rows) band = rows;
+    if (NULL == (buf = (U8 *)malloc(row_bytes * band)))
+      return ERR_MEMORY;
+
+    err = 0;
+    for (first = 0; first < rows; first += count) {
+        count = min(band, rows - first);
+        each = (count + SCATTER_THREADS - 1) / SCATTER_THREADS;
+
+        for (t = 0; t < SCATTER_THREADS; ++t) {
+            block[t].first = first + min(count, t * each);
+            block[t].count = min(count, (t + 1) * each) -
+              min(count, t * each);
+            block[t].out = buf + row_bytes * (block[t].first - first);
+            started[t] = (0 == pthread_create(&block[t].thread, NULL,
+              scatter_rows, &block[t]));
+            if (!started[t]) scatter_rows(&block[t]);
+        }
+        for (t = 0; t < SCATTER_THREADS; ++t) {
+            if (started[t]) pthread_join(block[t].thread, NULL);
+        }
+        if (count != fwrite(buf, row_bytes, count, outf)) {
+            err = ERR_WRITE;
+            break;
+        }
+    }
+    free(buf);
+    return err;
+}
+
+/*
+ * Free everything, waiting first for any workers still going
+ * (after an error, say).
+ */
+
+void
+end_adam7(
+    void)
+{
+    int pass;
+
+    for (pass = 0; pass <= 6; ++pass) {
+        if (a7.started[pass]) pthread_join(a7.worker[pass], NULL);
+        if (NULL != a7.raw[pass]) free(a7.raw[pass]);
+        if (NULL != a7.data[pass]) free(a7.data[pass]);
+    }
+    memset(&a7, 0, sizeof a7);
+    ps.adam7 = FALSE;
+}
+
+#else /* _PTOT_THREADS_ */
+
+/*
+ * Without threads, interlaced images are always done as they
+ * are inflated, and none of the rest is ever called.
+ */
+
+int
+start_adam7(
+    void)
+{
+    ps.adam7 = FALSE;
+    return 0;
+}
+
+int
+adam7_bytes(
+    U8 *data,
+    U32 size)
+{
+    ASSERT(FALSE);
+    return 1;
+}
+
+int
+finish_adam7(
+    void)
+{
+    ASSERT(FALSE);
+    return ERR_ASSERT;
+}
+
+int
+scatter_adam7(
+    FILE *outf)
+{
+    ASSERT(FALSE);
+    return ERR_ASSERT;
+}
+
+void
+end_adam7(
+    void)
+{
+}
+
+#endif /* _PTOT_THREADS_ */
+
+/*
+ * End of adam7.c
+ */
@@ -0,0 +1,506 @@
+/*
+ * apng.c
+ *
+ * Animated PNG (APNG) support for PNG-to-TIFF utility. The
+ * acTL and fcTL chunks describe the animation and its frames;
+ * each frame's image data arrives in fdAT chunks, which are
+ * decoded exactly like IDAT into a frame data file.
+ *
+ * On output, the frames are drawn one by one onto a canvas the
+ * size of the whole image, and the canvas is written out as a
+ * TIFF page after each. The canvas is kept in a file, in the
+ * same layout as the pixel data file, and only the rows and
+ * columns a frame covers are ever read or rewritten, so the
+ * work per frame depends on the size of the frame, not of the
+ * canvas.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ptot.h"
+
+#define DEFINE_ENUMS
+#include "errors.h"
+
+extern PNG_STATE ps;
+
+static int dispose_frame(APNG_FRAME *);
+static int save_region(APNG_FRAME *);
+static int draw_frame(APNG_FRAME *);
+static int is_transparent(U8 *);
+static void blend_over(U8 *, U8 *, U32);
+
+static struct _anim_state {
+    IMG_INFO source;        /* Image as decoded */
+    FILE *canvas;           /* Open for update */
+    FILE *frames, *still;   /* Frame sources */
+    FILE *saved;            /* Region under a "previous" frame */
+    size_t bpp;             /* Bytes per pixel */
+    U8 *src_row, *dst_row;
+    U8 trans_key[6];        /* tRNS color, as stored */
+    U32 frame;              /* Next frame to draw */
+} as;
+
+/*
+ * fcTL and fdAT chunks share one sequence, which must count
+ * up from zero without gaps. We complain but carry on if not.
+ */
+
+void
+check_sequence(
+    U32 sequence)
+{
+    if (sequence != ps.next_sequence) print_warning(WARN_BAD_PNG);
+    ps.next_sequence = sequence + 1;
+}
+
+/*
+ * acTL marks the file as animated. It must come before IDAT;
+ * otherwise, by the APNG rules, the file is a still image.
+ */
+
+int
+decode_acTL(
+    void)
+{
+    ASSERT(NULL != ps.buf);
+    ASSERT(NULL != ps.image);
+
+    if (ps.got_first_idat) {
+        print_warning(WARN_BAD_PNG);
+        return skip_chunk_data();
+    }
+    if (!ps.animate) {
+        print_warning(WARN_FRAMES);
+        return skip_chunk_data();
+    }
+    if (ps.bytes_remaining < 8) return ERR_BAD_PNG;
+    if (8 != get_chunk_data(8)) return ERR_READ;
+
+    ps.image->num_frames = BE_GET32(ps.buf);
+    ps.image->num_plays = BE_GET32(ps.buf + 4);
+    ps.image->is_animated = (0 != ps.image->num_frames);
+    if (!ps.image->is_animated) print_warning(WARN_BAD_PNG);
+    return 0;
+}
+
+/*
+ * fcTL starts a new frame. If it comes before IDAT, the IDAT
+ * image is the first frame of the animation.
+ */
+
+int
+decode_fcTL(
+    void)
+{
+    APNG_FRAME *frame;
+    U32 count;
+
+    ASSERT(NULL != ps.buf);
+    ASSERT(NULL != ps.image);
+
+    if (!ps.image->is_animated) return skip_chunk_data();
+    if (ps.bytes_remaining < 26) return ERR_BAD_PNG;
+    if (26 != get_chunk_data(26)) return ERR_READ;
+    check_sequence(BE_GET32(ps.buf));
+    /*
+     * The frame table starts with room for 8, and doubles in
+     * size whenever it fills up.
+     */
+    count = ps.image->frame_count;
+    if (0 == count || (count >= 8 && 0 == (count & (count - 1)))) {
+        count = (0 == count) ? 8 : 2 * count;
+        frame = (APNG_FRAME *)realloc(ps.image->frames,
+          (size_t)count * sizeof (APNG_FRAME));
+        if (NULL == frame) return ERR_MEMORY;
+        ps.image->frames = frame;
+    }
+    frame = &ps.image->frames[ps.image->frame_count];
+
+    frame->width = BE_GET32(ps.buf + 4);
+    frame->height = BE_GET32(ps.buf + 8);
+    frame->x_offset = BE_GET32(ps.buf + 12);
+    frame->y_offset = BE_GET32(ps.buf + 16);
+    frame->delay_num = BE_GET16(ps.buf + 20);
+    frame->delay_den = BE_GET16(ps.buf + 22);
+    frame->dispose_op = ps.buf[24];
+    frame->blend_op = ps.buf[25];
+    frame->is_default = !ps.got_first_idat;
+    frame->data_offset = -1L;
+
+    if (0 == frame->width || 0 == frame->height ||
+      frame->x_offset >= ps.image->width ||
+      frame->y_offset >= ps.image->height ||
+      frame->width > ps.image->width - frame->x_offset ||
+      frame->height > ps.image->height - frame->y_offset ||
+      frame->dispose_op > APNG_DISPOSE_PREVIOUS ||
+      frame->blend_op > APNG_BLEND_OVER) return ERR_BAD_PNG;
+
+    if (frame->is_default && (frame->width != ps.image->width ||
+      frame->height != ps.image->height)) return ERR_BAD_PNG;
+
+    ++ps.image->frame_count;
+    return 0;
+}
+
+/*
+ * Decode a frame's image data. We temporarily make the image
+ * the size of the frame, and let decode_IDAT() do the rest;
+ * it follows the frame on through any further fdAT chunks.
+ */
+
+int
+decode_fdAT(
+    void)
+{
+    APNG_FRAME *frame;
+    U32 width, height;
+    int err;
+
+    ASSERT(NULL != ps.buf);
+    ASSERT(NULL != ps.image);
+
+    if (!ps.image->is_animated) return skip_chunk_data();
+    if (ps.bytes_remaining < 4) return ERR_BAD_PNG;
+    if (4 != get_chunk_data(4)) return ERR_READ;
+    check_sequence(BE_GET32(ps.buf));
+    /*
+     * Image data with no fcTL of its own to describe it.
+     */
+    if (!ps.got_first_idat || 0 == ps.image->frame_count) {
+        print_warning(WARN_BAD_PNG);
+        return skip_chunk_data();
+    }
+    frame = &ps.image->frames[ps.image->frame_count - 1];
+    if (frame->is_default || -1L != frame->data_offset) {
+        print_warning(WARN_BAD_PNG);
+        return skip_chunk_data();
+    }
+    width = ps.image->width;
+    height = ps.image->height;
+    ps.image->width = frame->width;
+    ps.image->height = frame->height;
+    ps.frame = frame;
+
+    err = decode_IDAT();
+
+    ps.frame = NULL;
+    ps.image->width = width;
+    ps.image->height = height;
+    return err;
+}
+
+/*
+ * Get ready to draw the frames. This must be called before
+ * setup_transforms() changes the image description. The canvas
+ * starts out fully transparent black, and takes over as the
+ * image's pixel data file, so the output module sees whatever
+ * has been drawn.
+ */
+
+int
+start_animation(
+    IMG_INFO *image)
+{
+    U32 row;
+    size_t bytes;
+    int sample;
+
+    ASSERT(NULL != image);
+    ASSERT(NULL != image->pixel_data);
+    ASSERT(0 != image->frame_count);
+
+    memset(&as, 0, sizeof as);
+    as.source = *image;
+    as.bpp = image->samples_per_pixel;
+    if (16 == image->bits_per_sample) as.bpp *= 2;
+    bytes = (size_t)as.bpp * image->width;
+    /*
+     * The transparent color, in the form it takes in the
+     * pixel data file (sub-byte gray is scaled to 8 bits).
+     */
+    if (image->has_trns && !image->is_palette) {
+        for (sample = 0; sample < image->samples_per_pixel;
+          ++sample) {
+            U16 value = image->trans_values[sample];
+
+            if (16 == image->bits_per_sample) {
+                BE_PUT16(as.trans_key + 2 * sample, value);
+            } else {
+                if (image->bits_per_sample < 8) value = (value *
+                  255) / ((1 << image->bits_per_sample) - 1);
+                as.trans_key[sample] = (U8)value;
+            }
+        }
+    }
+    as.src_row = (U8 *)malloc(bytes);
+    as.dst_row = (U8 *)malloc(bytes);
+    if (NULL == as.src_row || NULL == as.dst_row) return ERR_MEMORY;
+
+    as.still = image->pixel_data;
+    as.frames = image->frame_data;
+    if (NULL == (as.canvas =
+      new_tempfile((long)bytes * (long)image->height))) {
+        image->pixel_data = NULL;
+        return ERR_WRITE;
+    }
+    image->pixel_data = as.canvas;
+
+    memset(as.dst_row, 0, bytes);
+    for (row = 0; row < image->height; ++row) {
+        if (bytes != fwrite(as.dst_row, 1, bytes, as.canvas))
+          return ERR_WRITE;
+    }
+    return 0;
+}
+
+/*
+ * Draw the next frame onto the canvas, first clearing away the
+ * one before as its dispose_op says.
+ */
+
+int
+compose_frame(
+    void)
+{
+    APNG_FRAME *frame;
+    int err;
+
+    ASSERT(NULL != as.canvas);
+    ASSERT(as.frame < as.source.frame_count);
+
+    if (0 != as.frame) {
+        err = dispose_frame(&as.source.frames[as.frame - 1]);
+        if (0 != err) return err;
+    }
+    frame = &as.source.frames[as.frame];
+    if (!frame->is_default && -1L == frame->data_offset)
+      return ERR_BAD_PNG;
+    /*
+     * A "previous" dispose on the first frame means clear to
+     * background, so there is nothing to save then.
+     */
+    if (APNG_DISPOSE_PREVIOUS == frame->dispose_op && 0 != as.frame) {
+        if (0 != (err = save_region(frame))) return err;
+    }
+    if (0 != (err = draw_frame(frame))) return err;
+    if (0 != fflush(as.canvas)) return ERR_WRITE;
+
+    ++as.frame;
+    return 0;
+}
+
+/*
+ * Release everything start_animation() set up. The canvas and
+ * the frame data belong to the image, and are left for the
+ * caller to free with it.
+ */
+
+void
+end_animation(
+    void)
+{
+    free_tempfile(as.still);
+    free_tempfile(as.saved);
+    if (NULL != as.src_row) free(as.src_row);
+    if (NULL != as.dst_row) free(as.dst_row);
+    memset(&as, 0, sizeof as);
+}
+
+/*
+ * Seek to column "x" of canvas row "y". The offset is worked out
+ * in long, as it can pass 4GB; check_image_size() has made sure
+ * that it fits.
+ */
+
+#define SEEK_CANVAS(x,y) fseek(as.canvas, ((long)(y) * \
+  (long)as.source.width + (long)(x)) * as.bpp, SEEK_SET)
+
+static int
+dispose_frame(
+    APNG_FRAME *frame)
+{
+    U32 row;
+    size_t bytes;
+    int op;
+
+    op = frame->dispose_op;
+    if (APNG_DISPOSE_NONE == op) return 0;
+    if (APNG_DISPOSE_PREVIOUS == op && NULL == as.saved)
+      op = APNG_DISPOSE_BACKGROUND;
+
+    bytes = (size_t)as.bpp * frame->width;
+    if (APNG_DISPOSE_BACKGROUND == op) {
+        memset(as.src_row, 0, bytes);
+    } else rewind(as.saved);
+
+    for (row = 0; row < frame->height; ++row) {
+        if (APNG_DISPOSE_PREVIOUS == op &&
+          bytes != fread(as.src_row, 1, bytes, as.saved))
+          return ERR_READ;
+        if (0 != SEEK_CANVAS(frame->x_offset, frame->y_offset + row))
+          return ERR_WRITE;
+        if (bytes != fwrite(as.src_row, 1, bytes, as.canvas))
+          return ERR_WRITE;
+    }
+    return 0;
+}
+
+static int
+save_region(
+    APNG_FRAME *frame)
+{
+    U32 row;
+    size_t bytes;
+
+    if (NULL == as.saved) {
+        if (NULL == (as.saved = new_tempfile((long)as.bpp *
+          (long)as.source.width * (long)as.source.height)))
+          return ERR_WRITE;
+    } else rewind(as.saved);
+
+    bytes = (size_t)as.bpp * frame->width;
+    for (row = 0; row < frame->height; ++row) {
+        if (0 != SEEK_CANVAS(frame->x_offset, frame->y_offset + row))
+          return ERR_READ;
+        if (bytes != fread(as.dst_row, 1, bytes, as.canvas))
+          return ERR_READ;
+        if (bytes != fwrite(as.dst_row, 1, bytes, as.saved))
+          return ERR_WRITE;
+    }
+    return 0;
+}
+
+/*
+ * Copy or blend the frame's rows into place. Blending needs the
+ * canvas pixels underneath, and only matters if the image has
+ * some kind of transparency.
+ */
+
+static int
+draw_frame(
+    APNG_FRAME *frame)
+{
+    U32 row;
+    size_t bytes;
+    FILE *inf;
+    int blend;
+
+    if (frame->is_default) {
+        inf = as.still;
+        rewind(inf);
+    } else {
+        inf = as.frames;
+        ASSERT(NULL != inf);
+        if (0 != fseek(inf, frame->data_offset, SEEK_SET))
+          return ERR_READ;
+    }
+    blend = (APNG_BLEND_OVER == frame->blend_op &&
+      (as.source.has_alpha || as.source.has_trns));
+    bytes = (size_t)as.bpp * frame->width;
+
+    for (row = 0; row < frame->height; ++row) {
+        if (bytes != fread(as.src_row, 1, bytes, inf))
+          return ERR_READ;
+        if (0 != SEEK_CANVAS(frame->x_offset, frame->y_offset + row))
+          return ERR_WRITE;
+        if (blend) {
+            if (bytes != fread(as.dst_row, 1, bytes, as.canvas))
+              return ERR_READ;
+            blend_over(as.src_row, as.dst_row, frame->width);
+            if (0 != SEEK_CANVAS(frame->x_offset,
+              frame->y_offset + row)) return ERR_WRITE;
+            if (bytes != fwrite(as.dst_row, 1, bytes, as.canvas))
+              return ERR_WRITE;
+        } else {
+            if (bytes != fwrite(as.src_row, 1, bytes, as.canvas))
+              return ERR_WRITE;
+        }
+    }
+    return 0;
+}
+
+#undef SEEK_CANVAS
+
+/*
+ * Does this pixel match the tRNS color (or, for a palette
+ * image, is its palette entry clear)? A palette entry that is
+ * only partly transparent can't be blended into a palette
+ * image, so we count it as opaque.
+ */
+
+static int
+is_transparent(
+    U8 *pixel)
+{
+    int index;
+
+    if (as.source.is_palette) {
+        index = *pixel >> (8 - as.source.bits_per_sample);
+        return (0 == as.source.palette_trans_bytes[index]);
+    }
+    return (0 == memcmp(pixel, as.trans_key, as.bpp));
+}
+
+/*
+ * APNG_BLEND_OVER: the frame's pixels are composited over the
+ * canvas using their alpha. This is the usual "over" operator
+ * for unassociated alpha. With only tRNS transparency, pixels
+ * are either replaced or not.
+ */
+
+static void
+blend_over(
+    U8 *src,
+    U8 *dst,
+    U32 pixels)
+{
+    U32 col;
+    int sample, colors;
+    double sa, da, oa, max, sc, dc;
+
+    colors = as.source.samples_per_pixel - 1;
+    max = (16 == as.source.bits_per_sample) ? 65535.0 : 255.0;
+
+    for (col = 0; col < pixels; ++col, src += as.bpp, dst += as.bpp) {
+        if (!as.source.has_alpha) {
+            if (!is_transparent(src)) memcpy(dst, src, as.bpp);
+            continue;
+        }
+        if (16 == as.source.bits_per_sample) {
+            sa = BE_GET16(src + 2 * colors);
+            da = BE_GET16(dst + 2 * colors);
+        } else {
+            sa = src[colors];
+            da = dst[colors];
+        }
+        if (0.0 == sa) continue;
+        if (max == sa || 0.0 == da) {
+            memcpy(dst, src, as.bpp);
+            continue;
+        }
+        da = da * (max - sa) / max;
+        oa = sa + da;
+
+        for (sample = 0; sample <= colors; ++sample) {
+            if (16 == as.source.bits_per_sample) {
+                sc = BE_GET16(src + 2 * sample);
+                dc = BE_GET16(dst + 2 * sample);
+            } else {
+                sc = src[sample];
+                dc = dst[sample];
+            }
+            if (sample < colors) dc = (sc * sa + dc * da) / oa;
+            else dc = oa;
+            if (16 == as.source.bits_per_sample) {
+                BE_PUT16(dst + 2 * sample, (U16)(dc + 0.5));
+            } else dst[sample] = (U8)(dc + 0.5);
+        }
+    }
+}
+
+/*
+ * End of apng.c
+ */
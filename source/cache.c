@@ -0,0 +1,312 @@
+/*
+ * cache.c
+ *
+ * Output cache for --cache-dir. Each conversion is filed in the
+ * cache directory under a key made from the input PNG and the
+ * options that affect the output, and a later run with the same
+ * key copies the stored file instead of converting again.
+ *
+ * The key doesn't need the input's image data read: every PNG
+ * chunk already carries a CRC of its contents, so we walk the
+ * chunk headers, seeking past the data, and hash the lengths,
+ * names and CRCs, along with the file size and the options.
+ * Two different 32-bit hashes of all that make a 64-bit key.
+ *
+ * With _PTOT_POSIX_ defined, files go into and out of the cache
+ * as hard links where possible, rather than copies. Entries are
+ * only ever created whole (by link() or rename()), so any number
+ * of copies of ptot can share a cache.
+ */
+
+#ifdef _PTOT_POSIX_
+#  define _XOPEN_SOURCE 500     /* For link() */
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _PTOT_POSIX_
+#  include <unistd.h>
+#endif
+
+#include "ptot.h"
+
+#define DEFINE_ENUMS
+#include "errors.h"
+
+/*
+ * Change this whenever ptot's output for the same input and
+ * options changes, so that old entries are no longer found.
+ */
+#define CACHE_VERSION   1
+
+static U32 fnv_hash(U32, U8 *, U32);
+static int copy_file(char *, char *);
+static int cache_name(char *, char *, char *);
+
+static char *extensions[] = { ".tif", ".pgm", ".ppm", ".pam", NULL };
+
+/*
+ * 32-bit FNV-1a, to go with the CRC.
+ */
+
+static U32
+fnv_hash(
+    U32 hash,
+    U8 *data,
+    U32 count)
+{
+    while (count--) {
+        hash ^= *data++;
+        hash = (hash * 16777619L) & 0xFFFFFFFFL;
+    }
+    return hash;
+}
+
+/*
+ * Work out the cache key for the PNG file "infname", as 16 hex
+ * digits in "key". Returns ERR_READ or ERR_BAD_PNG if the file
+ * can't be walked, in which case it can't be converted either.
+ */
+
+int
+cache_key(
+    char *infname,
+    char *key)
+{
+    U8 buf[128];
+    U32 crc, hash, length;
+    long size;
+    int err;
+
+    ASSERT(NULL != infname);
+    ASSERT(NULL != key);
+
+    sprintf((char *)buf, "ptot %d %d %d %lu %lu %lu %lu %lu %d",
+      CACHE_VERSION, opts.output_format, opts.crop,
+      (unsigned long)opts.crop_x, (unsigned long)opts.crop_y,
+      (unsigned long)opts.crop_width, (unsigned long)opts.crop_height,
+      (unsigned long)opts.thumbnail, opts.expand_trns);
+    length = strlen((char *)buf);
+    crc = update_crc(0xFFFFFFFFL, buf, length);
+    hash = fnv_hash(0x811C9DC5L, buf, length);
+
+    sprintf((char *)buf, "%.6g %lu %d %d %d %d", opts.target_gamma,
+      (unsigned long)opts.max_text, opts.flatten,
+      opts.flatten_color[0], opts.flatten_color[1],
+      opts.flatten_color[2]);
+    length = strlen((char *)buf);
+    crc = update_crc(crc, buf, length);
+    hash = fnv_hash(hash, buf, length);
+
+    if (0 != (err = png_fingerprint(infname, &crc, &hash, &size)))
+      return err;
+    BE_PUT32(buf, (U32)((size >> 16) >> 16));
+    BE_PUT32(buf + 4, (U32)(size & 0xFFFFFFFFL));
+    crc = update_crc(crc, buf, 8) ^ 0xFFFFFFFFL;
+    hash = fnv_hash(hash, buf, 8);
+
+    sprintf(key, "%08lx%08lx", (unsigned long)crc, (unsigned long)hash);
+    return 0;
+}
+
+/*
+ * Fingerprint the PNG file "infname" without reading its image
+ * data: each chunk's length, name and CRC go into "*crc" and
+ * "*hash", carrying on from the values passed, and the file's
+ * size into "*size". The index uses this too, to tell whether
+ * an index file is for the PNG it is given with.
+ */
+
+int
+png_fingerprint(
+    char *infname,
+    U32 *crc,
+    U32 *hash,
+    long *size)
+{
+    U8 buf[12];
+    U32 length;
+    FILE *fp;
+    int err;
+
+    ASSERT(NULL != infname);
+    ASSERT(NULL != crc && NULL != hash && NULL != size);
+
+    if (NULL == (fp = fopen(infname, "rb"))) return ERR_READ;
+
+    err = ERR_BAD_PNG;
+    if (8 != fread(buf, 1, 8, fp) || 0 != memcmp(buf, PNG_Signature, 8))
+      goto pf_err_out;
+    /*
+     * Hash each chunk's length, name and CRC, and skip the rest.
+     */
+    err = ERR_READ;
+    *size = 8;
+    for (;;) {
+        if (8 != fread(buf, 1, 8, fp)) break;
+        length = BE_GET32(buf);
+        if (length > PNG_MaxChunkLength ||
+          0 != fseek(fp, (long)length, SEEK_CUR) ||
+          4 != fread(buf + 8, 1, 4, fp)) goto pf_err_out;
+
+        *crc = update_crc(*crc, buf, 12);
+        *hash = fnv_hash(*hash, buf, 12);
+        *size += 12 + (long)length;
+        if (PNG_CN_IEND == BE_GET32(buf + 4)) break;
+    }
+    if (ferror(fp)) goto pf_err_out;
+    err = 0;
+pf_err_out:
+    fclose(fp);
+    return err;
+}
+
+/*
+ * Name of the cache entry with the given key and extension.
+ */
+
+static int
+cache_name(
+    char *name,
+    char *key,
+    char *extension)
+{
+    ASSERT(NULL != opts.cache_dir);
+
+    if (strlen(opts.cache_dir) + strlen(key) + 16 > FILENAME_MAX)
+      return ERR_USAGE;
+    sprintf(name, "%s/%s%s", opts.cache_dir, key, extension);
+    return 0;
+}
+
+/*
+ * Copy file "from" to "to", or (if we can) make "to" another
+ * link to the same file.
+ */
+
+static int
+copy_file(
+    char *from,
+    char *to)
+{
+    FILE *inf, *outf;
+    U8 buf[IOBUF_SIZE];
+    size_t bytes;
+    int err;
+
+#ifdef _PTOT_POSIX_
+    if (0 == link(from, to)) return 0;
+#endif
+    if (NULL == (inf = fopen(from, "rb"))) return ERR_READ;
+    if (NULL == (outf = fopen(to, "wb"))) {
+        fclose(inf);
+        return ERR_WRITE;
+    }
+    err = 0;
+    while (0 < (bytes = fread(buf, 1, IOBUF_SIZE, inf))) {
+        if (bytes != fwrite(buf, 1, bytes, outf)) {
+            err = ERR_WRITE;
+            break;
+        }
+    }
+    if (ferror(inf)) err = ERR_READ;
+    fclose(inf);
+    if (0 != fclose(outf) && 0 == err) err = ERR_WRITE;
+    if (0 != err) remove(to);
+    return err;
+}
+
+/*
+ * If the cache holds output for "key", copy it to "outfname"
+ * plus the extension it was stored with, and return TRUE.
+ * Otherwise return FALSE, and we convert as usual.
+ */
+
+int
+fetch_cached(
+    char *key,
+    char *outfname)
+{
+    char name[FILENAME_MAX], output[FILENAME_MAX];
+    FILE *fp;
+    int i;
+
+    ASSERT(NULL != key);
+    ASSERT(NULL != outfname);
+
+    for (i = 0; NULL != extensions[i]; ++i) {
+        if (0 != cache_name(name, key, extensions[i])) return FALSE;
+        if (NULL == (fp = fopen(name, "rb"))) continue;
+        fclose(fp);
+
+        sprintf(output, "%s%s", outfname, extensions[i]);
+        remove(output);
+        return (0 == copy_file(name, output));
+    }
+    return FALSE;
+}
+
+/*
+ * File the output just written to "outfname" in the cache. A
+ * copy goes in under a temporary name and is then renamed, so
+ * that nobody can find it half written; a link is made whole.
+ * If an entry already exists, another copy of ptot got there
+ * first, which is fine.
+ */
+
+int
+store_cached(
+    char *key,
+    char *outfname)
+{
+    char name[FILENAME_MAX], temp[FILENAME_MAX], *extension;
+    FILE *fp;
+    int err;
+#ifdef _PTOT_POSIX_
+    int fd;
+#else
+    static unsigned long serial;
+    int tries;
+#endif
+
+    ASSERT(NULL != key);
+    ASSERT(NULL != outfname);
+
+    if (NULL == (extension = strrchr(outfname, '.'))) return ERR_USAGE;
+    if (0 != (err = cache_name(name, key, extension))) return err;
+    if (0 != (err = cache_name(temp, key, ".XXXXXX"))) return err;
+#ifdef _PTOT_POSIX_
+    if (0 == link(outfname, name)) return 0;
+    if (NULL != (fp = fopen(name, "rb"))) {
+        fclose(fp);
+        return 0;
+    }
+    if (-1 == (fd = mkstemp(temp))) return ERR_WRITE;
+    close(fd);
+#else
+    if (NULL != (fp = fopen(name, "rb"))) {
+        fclose(fp);
+        return 0;
+    }
+    if (0 == serial) serial = (unsigned long)time(NULL);
+    for (tries = 0; tries < 100; ++tries) {
+        sprintf(temp + strlen(temp) - 6, "%06lx", serial++ & 0xFFFFFFL);
+        if (NULL == (fp = fopen(temp, "rb"))) break;
+        fclose(fp);
+    }
+    if (100 == tries) return ERR_WRITE;
+#endif
+    if (0 != (err = copy_file(outfname, temp))) return err;
+    if (0 != rename(temp, name)) {
+        remove(temp);
+        return ERR_WRITE;
+    }
+    return 0;
+}
+
+/*
+ * End of cache.c
+ */
@@ -0,0 +1,929 @@
+/*
+ * deflate.c
+ *
+ * zlib-format compression for the TIFF-to-PNG converter (ttop.c).
+ * The data is cut into jobs of DEFLATE_BLOCK bytes, and each job
+ * is compressed on its own, in the manner of pigz: it starts with
+ * the last 32K of the job before it as a dictionary, so matches
+ * can reach back across the cut just as they would in one long
+ * stream, and ends with an empty stored block to bring it to a
+ * byte boundary, so the jobs' output can simply be put end to
+ * end. All that costs is a few bytes a job.
+ *
+ * Built with _PTOT_THREADS_, each job is compressed by a thread
+ * of its own, with up to DEFLATE_JOBS at once. Otherwise each is
+ * compressed as soon as it is full. Either way the output is the
+ * same, byte for byte.
+ *
+ * Within a job, matches are found with hash chains and lazy
+ * evaluation, and each block of symbols is sent with whichever
+ * of dynamic codes, fixed codes or stored bytes is smallest.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _PTOT_THREADS_
+#  include <pthread.h>
+#endif
+
+#include "ptot.h"
+
+#define DEFINE_ENUMS
+#include "errors.h"
+
+#define DEFLATE_BLOCK   131072L /* Bytes of input per job */
+#define WINDOW_SIZE     32768L
+
+#ifdef _PTOT_THREADS_
+#  define DEFLATE_JOBS  4
+#else
+#  define DEFLATE_JOBS  1
+#endif
+
+#define HASH_BITS   15
+#define HASH_SIZE   (1 << HASH_BITS)
+#define MIN_MATCH   3
+#define MAX_MATCH   258
+#define MAX_CHAIN   128     /* Candidates tried per match */
+#define GOOD_MATCH  8       /* Try fewer after a match this long */
+#define MAX_LAZY    16      /* Take a match this long at once */
+#define NICE_MATCH  128     /* Stop looking at this length */
+#define SYMBOLS     16384   /* Literals and matches per block */
+
+#define LITERALS    286     /* Literal/length alphabet */
+#define DISTANCES   30
+#define CODE_LENGTHS 19
+#define END_BLOCK   256
+
+typedef struct _deflate_job {
+    U8 *in;                 /* Dictionary, then the data */
+    U32 dict_size, in_size;
+    int last;               /* Ends the stream */
+    U8 *out;                /* Compressed data */
+    U32 out_size, out_alloc;
+    U32 bit_buf;            /* Bits not yet in out */
+    int bit_count;
+    S32 *head, *prev;       /* Hash chains */
+    U16 *sym_len, *sym_dist;
+    int err;
+#ifdef _PTOT_THREADS_
+    pthread_t thread;
+    int started;            /* Has a thread to join */
+#endif
+} DEFLATE_JOB;
+
+static int init_tables(void);
+static void compress_job(DEFLATE_JOB *);
+static U32 longest_match(DEFLATE_JOB *, S32, S32, U32, int, U32 *);
+static void flush_block(DEFLATE_JOB *, U32, U32, U32, int);
+static void build_lengths(U32 *, int, int, U8 *);
+static void make_codes(U8 *, int, U16 *);
+static int make_code_lengths(U8 *, int, U8 *, int, U8 *, U8 *);
+static void send_symbols(DEFLATE_JOB *, U32, U8 *, U16 *, U8 *, U16 *);
+static void put_bits(DEFLATE_JOB *, U32, int);
+static void align_bits(DEFLATE_JOB *);
+static int grow_output(DEFLATE_JOB *, U32);
+static int start_job(void);
+static int finish_job(void);
+
+static struct _deflate_state {
+    DEFLATE_JOB job[DEFLATE_JOBS];
+    int next;               /* Job being filled */
+    int oldest;             /* First of the jobs started */
+    int pending;            /* How many have been started */
+    U32 sum1, sum2;         /* Adler-32 of the data */
+    int (*put)(U8 *, U32);  /* Where the stream goes */
+    int err;
+} ds;
+
+/*
+ * Extra bits and base values of the length and distance codes,
+ * and tables to find the code for any length or distance.
+ */
+
+static int length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static int dist_extra[DISTANCES] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+static int cl_extra[CODE_LENGTHS] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 7
+};
+static U8 cl_order[CODE_LENGTHS] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+static U16 length_base[29], dist_base[DISTANCES];
+static U8 length_code[MAX_MATCH + 1];
+static U8 dist_code[512];
+static U8 fixed_lit_len[288], fixed_dist_len[DISTANCES];
+static U16 fixed_lit_code[288], fixed_dist_code[DISTANCES];
+static int tables_built;
+
+#define DIST_CODE(d) (((d) <= 256) ? dist_code[(d) - 1] : \
+                      dist_code[256 + (((d) - 1) >> 7)])
+
+static int
+init_tables(
+    void)
+{
+    int code, i;
+    U32 base;
+
+    if (tables_built) return 0;
+
+    base = 3;
+    for (code = 0; code < 28; ++code) {
+        length_base[code] = (U16)base;
+        for (i = 0; i < (1 << length_extra[code]); ++i)
+          length_code[base + i] = (U8)code;
+        base += 1 << length_extra[code];
+    }
+    length_base[28] = MAX_MATCH;
+    length_code[MAX_MATCH] = 28;
+
+    base = 1;
+    for (code = 0; code < DISTANCES; ++code) {
+        dist_base[code] = (U16)base;
+        for (i = 0; i < (1 << dist_extra[code]); ++i) {
+            if (base + i <= 256) dist_code[base + i - 1] = (U8)code;
+            else dist_code[256 + ((base + i - 1) >> 7)] = (U8)code;
+        }
+        base += 1 << dist_extra[code];
+    }
+
+    for (i = 0; i < 288; ++i) {
+        if (i < 144) fixed_lit_len[i] = 8;
+        else if (i < 256) fixed_lit_len[i] = 9;
+        else if (i < 280) fixed_lit_len[i] = 7;
+        else fixed_lit_len[i] = 8;
+    }
+    make_codes(fixed_lit_len, 288, fixed_lit_code);
+    for (i = 0; i < DISTANCES; ++i) fixed_dist_len[i] = 5;
+    make_codes(fixed_dist_len, DISTANCES, fixed_dist_code);
+
+    tables_built = TRUE;
+    return 0;
+}
+
+/*
+ * Start a zlib stream. Compressed data is passed to "put" in
+ * order, as it becomes ready.
+ */
+
+int
+start_deflate(
+    int (*put)(U8 *, U32))
+{
+    DEFLATE_JOB *jp;
+    U8 header[2];
+    int i;
+
+    ASSERT(NULL != put);
+
+    init_tables();
+    memset(&ds, 0, sizeof ds);
+    ds.put = put;
+    ds.sum1 = 1;
+
+    for (i = 0; i < DEFLATE_JOBS; ++i) {
+        jp = &ds.job[i];
+        jp->in = (U8 *)malloc((size_t)(WINDOW_SIZE + DEFLATE_BLOCK));
+        jp->head = (S32 *)malloc(HASH_SIZE * sizeof (S32));
+        jp->prev = (S32 *)malloc((size_t)(WINDOW_SIZE +
+          DEFLATE_BLOCK) * sizeof (S32));
+        jp->sym_len = (U16 *)malloc(SYMBOLS * sizeof (U16));
+        jp->sym_dist = (U16 *)malloc(SYMBOLS * sizeof (U16));
+        if (NULL == jp->in || NULL == jp->head || NULL == jp->prev ||
+          NULL == jp->sym_len || NULL == jp->sym_dist) {
+            end_deflate();
+            return ERR_MEMORY;
+        }
+    }
+    /*
+     * Deflate, 32K window, default compression, no dictionary.
+     */
+    header[0] = 0x78;
+    header[1] = 0x9C;
+    if (0 != (ds.err = (*ds.put)(header, 2))) return ds.err;
+    return 0;
+}
+
+/*
+ * Add "count" bytes to the stream.
+ */
+
+int
+deflate_bytes(
+    U8 *data,
+    U32 count)
+{
+    DEFLATE_JOB *jp;
+    U32 n, i, sum1, sum2, chunk;
+
+    ASSERT(NULL != data || 0 == count);
+
+    if (0 != ds.err) return ds.err;
+    /*
+     * Adler-32, taking the modulus no more often than the sums
+     * might overflow (every 5552 bytes).
+     */
+    sum1 = ds.sum1;
+    sum2 = ds.sum2;
+    for (i = 0; i < count; i += chunk) {
+        chunk = min(count - i, 5552);
+        for (n = 0; n < chunk; ++n) {
+            sum1 += data[i + n];
+            sum2 += sum1;
+        }
+        sum1 %= 65521;
+        sum2 %= 65521;
+    }
+    ds.sum1 = sum1;
+    ds.sum2 = sum2;
+
+    while (0 != count) {
+        jp = &ds.job[ds.next];
+        n = min(count, DEFLATE_BLOCK - jp->in_size);
+        memcpy(jp->in + jp->dict_size + jp->in_size, data, (size_t)n);
+        jp->in_size += n;
+        data += n;
+        count -= n;
+
+        if (DEFLATE_BLOCK == jp->in_size) {
+            if (0 != (ds.err = start_job())) return ds.err;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Compress what is left, and end the stream.
+ */
+
+int
+finish_deflate(
+    void)
+{
+    U8 trailer[4];
+
+    if (0 != ds.err) return ds.err;
+
+    ds.job[ds.next].last = TRUE;
+    if (0 != (ds.err = start_job())) return ds.err;
+    while (0 != ds.pending) {
+        if (0 != (ds.err = finish_job())) return ds.err;
+    }
+    BE_PUT32(trailer, (ds.sum2 << 16) | ds.sum1);
+    return (ds.err = (*ds.put)(trailer, 4));
+}
+
+/*
+ * Wait for any jobs still running, and free everything. Safe to
+ * call at any time after start_deflate(), or more than once.
+ */
+
+void
+end_deflate(
+    void)
+{
+    DEFLATE_JOB *jp;
+    int i;
+
+    for (i = 0; i < DEFLATE_JOBS; ++i) {
+        jp = &ds.job[i];
+#ifdef _PTOT_THREADS_
+        if (jp->started) pthread_join(jp->thread, NULL);
+        jp->started = FALSE;
+#endif
+        if (NULL != jp->in) free(jp->in);
+        if (NULL != jp->head) free(jp->head);
+        if (NULL != jp->prev) free(jp->prev);
+        if (NULL != jp->sym_len) free(jp->sym_len);
+        if (NULL != jp->sym_dist) free(jp->sym_dist);
+        if (NULL != jp->out) free(jp->out);
+    }
+    memset(ds.job, 0, sizeof ds.job);
+    ds.pending = 0;
+}
+
+#ifdef _PTOT_THREADS_
+static void *
+job_thread(
+    void *arg)
+{
+    compress_job((DEFLATE_JOB *)arg);
+    return arg;
+}
+#endif
+
+/*
+ * The job being filled is complete: compress it (on a thread
+ * of its own, if we can), and start the next one with the end
+ * of this one as its dictionary. If every job is busy, wait for
+ * the oldest to finish and pass its output on.
+ */
+
+static int
+start_job(
+    void)
+{
+    DEFLATE_JOB *jp, *np;
+    U32 dict_size;
+    int err;
+
+    jp = &ds.job[ds.next];
+#ifdef _PTOT_THREADS_
+    jp->started = (0 == pthread_create(&jp->thread, NULL,
+      job_thread, jp));
+    if (!jp->started) compress_job(jp);
+#else
+    compress_job(jp);
+#endif
+    ++ds.pending;
+    if (jp->last) return 0;
+
+    ds.next = (ds.next + 1) % DEFLATE_JOBS;
+    if (DEFLATE_JOBS == ds.pending) {
+        if (0 != (err = finish_job())) return err;
+    }
+    /*
+     * Reading the end of a running job's input is safe: the
+     * thread only reads it too.
+     */
+    np = &ds.job[ds.next];
+    dict_size = min(jp->dict_size + jp->in_size, WINDOW_SIZE);
+    memcpy(np->in, jp->in + jp->dict_size + jp->in_size - dict_size,
+      (size_t)dict_size);
+    np->dict_size = dict_size;
+    np->in_size = 0;
+    np->last = FALSE;
+    return 0;
+}
+
+/*
+ * Wait for the oldest job and pass its output on.
+ */
+
+static int
+finish_job(
+    void)
+{
+    DEFLATE_JOB *jp;
+
+    ASSERT(0 != ds.pending);
+
+    jp = &ds.job[ds.oldest];
+    ds.oldest = (ds.oldest + 1) % DEFLATE_JOBS;
+#ifdef _PTOT_THREADS_
+    if (jp->started) pthread_join(jp->thread, NULL);
+    jp->started = FALSE;
+#endif
+    --ds.pending;
+    if (0 != jp->err) return jp->err;
+    return (*ds.put)(jp->out, jp->out_size);
+}
+
+/*
+ * Hash of the three bytes at "p".
+ */
+
+#define HASH(p) ((((U32)(p)[0] << 10) ^ ((U32)(p)[1] << 5) ^ \
+                  (U32)(p)[2]) & (HASH_SIZE - 1))
+
+/*
+ * Compress one job into its output buffer.
+ */
+
+static void
+compress_job(
+    DEFLATE_JOB *jp)
+{
+    U8 *in;
+    S32 pos, end, cand, start, covered;
+    U32 h, nsyms, prev_len, prev_dist, len, dist, chain;
+    int pending_literal;
+
+    in = jp->in;
+    end = (S32)(jp->dict_size + jp->in_size);
+    jp->out_size = 0;
+    jp->bit_buf = 0;
+    jp->bit_count = 0;
+    jp->err = 0;
+
+    for (h = 0; h < HASH_SIZE; ++h) jp->head[h] = -1;
+    for (pos = 0; pos + MIN_MATCH <= (S32)jp->dict_size; ++pos) {
+        h = HASH(in + pos);
+        jp->prev[pos] = jp->head[h];
+        jp->head[h] = pos;
+    }
+    start = covered = pos = (S32)jp->dict_size;
+    nsyms = 0;
+    prev_len = MIN_MATCH - 1;
+    prev_dist = 0;
+    pending_literal = FALSE;
+    /*
+     * Lazy evaluation, as zlib does it: a match found at one
+     * position is only taken if the next position doesn't have a
+     * longer one. Otherwise a literal goes out, and the match at
+     * the next position becomes the one to beat.
+     */
+    while (pos < end) {
+        cand = -1;
+        if (pos + MIN_MATCH <= end) {
+            h = HASH(in + pos);
+            cand = jp->head[h];
+            jp->prev[pos] = cand;
+            jp->head[h] = pos;
+        }
+        len = MIN_MATCH - 1;
+        dist = 0;
+        if (-1 != cand && prev_len < MAX_LAZY) {
+            chain = (prev_len >= GOOD_MATCH) ? MAX_CHAIN / 4 :
+              MAX_CHAIN;
+            len = longest_match(jp, pos, cand, (U32)(end - pos),
+              (int)chain, &dist);
+        }
+        if (prev_len >= MIN_MATCH && len <= prev_len) {
+            /*
+             * Take the match that started at the previous byte,
+             * and put the bytes it covers into the hash chains.
+             */
+            jp->sym_len[nsyms] = (U16)prev_len;
+            jp->sym_dist[nsyms++] = (U16)prev_dist;
+            covered = pos - 1 + (S32)prev_len;
+            for (++pos; pos < covered; ++pos) {
+                if (pos + MIN_MATCH <= end) {
+                    h = HASH(in + pos);
+                    jp->prev[pos] = jp->head[h];
+                    jp->head[h] = pos;
+                }
+            }
+            pending_literal = FALSE;
+            prev_len = MIN_MATCH - 1;
+        } else {
+            if (pending_literal) {
+                jp->sym_len[nsyms] = in[pos - 1];
+                jp->sym_dist[nsyms++] = 0;
+                covered = pos;
+            }
+            pending_literal = TRUE;
+            prev_len = len;
+            prev_dist = dist;
+            ++pos;
+        }
+        if (SYMBOLS == nsyms) {
+            flush_block(jp, nsyms, (U32)start, (U32)covered, FALSE);
+            start = covered;
+            nsyms = 0;
+        }
+    }
+    if (pending_literal) {
+        jp->sym_len[nsyms] = in[pos - 1];
+        jp->sym_dist[nsyms++] = 0;
+        covered = pos;
+    }
+    ASSERT(covered == end);
+    flush_block(jp, nsyms, (U32)start, (U32)end, TRUE);
+}
+
+/*
+ * Follow the hash chain from "cand" for the longest match with
+ * the data at "pos", of at most "limit" bytes. Returns its length,
+ * and its distance in *dist.
+ */
+
+static U32
+longest_match(
+    DEFLATE_JOB *jp,
+    S32 pos,
+    S32 cand,
+    U32 limit,
+    int chain,
+    U32 *dist)
+{
+    U8 *in, *scan, *match;
+    U32 best, len;
+
+    in = jp->in;
+    best = MIN_MATCH - 1;
+    if (limit > MAX_MATCH) limit = MAX_MATCH;
+    if (limit < MIN_MATCH) return best;
+    scan = in + pos;
+
+    while (-1 != cand && pos - cand <= WINDOW_SIZE && 0 != chain--) {
+        match = in + cand;
+        if (match[best] == scan[best] && match[0] == scan[0] &&
+          match[1] == scan[1]) {
+            for (len = 2; len < limit && match[len] == scan[len]; ++len)
+              ;
+            if (len > best) {
+                best = len;
+                *dist = (U32)(pos - cand);
+                if (len >= NICE_MATCH || len == limit) break;
+            }
+        }
+        cand = jp->prev[cand];
+    }
+    return best;
+}
+
+/*
+ * Send a block made of the "nsyms" symbols gathered, which cover
+ * input bytes "from" to "to". "final" means this is the job's
+ * last block, which either ends the stream or is followed by an
+ * empty stored block to align the output.
+ */
+
+static void
+flush_block(
+    DEFLATE_JOB *jp,
+    U32 nsyms,
+    U32 from,
+    U32 to,
+    int final)
+{
+    U32 lit_freq[LITERALS], dist_freq[DISTANCES], cl_freq[CODE_LENGTHS];
+    U8 lit_len[LITERALS], dist_len[DISTANCES], cl_len[CODE_LENGTHS];
+    U16 lit_codes[LITERALS], dist_codes[DISTANCES];
+    U16 cl_codes[CODE_LENGTHS];
+    U8 cl_syms[LITERALS + DISTANCES];
+    U8 cl_extra_bits[LITERALS + DISTANCES];
+    U32 i, dyn_bits, fixed_bits, stored_bits, len, n, extra;
+    int hlit, hdist, hclen, ncl, last;
+    U8 header[4];
+
+    if (0 != jp->err) return;
+    last = final && jp->last;
+    /*
+     * The block will be no bigger than storing it would be.
+     */
+    if (0 != grow_output(jp, (to - from) + 5 * ((to - from) / 65535 +
+      2) + 8)) return;
+
+    memset(lit_freq, 0, sizeof lit_freq);
+    memset(dist_freq, 0, sizeof dist_freq);
+    extra = 0;
+    for (i = 0; i < nsyms; ++i) {
+        if (0 == jp->sym_dist[i]) ++lit_freq[jp->sym_len[i]];
+        else {
+            n = length_code[jp->sym_len[i]];
+            ++lit_freq[257 + n];
+            extra += length_extra[n];
+            n = DIST_CODE(jp->sym_dist[i]);
+            ++dist_freq[n];
+            extra += dist_extra[n];
+        }
+    }
+    lit_freq[END_BLOCK] = 1;
+    /*
+     * Give the distance code something to describe, even if
+     * there are no matches: not every decoder takes an empty one.
+     */
+    for (i = 0, n = 0; i < DISTANCES; ++i) n += dist_freq[i];
+    if (0 == n) dist_freq[0] = 1;
+    build_lengths(lit_freq, LITERALS, 15, lit_len);
+    build_lengths(dist_freq, DISTANCES, 15, dist_len);
+
+    for (hlit = LITERALS; hlit > 257 && 0 == lit_len[hlit - 1]; --hlit)
+      ;
+    for (hdist = DISTANCES; hdist > 1 && 0 == dist_len[hdist - 1];
+      --hdist)
+      ;
+    ncl = make_code_lengths(lit_len, hlit, dist_len, hdist, cl_syms,
+      cl_extra_bits);
+    memset(cl_freq, 0, sizeof cl_freq);
+    for (i = 0; i < (U32)ncl; ++i) ++cl_freq[cl_syms[i]];
+    build_lengths(cl_freq, CODE_LENGTHS, 7, cl_len);
+    for (hclen = CODE_LENGTHS; hclen > 4 &&
+      0 == cl_len[cl_order[hclen - 1]]; --hclen)
+      ;
+    /*
+     * Work out the size each way. A distance we forced in above
+     * is counted once but never sent, which makes no difference
+     * worth worrying about.
+     */
+    dyn_bits = 3 + 14 + 3 * hclen + extra;
+    for (i = 0; i < CODE_LENGTHS; ++i)
+      dyn_bits += cl_freq[i] * (cl_len[i] + cl_extra[i]);
+    for (i = 0; i < LITERALS; ++i) dyn_bits += lit_freq[i] * lit_len[i];
+    for (i = 0; i < DISTANCES; ++i)
+      dyn_bits += dist_freq[i] * dist_len[i];
+
+    fixed_bits = 3 + extra;
+    for (i = 0; i < LITERALS; ++i)
+      fixed_bits += lit_freq[i] * fixed_lit_len[i];
+    for (i = 0; i < DISTANCES; ++i) fixed_bits += dist_freq[i] * 5;
+
+    stored_bits = 0;
+    for (i = from, n = 0; i < to || 0 == n; i += len, ++n) {
+        len = min(to - i, 65535);
+        stored_bits += 3 + 7 + 32 + 8 * len;
+    }
+
+    if (stored_bits <= dyn_bits && stored_bits <= fixed_bits &&
+      to > from) {
+        for (i = from; i < to; i += len) {
+            len = min(to - i, 65535);
+            put_bits(jp, (last && i + len == to) ? 1 : 0, 3);
+            align_bits(jp);
+            LE_PUT16(header, (U16)len);
+            LE_PUT16(header + 2, (U16)~len);
+            memcpy(jp->out + jp->out_size, header, 4);
+            memcpy(jp->out + jp->out_size + 4, jp->in + i, (size_t)len);
+            jp->out_size += 4 + len;
+        }
+    } else if (fixed_bits <= dyn_bits) {
+        put_bits(jp, (last ? 1 : 0) | (1 << 1), 3);
+        send_symbols(jp, nsyms, fixed_lit_len, fixed_lit_code,
+          fixed_dist_len, fixed_dist_code);
+    } else {
+        make_codes(lit_len, LITERALS, lit_codes);
+        make_codes(dist_len, DISTANCES, dist_codes);
+        make_codes(cl_len, CODE_LENGTHS, cl_codes);
+
+        put_bits(jp, (last ? 1 : 0) | (2 << 1), 3);
+        put_bits(jp, hlit - 257, 5);
+        put_bits(jp, hdist - 1, 5);
+        put_bits(jp, hclen - 4, 4);
+        for (i = 0; i < (U32)hclen; ++i)
+          put_bits(jp, cl_len[cl_order[i]], 3);
+        for (i = 0; i < (U32)ncl; ++i) {
+            put_bits(jp, cl_codes[cl_syms[i]], cl_len[cl_syms[i]]);
+            if (0 != cl_extra[cl_syms[i]])
+              put_bits(jp, cl_extra_bits[i], cl_extra[cl_syms[i]]);
+        }
+        send_symbols(jp, nsyms, lit_len, lit_codes, dist_len,
+          dist_codes);
+    }
+    if (!final) return;
+    /*
+     * End the job on a byte boundary: with an empty stored block,
+     * unless the stream ends here.
+     */
+    if (!last) {
+        put_bits(jp, 0, 3);
+        align_bits(jp);
+        memcpy(jp->out + jp->out_size, "\000\000\377\377", 4);
+        jp->out_size += 4;
+    } else align_bits(jp);
+}
+
+/*
+ * Send the block's symbols with the given codes, and its end.
+ */
+
+static void
+send_symbols(
+    DEFLATE_JOB *jp,
+    U32 nsyms,
+    U8 *lit_len,
+    U16 *lit_code,
+    U8 *dist_len,
+    U16 *dist_codes)
+{
+    U32 i, len, dist;
+    int code;
+
+    for (i = 0; i < nsyms; ++i) {
+        len = jp->sym_len[i];
+        dist = jp->sym_dist[i];
+        if (0 == dist) {
+            put_bits(jp, lit_code[len], lit_len[len]);
+            continue;
+        }
+        code = length_code[len];
+        put_bits(jp, lit_code[257 + code], lit_len[257 + code]);
+        if (0 != length_extra[code])
+          put_bits(jp, len - length_base[code], length_extra[code]);
+        code = DIST_CODE(dist);
+        put_bits(jp, dist_codes[code], dist_len[code]);
+        if (0 != dist_extra[code])
+          put_bits(jp, dist - dist_base[code], dist_extra[code]);
+    }
+    put_bits(jp, lit_code[END_BLOCK], lit_len[END_BLOCK]);
+}
+
+/*
+ * Huffman code lengths for the given symbol counts, none longer
+ * than "limit" bits. If the best code is too deep, the counts
+ * are halved (keeping every used symbol at 1 or more) and it is
+ * built again; that flattens the tree, and it costs little.
+ * Ties are broken by position, so the result never varies.
+ */
+
+static void
+build_lengths(
+    U32 *freq,
+    int count,
+    int limit,
+    U8 *lengths)
+{
+    U32 weight[2 * LITERALS], f[LITERALS];
+    int parent[2 * LITERALS], depth[2 * LITERALS];
+    int symbol[LITERALS], live[2 * LITERALS];
+    int leaves, nodes, i, a, b, deepest;
+
+    ASSERT(count <= LITERALS);
+
+    for (i = 0; i < count; ++i) f[i] = freq[i];
+    memset(lengths, 0, (size_t)count);
+
+    for (;;) {
+        leaves = 0;
+        for (i = 0; i < count; ++i) {
+            if (0 == f[i]) continue;
+            weight[leaves] = f[i];
+            symbol[leaves] = i;
+            live[leaves++] = TRUE;
+        }
+        if (0 == leaves) return;
+        /*
+         * A lone symbol gets a partner, so that the code is
+         * complete, which decoders insist on.
+         */
+        if (1 == leaves) {
+            lengths[symbol[0]] = 1;
+            lengths[(0 == symbol[0]) ? 1 : 0] = 1;
+            return;
+        }
+        for (nodes = leaves; nodes < 2 * leaves - 1; ++nodes) {
+            a = b = -1;
+            for (i = 0; i < nodes; ++i) {
+                if (!live[i]) continue;
+                if (-1 == a || weight[i] < weight[a]) {
+                    b = a;
+                    a = i;
+                } else if (-1 == b || weight[i] < weight[b]) b = i;
+            }
+            weight[nodes] = weight[a] + weight[b];
+            parent[a] = parent[b] = nodes;
+            live[a] = live[b] = FALSE;
+            live[nodes] = TRUE;
+        }
+        depth[nodes - 1] = 0;
+        deepest = 0;
+        for (i = nodes - 2; i >= 0; --i) {
+            depth[i] = depth[parent[i]] + 1;
+            if (i < leaves && depth[i] > deepest) deepest = depth[i];
+        }
+        if (deepest <= limit) break;
+
+        for (i = 0; i < count; ++i) {
+            if (0 != f[i]) f[i] = (f[i] + 1) / 2;
+        }
+    }
+    for (i = 0; i < leaves; ++i) lengths[symbol[i]] = (U8)depth[i];
+}
+
+/*
+ * Canonical codes for the given lengths, bit-reversed, since
+ * deflate sends Huffman codes starting from the top bit.
+ */
+
+static void
+make_codes(
+    U8 *lengths,
+    int count,
+    U16 *codes)
+{
+    U16 bl_count[16], next_code[16];
+    U32 code, reversed;
+    int i, bits;
+
+    memset(bl_count, 0, sizeof bl_count);
+    for (i = 0; i < count; ++i) ++bl_count[lengths[i]];
+    bl_count[0] = 0;
+
+    code = 0;
+    for (bits = 1; bits < 16; ++bits) {
+        code = (code + bl_count[bits - 1]) << 1;
+        next_code[bits] = (U16)code;
+    }
+    for (i = 0; i < count; ++i) {
+        if (0 == lengths[i]) {
+            codes[i] = 0;
+            continue;
+        }
+        code = next_code[lengths[i]]++;
+        reversed = 0;
+        for (bits = 0; bits < lengths[i]; ++bits) {
+            reversed = (reversed << 1) | (code & 1);
+            code >>= 1;
+        }
+        codes[i] = (U16)reversed;
+    }
+}
+
+/*
+ * Run-length code the literal and distance code lengths, as the
+ * dynamic block header has them. Returns the number of symbols,
+ * with each one's extra bits in "extra".
+ */
+
+static int
+make_code_lengths(
+    U8 *lit_len,
+    int hlit,
+    U8 *dist_len,
+    int hdist,
+    U8 *syms,
+    U8 *extra)
+{
+    U8 all[LITERALS + DISTANCES];
+    int total, i, run, n, count;
+
+    memcpy(all, lit_len, (size_t)hlit);
+    memcpy(all + hlit, dist_len, (size_t)hdist);
+    total = hlit + hdist;
+
+    n = 0;
+    for (i = 0; i < total; i += run) {
+        for (run = 1; i + run < total && all[i + run] == all[i]; ++run)
+          ;
+        if (0 == all[i] && run >= 3) {
+            count = min(run, 138);
+            if (count <= 10) {
+                syms[n] = 17;
+                extra[n++] = (U8)(count - 3);
+            } else {
+                syms[n] = 18;
+                extra[n++] = (U8)(count - 11);
+            }
+            run = count;
+        } else if (0 != all[i] && run >= 4) {
+            count = min(run - 1, 6);
+            syms[n] = all[i];
+            extra[n++] = 0;
+            syms[n] = 16;
+            extra[n++] = (U8)(count - 3);
+            run = count + 1;
+        } else {
+            syms[n] = all[i];
+            extra[n++] = 0;
+            run = 1;
+        }
+    }
+    return n;
+}
+
+/*
+ * Bits go out least significant first.
+ */
+
+static void
+put_bits(
+    DEFLATE_JOB *jp,
+    U32 value,
+    int count)
+{
+    jp->bit_buf |= value << jp->bit_count;
+    jp->bit_count += count;
+    while (jp->bit_count >= 8) {
+        jp->out[jp->out_size++] = (U8)jp->bit_buf;
+        jp->bit_buf >>= 8;
+        jp->bit_count -= 8;
+    }
+}
+
+static void
+align_bits(
+    DEFLATE_JOB *jp)
+{
+    if (0 != jp->bit_count) {
+        jp->out[jp->out_size++] = (U8)jp->bit_buf;
+    }
+    jp->bit_buf = 0;
+    jp->bit_count = 0;
+}
+
+/*
+ * Make room for "bytes" more bytes of output.
+ */
+
+static int
+grow_output(
+    DEFLATE_JOB *jp,
+    U32 bytes)
+{
+    U32 new_alloc;
+    U8 *new_out;
+
+    if (jp->out_size + bytes <= jp->out_alloc) return 0;
+
+    new_alloc = (0 == jp->out_alloc) ? 65536L : jp->out_alloc;
+    while (new_alloc < jp->out_size + bytes) new_alloc *= 2;
+    if (NULL == (new_out = (U8 *)realloc(jp->out, (size_t)new_alloc)))
+      return (jp->err = ERR_MEMORY);
+    jp->out = new_out;
+    jp->out_alloc = new_alloc;
+    return 0;
+}
+
+/*
+ * End of deflate.c
+ */
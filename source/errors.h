@@ -29,7 +29,7 @@ typedef enum {
 #endif /* DEFINE_ENUMS */
 
 ASSOCIATE( ERR_ASSERT,      "Assertion failure or internal error")
-ASSOCIATE( ERR_USAGE,       "Usage: ptot filename[.png]")
+ASSOCIATE( ERR_USAGE,       "Usage: ptot [options] filename[.png]")
 ASSOCIATE( ERR_MEMORY,      "Could not allocate memory")
 ASSOCIATE( ERR_READ,        "Failure reading input file")
 ASSOCIATE( ERR_WRITE,       "Failure writing output file")
@@ -40,6 +40,10 @@ ASSOCIATE( ERR_NO_IDAT,     "No image data found")
 ASSOCIATE( ERR_COMP_HDR,    "Input PNG has invalid compression header")
 ASSOCIATE( ERR_EARLY_EOI,   "Incomplete IDAT on input")
 ASSOCIATE( ERR_INFLATE,     "Decompression failure")
+ASSOCIATE( ERR_CROP,        "Crop rectangle lies outside image")
+ASSOCIATE( ERR_TOO_BIG,     "Image too large to convert")
+ASSOCIATE( ERR_STOPPED,     "Decoding stopped by caller")
+ASSOCIATE( ERR_BAD_TIFF,    "Input TIFF file is incorrect or unsupported")
 ASSOCIATE( WARN_BAD_CRC,    "Input PNG file failed CRC check")
 ASSOCIATE( WARN_BAD_SUM,    "Uncompressed image data failed sum check")
 ASSOCIATE( WARN_BAD_PNG,    "Invalid (but recoverable) PNG file")
@@ -52,6 +56,12 @@ ASSOCIATE( WARN_MULTI_PLTE, "More than one palette present")
 ASSOCIATE( WARN_MULTI_TRNS, "More than one transparency chunk present")
 ASSOCIATE( WARN_FILTER,     "Unknown prediction filter in input PNG")
 ASSOCIATE( WARN_BAD_VAL,    "Unknown value in PNG chunk")
+ASSOCIATE( WARN_NO_GAMA,    "No gAMA chunk, gamma not applied")
+ASSOCIATE( WARN_FRAMES,     "Animation frames after the first ignored")
+ASSOCIATE( WARN_BIG_TEXT,   "Text chunk too long, truncated")
+ASSOCIATE( WARN_NO_INDEX,   "Index not usable for this image, ignored")
+ASSOCIATE( WARN_NO_CACHE,   "Could not store output in cache directory")
+ASSOCIATE( WARN_PAGES,      "Pages after the first in TIFF file ignored")
 
 #ifdef DEFINE_ENUMS
 
@@ -0,0 +1,459 @@
+/*
+ * index.c
+ *
+ * Random access into the image data of big PNGs. With
+ * --build-index, a full decode also writes an index file of
+ * checkpoints: every so many rows, at the next deflate block
+ * boundary, we save everything needed to carry on decoding from
+ * that point--the file offset and leftover bits of the
+ * compressed data, inflate's 32K window, and the unfilter's
+ * place in the scanlines. A later decode given the index with
+ * --index and cropped with --crop starts from the last
+ * checkpoint above the crop window, rather than inflating
+ * everything before it again.
+ *
+ * Only non-interlaced images are indexed (interlace passes
+ * spread every row through the whole data stream), and only the
+ * main image, not APNG frames. The input must be seekable.
+ *
+ * The index file is all big-endian. It starts with a header
+ * describing the image, followed by checkpoints in row order,
+ * each a fixed part followed by the window and the two lines.
+ * The header has a fingerprint of the whole PNG, as made for
+ * the cache key, so an index is only used with the file it was
+ * built from; and each checkpoint has a CRC, so a damaged one
+ * is not used either. If inflate still fails after starting from
+ * a checkpoint, we warn and decode again from the start.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ptot.h"
+
+#define DEFINE_ENUMS
+#include "errors.h"
+
+extern PNG_STATE ps;
+
+extern unsigned wp;         /* inflate.c's decoder state */
+extern ulg bb;
+extern unsigned bk;
+
+#define INDEX_MAGIC     "PTIX"
+#define INDEX_VERSION   2
+#define HEADER_SIZE     56
+#define ENTRY_SIZE      40
+
+static void put_offset(U8 *, long);
+static long get_offset(U8 *);
+static void make_header(U8 *);
+static int read_index(FILE *);
+static int find_checkpoint(FILE *);
+static int restore_checkpoint(FILE *, U8 *);
+static U32 checkpoint_crc(U8 *);
+
+static struct _index_state {
+    FILE *fp;               /* Index being written */
+    int err;                /* First write error, if any */
+    long start;             /* Offset of first deflate byte */
+    U32 start_left;         /* Bytes left in its IDAT */
+    U32 span;               /* Rows between checkpoints */
+    U32 next_row;           /* Row due a checkpoint */
+    int resume;             /* Decoder state waiting in ... */
+    unsigned wp, bk;        /* ... these, for resume_inflate() */
+    ulg bb;
+    int resumed;            /* Decoding from a checkpoint */
+} ix;
+
+/*
+ * Fingerprint of the PNG being converted, from index_source().
+ * It is kept apart from "ix", which start_index() clears.
+ */
+
+static struct _index_source {
+    U32 crc, hash;
+    long size;
+} source;
+
+/*
+ * File offsets can pass 4GB, so they are stored as two words.
+ * The shifts are split so they are not by the full width of a
+ * 32-bit long.
+ */
+
+static void
+put_offset(
+    U8 *p,
+    long offset)
+{
+    BE_PUT32(p, (U32)((offset >> 16) >> 16));
+    BE_PUT32(p + 4, (U32)(offset & 0xFFFFFFFFL));
+}
+
+static long
+get_offset(
+    U8 *p)
+{
+    return (((long)BE_GET32(p) << 16) << 16) | (long)BE_GET32(p + 4);
+}
+
+/*
+ * Fingerprint the PNG file "infname", which is about to be
+ * converted with --build-index or --index.
+ */
+
+int
+index_source(
+    char *infname)
+{
+    int err;
+
+    ASSERT(NULL != infname);
+
+    source.crc = 0xFFFFFFFFL;
+    source.hash = 0x811C9DC5L;
+    err = png_fingerprint(infname, &source.crc, &source.hash,
+      &source.size);
+    source.crc ^= 0xFFFFFFFFL;
+    return err;
+}
+
+/*
+ * The header identifies the image an index belongs to: its
+ * dimensions and layout, where its compressed data starts, and
+ * the fingerprint of the file.
+ */
+
+static void
+make_header(
+    U8 *header)
+{
+    memset(header, 0, HEADER_SIZE);
+    memcpy(header, INDEX_MAGIC, 4);
+    BE_PUT32(header + 4, INDEX_VERSION);
+    BE_PUT32(header + 8, ps.image->width);
+    BE_PUT32(header + 12, ps.image->height);
+    header[16] = (U8)ps.image->bits_per_sample;
+    header[17] = (U8)ps.image->samples_per_pixel;
+    header[18] = (U8)ps.image->is_palette;
+    put_offset(header + 20, ix.start);
+    BE_PUT32(header + 28, ix.start_left);
+    BE_PUT32(header + 32, ps.inflate_window_size);
+    BE_PUT32(header + 36, (U32)ps.line_size);
+    put_offset(header + 40, source.size);
+    BE_PUT32(header + 48, source.crc);
+    BE_PUT32(header + 52, source.hash);
+}
+
+/*
+ * CRC of a checkpoint: its fixed part, less the CRC itself, and
+ * the window and lines, which must be in place already.
+ */
+
+static U32
+checkpoint_crc(
+    U8 *entry)
+{
+    U32 crc;
+
+    crc = update_crc(0xFFFFFFFFL, entry, ENTRY_SIZE - 4);
+    crc = update_crc(crc, ps.inflate_window,
+      (U32)ps.inflate_window_size);
+    crc = update_crc(crc, ps.last_line, (U32)ps.line_size);
+    crc = update_crc(crc, ps.this_line, (U32)ps.line_size);
+    return crc ^ 0xFFFFFFFFL;
+}
+
+/*
+ * Called by decode_IDAT() once the zlib header has been read.
+ * Starts a new index for --build-index, or for --index moves
+ * the input and decoder on to the best checkpoint for the crop
+ * window. An index that can't be used is only worth a warning,
+ * since we can always decode from the start instead.
+ */
+
+int
+start_index(
+    void)
+{
+    U8 header[HEADER_SIZE];
+    FILE *fp;
+    int err;
+
+    memset(&ix, 0, sizeof ix);
+    if (NULL != ps.frame) return 0;
+    if (NULL == opts.build_index && NULL == opts.use_index) return 0;
+
+    if (ps.image->is_interlaced || -1L == input_offset()) {
+        print_warning(WARN_NO_INDEX);
+        return 0;
+    }
+    ix.start = input_offset() - ps.bytes_in_buf;
+    ix.start_left = ps.bytes_remaining + ps.bytes_in_buf;
+
+    if (NULL != opts.build_index) {
+        ix.span = opts.index_rows;
+        if (0 == ix.span)
+          ix.span = max(1, DEFAULT_INDEX_SPAN / ps.line_size);
+        ix.next_row = ix.span;
+        /*
+         * The window is saved whole, so make sure there's
+         * nothing uninitialized in it.
+         */
+        memset(ps.inflate_window, 0, (size_t)ps.inflate_window_size);
+
+        if (NULL == (ix.fp = fopen(opts.build_index, "wb")))
+          return ERR_WRITE;
+        make_header(header);
+        if (HEADER_SIZE != fwrite(header, 1, HEADER_SIZE, ix.fp))
+          ix.err = ERR_WRITE;
+        return ix.err;
+    }
+    /*
+     * Nothing to gain unless rows at the top are to be skipped.
+     */
+    if (!ps.cropping || 0 == ps.crop_y) return 0;
+
+    if (NULL == (fp = fopen(opts.use_index, "rb"))) {
+        print_warning(WARN_NO_INDEX);
+        return 0;
+    }
+    err = read_index(fp);
+    fclose(fp);
+    return err;
+}
+
+/*
+ * Check that the index is for this image, and resume from the
+ * best checkpoint in it, if there is one.
+ */
+
+static int
+read_index(
+    FILE *fp)
+{
+    U8 header[HEADER_SIZE], expected[HEADER_SIZE];
+
+    make_header(expected);
+    if (HEADER_SIZE != fread(header, 1, HEADER_SIZE, fp) ||
+      0 != memcmp(header, expected, HEADER_SIZE)) {
+        print_warning(WARN_NO_INDEX);
+        return 0;
+    }
+    return find_checkpoint(fp);
+}
+
+/*
+ * Checkpoints are in row order, so the one we want is the last
+ * one at or above the first row of the crop window. Only their
+ * fixed parts are read on the way; the rest is skipped.
+ */
+
+static int
+find_checkpoint(
+    FILE *fp)
+{
+    U8 entry[ENTRY_SIZE], best[ENTRY_SIZE];
+    long data_size, best_pos;
+
+    data_size = (long)ps.inflate_window_size + 2 * (long)ps.line_size;
+    best_pos = -1L;
+
+    while (ENTRY_SIZE == fread(entry, 1, ENTRY_SIZE, fp)) {
+        if (BE_GET32(entry) > ps.crop_y) break;
+
+        memcpy(best, entry, ENTRY_SIZE);
+        if (-1L == (best_pos = ftell(fp))) return 0;
+        if (0 != fseek(fp, data_size, SEEK_CUR)) break;
+    }
+    if (-1L == best_pos) return 0;
+    if (0 != fseek(fp, best_pos, SEEK_SET)) return 0;
+    return restore_checkpoint(fp, best);
+}
+
+/*
+ * Move the input on to the checkpoint's place in the compressed
+ * data, and put the decoder back the way it was there. The
+ * checkpoint may be in the part of the IDAT already buffered;
+ * if not, we skip ahead in the file, and can't check the CRC of
+ * the IDAT we land in.
+ */
+
+static int
+restore_checkpoint(
+    FILE *fp,
+    U8 *entry)
+{
+    long offset, next, skip;
+    U32 left, bytes;
+
+    ASSERT(NULL != ps.inflate_window);
+    ASSERT(NULL != ps.this_line && NULL != ps.last_line);
+
+    offset = get_offset(entry + 4);
+    left = BE_GET32(entry + 12);
+    next = input_offset() - ps.bytes_in_buf;
+    if (offset < next || BE_GET16(entry + 20) > 32 ||
+      (BE_GET16(entry + 22) > 4 && BE_GET16(entry + 22) != 255) ||
+      BE_GET32(entry + 24) >= ps.inflate_window_size ||
+      BE_GET32(entry + 32) >= ps.line_size) {
+        print_warning(WARN_NO_INDEX);
+        return 0;
+    }
+    /*
+     * Read the saved window and lines before moving the input.
+     * If the index is cut short or damaged, the lines go back to
+     * the zeros a decode from the start needs; the window doesn't
+     * matter.
+     */
+    if (ps.inflate_window_size != fread(ps.inflate_window, 1,
+      (size_t)ps.inflate_window_size, fp) ||
+      ps.line_size != fread(ps.last_line, 1, ps.line_size, fp) ||
+      ps.line_size != fread(ps.this_line, 1, ps.line_size, fp) ||
+      checkpoint_crc(entry) != BE_GET32(entry + 36)) {
+        memset(ps.last_line, 0, ps.line_size);
+        memset(ps.this_line, 0, ps.line_size);
+        print_warning(WARN_NO_INDEX);
+        return 0;
+    }
+    if (offset - next <= (long)ps.bytes_in_buf) {
+        bytes = (U32)(offset - next);
+        ps.bufp += bytes;
+        ps.bytes_in_buf -= bytes;
+    } else {
+        for (skip = offset - input_offset(); skip > 0; skip -= bytes) {
+            bytes = (U32)min(skip, 0x40000000L);
+            if (0 != skip_input(bytes)) return ERR_READ;
+        }
+        ps.bytes_in_buf = 0;
+        ps.bytes_remaining = left;
+        ps.skip_crc = TRUE;
+    }
+    ps.current_row = BE_GET32(entry);
+    ps.cur_filter = BE_GET16(entry + 22);
+    ps.sum1 = BE_GET16(entry + 28);
+    ps.sum2 = BE_GET16(entry + 30);
+    ps.line_x = BE_GET32(entry + 32);
+
+    ix.bb = BE_GET32(entry + 16);
+    ix.bk = BE_GET16(entry + 20);
+    ix.wp = BE_GET32(entry + 24);
+    ix.resume = ix.resumed = TRUE;
+    return 0;
+}
+
+/*
+ * Called from inflate() in place of starting with an empty
+ * window, to pick up the checkpoint restored above.
+ */
+
+void
+resume_inflate(
+    void)
+{
+    if (!ix.resume) return;
+
+    wp = ix.wp;
+    bb = ix.bb;
+    bk = ix.bk;
+    ix.resume = FALSE;
+}
+
+/*
+ * Called from inflate() between blocks. If enough rows have
+ * gone by since the last checkpoint, save another. Whatever is
+ * in the window past wp hasn't been through flush_window() yet,
+ * and the saved row state is from before it, so a resumed
+ * decode flushes it just as this one will.
+ */
+
+void
+checkpoint_inflate(
+    void)
+{
+    U8 entry[ENTRY_SIZE];
+
+    if (NULL == ix.fp || 0 != ix.err) return;
+    if (ps.current_row < ix.next_row || bk > 32) return;
+
+    ix.next_row = ps.current_row + ix.span;
+
+    memset(entry, 0, ENTRY_SIZE);
+    BE_PUT32(entry, ps.current_row);
+    put_offset(entry + 4, input_offset() - ps.bytes_in_buf);
+    BE_PUT32(entry + 12, ps.bytes_remaining + ps.bytes_in_buf);
+    BE_PUT32(entry + 16, (U32)bb);
+    BE_PUT16(entry + 20, (U16)bk);
+    BE_PUT16(entry + 22, (U16)ps.cur_filter);
+    BE_PUT32(entry + 24, wp);
+    BE_PUT16(entry + 28, ps.sum1);
+    BE_PUT16(entry + 30, ps.sum2);
+    BE_PUT32(entry + 32, (U32)ps.line_x);
+    BE_PUT32(entry + 36, checkpoint_crc(entry));
+
+    if (ENTRY_SIZE != fwrite(entry, 1, ENTRY_SIZE, ix.fp) ||
+      ps.inflate_window_size != fwrite(ps.inflate_window, 1,
+      (size_t)ps.inflate_window_size, ix.fp) ||
+      ps.line_size != fwrite(ps.last_line, 1, ps.line_size, ix.fp) ||
+      ps.line_size != fwrite(ps.this_line, 1, ps.line_size, ix.fp))
+      ix.err = ERR_WRITE;
+}
+
+/*
+ * Called by decode_IDAT() when inflate fails. If we started
+ * from a checkpoint, the index is the likely culprit (a file can
+ * be changed without changing its fingerprint), so warn, and go
+ * back to decode from the start. Returns FALSE, leaving inflate's
+ * error to stand, if we didn't start from a checkpoint or can't
+ * go back.
+ */
+
+int
+restart_index(
+    void)
+{
+    if (!ix.resumed) return FALSE;
+    ix.resumed = ix.resume = FALSE;
+    print_warning(WARN_NO_INDEX);
+
+    if (0 != seek_input(ix.start) ||
+      0 != fseek(ps.tf[0], 0L, SEEK_SET)) return FALSE;
+    ps.bytes_in_buf = 0;
+    ps.bufp = ps.buf;
+    ps.bytes_remaining = ix.start_left;
+    ps.skip_crc = TRUE;
+
+    ps.current_row = 0;
+    ps.line_x = 0;
+    ps.cur_filter = 255;
+    ps.sum1 = 1;
+    ps.sum2 = 0;
+    ps.stop_inflate = FALSE;
+    ps.decode_err = 0;
+    memset(ps.last_line, 0, ps.line_size);
+    memset(ps.this_line, 0, ps.line_size);
+    return TRUE;
+}
+
+/*
+ * Finish the index, if we were writing one. Returns ERR_WRITE
+ * if any of it failed to be written.
+ */
+
+int
+end_index(
+    void)
+{
+    int err;
+
+    err = ix.err;
+    if (NULL != ix.fp && 0 != fclose(ix.fp)) err = ERR_WRITE;
+    memset(&ix, 0, sizeof ix);
+    return err;
+}
+
+/*
+ * End of index.c
+ */
@@ -211,6 +211,16 @@
 /* Warning: the fwrite above might not work on 16-bit compilers, since
    0x8000 might be interpreted as -32,768 by the library function. */
 
+/* CHECKPOINT is done between blocks, when the only decoder state is
+   slide[], wp, bb and bk, and RESUME before the first block, where it
+   may put back state saved earlier (ptot uses these for its index). */
+#ifndef CHECKPOINT
+#  define CHECKPOINT {}
+#endif
+#ifndef RESUME
+#  define RESUME {}
+#endif
+
 #ifndef Trace
 #  ifdef DEBUG
 #    define Trace(x) fprintf x
@@ -972,7 +982,11 @@ int inflate_dynamic()
 
   /* decompress until an end-of-block code */
   if (inflate_codes(tl, td, bl, bd))
+  {
+    huft_free(tl);              /* FLUSH() may stop us early (ptot) */
+    huft_free(td);
     return 1;
+  }
 
 
   /* free the decoding tables, return */
@@ -1041,16 +1055,22 @@ int inflate()
   wp = 0;
   bk = 0;
   bb = 0;
+  RESUME
 
 
   /* decompress until the last block */
   h = 0;
   do {
     hufts = 0;
-    if ((r = inflate_block(&e)) != 0)
+    TRACE_BEGIN(TRACE_INFLATE_BLOCK, 0);
+    r = inflate_block(&e);
+    TRACE_END(TRACE_INFLATE_BLOCK);
+    if (r != 0)
       return r;
     if (hufts > h)
       h = hufts;
+    if (!e)
+      CHECKPOINT
   } while (!e);
 
 
@@ -0,0 +1,409 @@
+/*
+ * input.c
+ *
+ * Buffered input for the PNG reader. Everything read from the
+ * input file goes through here, in large blocks rather than
+ * the 8k that the chunk code asks for at a time, and fill_buf()
+ * can decode straight out of a block without copying it.
+ *
+ * If compiled with _PTOT_THREADS_ defined (and POSIX threads
+ * available), a second thread reads ahead into a ring of
+ * blocks while the decoder works on the ones already read, so
+ * that waiting on a slow disk, network file system or pipe
+ * overlaps with decompression. Otherwise blocks are read when
+ * they are needed.
+ *
+ * Input can also come from memory (see open_input_memory()), in
+ * which case the whole buffer is one block.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _PTOT_THREADS_
+#  include <pthread.h>
+#endif
+
+#include "ptot.h"
+
+#define DEFINE_ENUMS
+#include "errors.h"
+
+/*
+ * A block must fit in a size_t, which is 16 bits in the DOS
+ * large model.
+ */
+
+#if UINT_MAX == 0xFFFF
+#  define INPUT_BLOCK_SIZE 32768L
+#else
+#  define INPUT_BLOCK_SIZE 65536L
+#endif
+
+#ifdef _PTOT_THREADS_
+#  define INPUT_BLOCKS 4
+#else
+#  define INPUT_BLOCKS 1
+#endif
+
+static int next_block(void);
+
+static struct _input_state {
+    FILE *inf;
+    long start;             /* File offset of block 0, -1 if unknown */
+    long consumed;          /* Bytes handed out so far */
+    U8 *data[INPUT_BLOCKS];
+    size_t count[INPUT_BLOCKS];
+    int current;            /* Block being consumed */
+    int have_block;
+    size_t pos;             /* Next byte in current block */
+    int eof;
+    int in_memory;          /* Reading from a caller's buffer */
+#ifdef _PTOT_THREADS_
+    pthread_t reader;
+    pthread_mutex_t lock;
+    pthread_cond_t filled_cv, freed_cv;
+    int filled;             /* Blocks read and not yet released */
+    int stop;
+    int running;
+#endif
+} is;
+
+#ifdef _PTOT_THREADS_
+
+/*
+ * The reader thread. It fills blocks in ring order, as long as
+ * there is one free, until it reaches end of file or is told
+ * to stop. Block contents are only touched by one side at a
+ * time: the reader owns blocks not counted in "filled".
+ */
+
+static void *
+reader_thread(
+    void *arg)
+{
+    int block;
+    size_t count;
+
+    pthread_mutex_lock(&is.lock);
+    while (!is.stop && !is.eof) {
+        while (INPUT_BLOCKS == is.filled && !is.stop)
+          pthread_cond_wait(&is.freed_cv, &is.lock);
+        if (is.stop) break;
+
+        block = (is.current + is.filled) % INPUT_BLOCKS;
+        pthread_mutex_unlock(&is.lock);
+
+        TRACE_BEGIN(TRACE_READ_BLOCK, 0);
+        count = fread(is.data[block], 1, (size_t)INPUT_BLOCK_SIZE,
+          is.inf);
+        TRACE_END(TRACE_READ_BLOCK);
+
+        pthread_mutex_lock(&is.lock);
+        is.count[block] = count;
+        ++is.filled;
+        if (count < (size_t)INPUT_BLOCK_SIZE) is.eof = TRUE;
+        pthread_cond_signal(&is.filled_cv);
+    }
+    pthread_mutex_unlock(&is.lock);
+    return arg;
+}
+
+static int
+start_reader(
+    void)
+{
+    is.stop = FALSE;
+    if (0 != pthread_create(&is.reader, NULL, reader_thread, NULL))
+      return ERR_MEMORY;
+    is.running = TRUE;
+    return 0;
+}
+
+static void
+stop_reader(
+    void)
+{
+    if (!is.running) return;
+
+    pthread_mutex_lock(&is.lock);
+    is.stop = TRUE;
+    pthread_cond_signal(&is.freed_cv);
+    pthread_mutex_unlock(&is.lock);
+
+    pthread_join(is.reader, NULL);
+    is.running = FALSE;
+}
+
+#endif /* _PTOT_THREADS_ */
+
+/*
+ * Start reading from the given file, which should be positioned
+ * at the start of the PNG.
+ */
+
+int
+open_input(
+    FILE *inf)
+{
+    int block;
+
+    ASSERT(NULL != inf);
+
+    memset(&is, 0, sizeof is);
+    is.inf = inf;
+    is.start = ftell(inf);
+#ifdef _PTOT_THREADS_
+    pthread_mutex_init(&is.lock, NULL);
+    pthread_cond_init(&is.filled_cv, NULL);
+    pthread_cond_init(&is.freed_cv, NULL);
+#endif
+    for (block = 0; block < INPUT_BLOCKS; ++block) {
+        is.data[block] = (U8 *)malloc((size_t)INPUT_BLOCK_SIZE);
+        if (NULL == is.data[block]) return ERR_MEMORY;
+    }
+#ifdef _PTOT_THREADS_
+    return start_reader();
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Start reading from "size" bytes of memory. They are not
+ * copied, so they must stay put until close_input().
+ */
+
+int
+open_input_memory(
+    U8 *data,
+    size_t size)
+{
+    ASSERT(NULL != data);
+
+    memset(&is, 0, sizeof is);
+    is.in_memory = TRUE;
+    is.data[0] = data;
+    is.count[0] = size;
+    is.have_block = is.eof = TRUE;
+    return 0;
+}
+
+void
+close_input(
+    void)
+{
+    int block;
+
+    if (is.in_memory) {
+        memset(&is, 0, sizeof is);
+        return;
+    }
+    if (NULL == is.inf) return;
+#ifdef _PTOT_THREADS_
+    stop_reader();
+    pthread_cond_destroy(&is.freed_cv);
+    pthread_cond_destroy(&is.filled_cv);
+    pthread_mutex_destroy(&is.lock);
+#endif
+    for (block = 0; block < INPUT_BLOCKS; ++block) {
+        if (NULL != is.data[block]) free(is.data[block]);
+    }
+    memset(&is, 0, sizeof is);
+}
+
+/*
+ * Done with the current block (if any); get the next one.
+ * Returns FALSE at end of input.
+ */
+
+static int
+next_block(
+    void)
+{
+    if (is.in_memory) {
+        is.have_block = FALSE;
+        return FALSE;
+    }
+#ifdef _PTOT_THREADS_
+    pthread_mutex_lock(&is.lock);
+    if (is.have_block) {
+        is.current = (is.current + 1) % INPUT_BLOCKS;
+        --is.filled;
+        pthread_cond_signal(&is.freed_cv);
+    }
+    if (0 == is.filled && !is.eof) {
+        TRACE_BEGIN(TRACE_INPUT_WAIT, 0);
+        while (0 == is.filled && !is.eof)
+          pthread_cond_wait(&is.filled_cv, &is.lock);
+        TRACE_END(TRACE_INPUT_WAIT);
+    }
+
+    is.have_block = (0 != is.filled);
+    pthread_mutex_unlock(&is.lock);
+#else
+    if (is.eof) {
+        is.have_block = FALSE;
+    } else {
+        TRACE_BEGIN(TRACE_READ_BLOCK, 0);
+        is.count[0] = fread(is.data[0], 1, (size_t)INPUT_BLOCK_SIZE,
+          is.inf);
+        TRACE_END(TRACE_READ_BLOCK);
+        if (is.count[0] < (size_t)INPUT_BLOCK_SIZE) is.eof = TRUE;
+        is.have_block = TRUE;
+    }
+#endif
+    is.pos = 0;
+    return is.have_block;
+}
+
+/*
+ * Point *data at up to "max" bytes of input, without copying.
+ * They remain valid until the next call to any input function.
+ * Returns the number of bytes, 0 at end of input.
+ */
+
+U32
+next_input(
+    U8 **data,
+    U32 max)
+{
+    size_t count;
+
+    ASSERT(NULL != data);
+
+    while (!is.have_block || is.pos >= is.count[is.current]) {
+        if (!next_block()) return 0;
+    }
+    count = is.count[is.current] - is.pos;
+    if (count > max) count = (size_t)max;
+
+    *data = is.data[is.current] + is.pos;
+    is.pos += count;
+    is.consumed += (long)count;
+    return (U32)count;
+}
+
+/*
+ * Copy the next "bytes" bytes of input into the buffer given.
+ * Returns the number actually read.
+ */
+
+U32
+read_input(
+    U8 *buffer,
+    U32 bytes)
+{
+    U32 total, count;
+    U8 *data;
+
+    ASSERT(NULL != buffer);
+
+    for (total = 0; total < bytes; total += count) {
+        if (0 == (count = next_input(&data, bytes - total))) break;
+        memcpy(buffer + total, data, (size_t)count);
+    }
+    return total;
+}
+
+/*
+ * Skip the next "bytes" bytes of input. Whatever has already
+ * been read is simply passed over; beyond that we seek, if the
+ * input allows it, and read and discard if it doesn't.
+ */
+
+int
+skip_input(
+    U32 bytes)
+{
+    U32 count;
+    U8 *data;
+
+    if (is.have_block) {
+        count = is.count[is.current] - is.pos;
+        if (count > bytes) count = bytes;
+        is.pos += count;
+        is.consumed += (long)count;
+        bytes -= count;
+    }
+    if (0 == bytes) return 0;
+    if (is.in_memory) return ERR_READ;
+
+    if (-1L != is.start) {
+#ifdef _PTOT_THREADS_
+        stop_reader();
+#endif
+        if (0 == fseek(is.inf, is.start + is.consumed + (long)bytes,
+          SEEK_SET)) {
+            /*
+             * Anything read ahead is now out of date.
+             */
+            is.start += is.consumed + (long)bytes;
+            is.consumed = 0;
+            is.have_block = is.eof = FALSE;
+            is.current = 0;
+#ifdef _PTOT_THREADS_
+            is.filled = 0;
+            return start_reader();
+#else
+            return 0;
+#endif
+        }
+        /*
+         * Seek failed, leaving the file where it was: carry on
+         * reading, and read what we wanted to skip.
+         */
+        is.start = -1L;
+#ifdef _PTOT_THREADS_
+        if (0 != start_reader()) return ERR_MEMORY;
+#endif
+    }
+    for (; 0 != bytes; bytes -= count) {
+        if (0 == (count = next_input(&data, bytes))) return ERR_READ;
+    }
+    return 0;
+}
+
+/*
+ * Go to file offset "offset", back or on, throwing away anything
+ * read ahead. Only for input that can seek.
+ */
+
+int
+seek_input(
+    long offset)
+{
+    if (is.in_memory || -1L == is.start) return ERR_READ;
+#ifdef _PTOT_THREADS_
+    stop_reader();
+#endif
+    if (0 != fseek(is.inf, offset, SEEK_SET)) return ERR_READ;
+    is.start = offset;
+    is.consumed = 0;
+    is.have_block = is.eof = FALSE;
+    is.current = 0;
+#ifdef _PTOT_THREADS_
+    is.filled = 0;
+    return start_reader();
+#else
+    return 0;
+#endif
+}
+
+/*
+ * File offset of the next byte of input, or -1 if the input
+ * can't seek, in which case its offsets are no use to anyone.
+ */
+
+long
+input_offset(
+    void)
+{
+    if (-1L == is.start) return -1L;
+    return is.start + is.consumed;
+}
+
+/*
+ * End of input.c
+ */
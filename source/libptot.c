@@ -0,0 +1,230 @@
+/*
+ * libptot.c
+ *
+ * Entry points for using ptot's PNG decoder as a library. See
+ * libptot.h for how they are used.
+ *
+ * The decoder takes its settings from the global options, which
+ * are meant for the command line: cropping and the rest would
+ * change what a caller gets. So each decode runs with all of
+ * them cleared, except the ones about where scratch data goes
+ * and how much text to keep, and puts them back afterwards.
+ * With opts.animate cleared, an APNG gives only its still image.
+ */
+
+#ifdef _PTOT_POSIX_
+#  define _XOPEN_SOURCE 500     /* For fdopen() */
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _PTOT_POSIX_
+#  include <unistd.h>
+#endif
+
+#include "libptot.h"
+
+#define DEFINE_ENUMS
+#include "errors.h"
+
+static int decode(IMG_INFO *, PTOT_CALLBACKS *);
+static int deliver_rows(IMG_INFO *, PTOT_CALLBACKS *);
+static int decode_stream(FILE *, IMG_INFO *, PTOT_CALLBACKS *);
+
+/*
+ * Decode whatever input has been opened, with the options set
+ * for a library caller. decode_PNG() closes the input.
+ */
+
+static int
+decode(
+    IMG_INFO *image,
+    PTOT_CALLBACKS *callbacks)
+{
+    PTOT_OPTIONS saved;
+    int err;
+
+    ASSERT(NULL != image);
+
+    saved = opts;
+    memset(&opts, 0, sizeof opts);
+    opts.max_text = saved.max_text;
+    opts.tmpdir = saved.tmpdir;
+    opts.max_memory = saved.max_memory;
+    ptot_callbacks = callbacks;
+
+    err = decode_PNG(image);
+    /*
+     * Rows of a plain image have already been delivered as
+     * they were decoded; an interlaced image was kept whole.
+     */
+    if (0 == err && NULL != callbacks && NULL != callbacks->row &&
+      NULL != image->pixel_data) {
+        err = deliver_rows(image, callbacks);
+    }
+    if (0 != err) free_image(image);
+
+    ptot_callbacks = NULL;
+    opts = saved;
+    return err;
+}
+
+/*
+ * Hand every row of the pixel data file to the row callback.
+ */
+
+static int
+deliver_rows(
+    IMG_INFO *image,
+    PTOT_CALLBACKS *callbacks)
+{
+    U32 row;
+    size_t bytes;
+    U8 *line;
+    int err;
+
+    bytes = pixel_row_size(image);
+    if (NULL == (line = (U8 *)malloc(bytes))) return ERR_MEMORY;
+
+    err = ERR_READ;
+    if (0 != fseek(image->pixel_data, 0L, SEEK_SET)) goto dr_err_out;
+
+    for (row = 0; row < image->height; ++row) {
+        err = ERR_READ;
+        if (bytes != fread(line, 1, bytes, image->pixel_data))
+          goto dr_err_out;
+        err = ERR_STOPPED;
+        if (0 != (*callbacks->row)(callbacks->user, row, line))
+          goto dr_err_out;
+    }
+    err = 0;
+dr_err_out:
+    free(line);
+    return err;
+}
+
+static int
+decode_stream(
+    FILE *inf,
+    IMG_INFO *image,
+    PTOT_CALLBACKS *callbacks)
+{
+    int err;
+
+    if (0 != (err = open_input(inf))) {
+        close_input();
+        return err;
+    }
+    return decode(image, callbacks);
+}
+
+/*
+ * Decode the PNG file named "path".
+ */
+
+int
+ptot_decode_file(
+    char *path,
+    IMG_INFO *image,
+    PTOT_CALLBACKS *callbacks)
+{
+    FILE *inf;
+    int err;
+
+    ASSERT(NULL != path);
+
+    if (NULL == (inf = fopen(path, "rb"))) return ERR_READ;
+    err = decode_stream(inf, image, callbacks);
+    fclose(inf);
+    return err;
+}
+
+#ifdef _PTOT_POSIX_
+/*
+ * Decode the PNG open on file descriptor "fd", from its current
+ * position. The descriptor is left open.
+ */
+
+int
+ptot_decode_fd(
+    int fd,
+    IMG_INFO *image,
+    PTOT_CALLBACKS *callbacks)
+{
+    FILE *inf;
+    int err, copy;
+
+    if (-1 == (copy = dup(fd))) return ERR_READ;
+    if (NULL == (inf = fdopen(copy, "rb"))) {
+        close(copy);
+        return ERR_READ;
+    }
+    err = decode_stream(inf, image, callbacks);
+    fclose(inf);
+    return err;
+}
+#endif
+
+/*
+ * Decode a PNG held in memory. The data is read in place, and
+ * not kept after we return.
+ */
+
+int
+ptot_decode_memory(
+    U8 *data,
+    size_t size,
+    IMG_INFO *image,
+    PTOT_CALLBACKS *callbacks)
+{
+    int err;
+
+    if (NULL == data) return ERR_READ;
+    if (0 != (err = open_input_memory(data, size))) {
+        close_input();
+        return err;
+    }
+    return decode(image, callbacks);
+}
+
+/*
+ * Read row "row" of a decoded image into "buf", which must have
+ * room for pixel_row_size(image) bytes.
+ */
+
+int
+ptot_read_row(
+    IMG_INFO *image,
+    U32 row,
+    U8 *buf)
+{
+    size_t bytes;
+
+    ASSERT(NULL != image);
+    ASSERT(NULL != buf);
+
+    if (NULL == image->pixel_data || row >= image->height)
+      return ERR_USAGE;
+
+    bytes = pixel_row_size(image);
+    if (0 != fseek(image->pixel_data, (long)row * (long)bytes,
+      SEEK_SET)) return ERR_READ;
+    if (bytes != fread(buf, 1, bytes, image->pixel_data))
+      return ERR_READ;
+    return 0;
+}
+
+void
+ptot_free_image(
+    IMG_INFO *image)
+{
+    ASSERT(NULL != image);
+
+    free_image(image);
+}
+
+/*
+ * End of libptot.c
+ */
@@ -0,0 +1,65 @@
+/*
+ * libptot.h
+ *
+ * Interface for programs that use ptot's PNG decoder as a
+ * library, built as libptot.a (see makefile.sunos). Nothing is
+ * converted or written: the caller gets the image description
+ * and its pixel rows.
+ *
+ * Open a PNG with ptot_decode_file(), ptot_decode_fd() or
+ * ptot_decode_memory(). The IMG_INFO struct passed is filled in
+ * as ptot.c's read_PNG() does it. The callbacks, which may be
+ * NULL, or have NULL members, are:
+ *
+ *   info(user, image)       Called once the image is described,
+ *                           before any rows.
+ *   row(user, row, data)    Called with each row, top to bottom.
+ *   warning(user, code, message)
+ *                           Called for each warning, which would
+ *                           otherwise go to stderr.
+ *
+ * A nonzero return from info() or row() stops the decode, which
+ * then returns ERR_STOPPED. Rows of a non-interlaced image come
+ * straight from the unfilter as they are decoded, and nothing
+ * is kept; those of an interlaced image are delivered once the
+ * last pass is done.
+ *
+ * Without a row callback, the rows are kept in a temporary file
+ * and can be had in any order with ptot_read_row() until
+ * ptot_free_image(), which must be called after every
+ * successful decode.
+ *
+ * Rows are pixel_row_size(image) bytes: one byte per sample,
+ * with 1, 2 and 4-bit samples scaled up to 8 bits, or two
+ * big-endian bytes for 16-bit samples. Palette images have one
+ * index per pixel, scaled the same way as gray; the palette is
+ * in the IMG_INFO. No gamma, transparency or other transforms
+ * are applied.
+ *
+ * All functions return 0 or an error code from errors.h (which
+ * callers include with DEFINE_ENUMS defined, as ptot's own
+ * modules do), and ptot_message() turns a code into text.
+ * They never exit, except on an internal assertion failure.
+ * Decoder state is global, so only one decode can be running
+ * at a time.
+ */
+
+#ifndef _LIBPTOT_H_
+#define _LIBPTOT_H_
+
+#include "ptot.h"
+
+int ptot_decode_file(char *, IMG_INFO *, PTOT_CALLBACKS *);
+#ifdef _PTOT_POSIX_
+int ptot_decode_fd(int, IMG_INFO *, PTOT_CALLBACKS *);
+#endif
+int ptot_decode_memory(U8 *, size_t, IMG_INFO *, PTOT_CALLBACKS *);
+int ptot_read_row(IMG_INFO *, U32, U8 *);
+void ptot_free_image(IMG_INFO *);
+char *ptot_message(int);
+
+#endif /* _LIBPTOT_H_ */
+
+/*
+ * End of libptot.h
+ */
@@ -12,8 +12,17 @@ icc /c tiff.c
 icc /c tempfile.c
 icc /c zchunks.c
 icc /c ppm.c
+icc /c raw.c
+icc /c xform.c
+icc /c apng.c
+icc /c adam7.c
+icc /c input.c
+icc /c output.c
+icc /c index.c
+icc /c cache.c
+icc /c trace.c
 
-icc /D_PNG2PPM_ ptot.c zchunks.obj tempfile.obj tiff.obj crc32.obj inflate.obj ppm.obj
+icc /D_PNG2PPM_ ptot.c zchunks.obj tempfile.obj tiff.obj crc32.obj inflate.obj ppm.obj raw.obj xform.obj apng.obj adam7.obj input.obj output.obj index.obj cache.obj trace.obj
 
 del *.obj
 
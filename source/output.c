@@ -0,0 +1,356 @@
+/*
+ * output.c
+ *
+ * Buffered output for the TIFF and netpbm writers. Output is
+ * gathered into large blocks and written a block at a time to
+ * an unbuffered stream, rather than a scanline at a time
+ * through stdio, which for big images spends more time copying
+ * and flushing small buffers than writing.
+ *
+ * If compiled with _PTOT_THREADS_ defined, full blocks are
+ * queued for a second thread to write, so that the disk is kept
+ * busy while the next block is filled. Otherwise each block is
+ * written as soon as it is full.
+ *
+ * Output is written in order, apart from the odd word patched
+ * in afterwards with patch_output(), such as IFD offsets.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _PTOT_THREADS_
+#  include <pthread.h>
+#endif
+
+#include "ptot.h"
+
+#define DEFINE_ENUMS
+#include "errors.h"
+
+/*
+ * A block must fit in a size_t, which is 16 bits in the DOS
+ * large model.
+ */
+
+#if UINT_MAX == 0xFFFF
+#  define OUTPUT_BLOCK_SIZE 32768L
+#else
+#  define OUTPUT_BLOCK_SIZE 262144L
+#endif
+
+#ifdef _PTOT_THREADS_
+#  define OUTPUT_BLOCKS 4
+#else
+#  define OUTPUT_BLOCKS 1
+#endif
+
+static int output_error(void);
+static int queue_block(void);
+static int drain_output(void);
+
+static struct _output_state {
+    FILE *outf;
+    unsigned long offset;   /* Bytes written so far */
+    unsigned long block_start;  /* Offset of current block */
+    U8 *data[OUTPUT_BLOCKS];
+    size_t count[OUTPUT_BLOCKS];
+    int current;            /* Block being filled */
+    int err;                /* First write error, if any */
+#ifdef _PTOT_THREADS_
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t queued_cv, freed_cv;
+    int head;               /* Oldest block not yet written */
+    int queued;             /* Blocks waiting to be written */
+    int stop;
+    int running;
+#endif
+} os;
+
+#ifdef _PTOT_THREADS_
+
+/*
+ * The writer thread. It writes queued blocks in order until
+ * told to stop, and then finishes whatever is left in the
+ * queue. The writer owns the blocks counted in "queued".
+ */
+
+static void *
+writer_thread(
+    void *arg)
+{
+    int block;
+    size_t count, written;
+
+    pthread_mutex_lock(&os.lock);
+    for (;;) {
+        while (0 == os.queued && !os.stop)
+          pthread_cond_wait(&os.queued_cv, &os.lock);
+        if (0 == os.queued) break;
+
+        block = os.head;
+        count = os.count[block];
+        pthread_mutex_unlock(&os.lock);
+
+        TRACE_BEGIN(TRACE_WRITE_BLOCK, count);
+        written = fwrite(os.data[block], 1, count, os.outf);
+        TRACE_END(TRACE_WRITE_BLOCK);
+
+        pthread_mutex_lock(&os.lock);
+        if (written != count) os.err = ERR_WRITE;
+        os.head = (os.head + 1) % OUTPUT_BLOCKS;
+        --os.queued;
+        pthread_cond_signal(&os.freed_cv);
+    }
+    pthread_mutex_unlock(&os.lock);
+    return arg;
+}
+
+#endif /* _PTOT_THREADS_ */
+
+/*
+ * Start writing to the given file, which must not have been
+ * written to through stdio yet.
+ */
+
+int
+open_output(
+    FILE *outf)
+{
+    int block;
+
+    ASSERT(NULL != outf);
+
+    memset(&os, 0, sizeof os);
+    os.outf = outf;
+    setvbuf(outf, NULL, _IONBF, 0);
+#ifdef _PTOT_THREADS_
+    pthread_mutex_init(&os.lock, NULL);
+    pthread_cond_init(&os.queued_cv, NULL);
+    pthread_cond_init(&os.freed_cv, NULL);
+#endif
+    for (block = 0; block < OUTPUT_BLOCKS; ++block) {
+        os.data[block] = (U8 *)malloc((size_t)OUTPUT_BLOCK_SIZE);
+        if (NULL == os.data[block]) return ERR_MEMORY;
+    }
+#ifdef _PTOT_THREADS_
+    if (0 != pthread_create(&os.writer, NULL, writer_thread, NULL))
+      return ERR_MEMORY;
+    os.running = TRUE;
+#endif
+    return 0;
+}
+
+/*
+ * Write out everything still buffered and release the buffers.
+ * Returns ERR_WRITE if anything failed to be written, now or
+ * earlier.
+ */
+
+int
+close_output(
+    void)
+{
+    int block, err;
+
+    if (NULL == os.outf) return 0;
+
+    err = drain_output();
+#ifdef _PTOT_THREADS_
+    if (os.running) {
+        pthread_mutex_lock(&os.lock);
+        os.stop = TRUE;
+        pthread_cond_signal(&os.queued_cv);
+        pthread_mutex_unlock(&os.lock);
+        pthread_join(os.writer, NULL);
+    }
+    pthread_cond_destroy(&os.freed_cv);
+    pthread_cond_destroy(&os.queued_cv);
+    pthread_mutex_destroy(&os.lock);
+#endif
+    for (block = 0; block < OUTPUT_BLOCKS; ++block) {
+        if (NULL != os.data[block]) free(os.data[block]);
+    }
+    memset(&os, 0, sizeof os);
+    return err;
+}
+
+/*
+ * The first write error, if any. The writer thread sets it, so
+ * it is read under the lock.
+ */
+
+static int
+output_error(
+    void)
+{
+    int err;
+
+#ifdef _PTOT_THREADS_
+    pthread_mutex_lock(&os.lock);
+#endif
+    err = os.err;
+#ifdef _PTOT_THREADS_
+    pthread_mutex_unlock(&os.lock);
+#endif
+    return err;
+}
+
+/*
+ * The current block is full (or we need it written now): send
+ * it on its way and start filling the next.
+ */
+
+static int
+queue_block(
+    void)
+{
+    int err;
+
+    if (0 == os.count[os.current]) return output_error();
+#ifdef _PTOT_THREADS_
+    pthread_mutex_lock(&os.lock);
+    ++os.queued;
+    pthread_cond_signal(&os.queued_cv);
+
+    os.current = (os.current + 1) % OUTPUT_BLOCKS;
+    if (OUTPUT_BLOCKS == os.queued) {
+        TRACE_BEGIN(TRACE_OUTPUT_WAIT, 0);
+        while (OUTPUT_BLOCKS == os.queued)
+          pthread_cond_wait(&os.freed_cv, &os.lock);
+        TRACE_END(TRACE_OUTPUT_WAIT);
+    }
+    err = os.err;
+    pthread_mutex_unlock(&os.lock);
+#else
+    TRACE_BEGIN(TRACE_WRITE_BLOCK, os.count[0]);
+    if (os.count[0] != fwrite(os.data[0], 1, os.count[0], os.outf))
+      os.err = ERR_WRITE;
+    TRACE_END(TRACE_WRITE_BLOCK);
+    err = os.err;
+#endif
+    os.count[os.current] = 0;
+    os.block_start = os.offset;
+    return err;
+}
+
+/*
+ * Wait until everything written so far is in the file.
+ */
+
+static int
+drain_output(
+    void)
+{
+    queue_block();
+#ifdef _PTOT_THREADS_
+    pthread_mutex_lock(&os.lock);
+    while (0 != os.queued)
+      pthread_cond_wait(&os.freed_cv, &os.lock);
+    pthread_mutex_unlock(&os.lock);
+#endif
+    /*
+     * The writer is idle now, so os.err is ours.
+     */
+    if (0 != fflush(os.outf)) os.err = ERR_WRITE;
+    return os.err;
+}
+
+/*
+ * Append "bytes" bytes to the output.
+ */
+
+int
+write_output(
+    U8 *data,
+    U32 bytes)
+{
+    size_t count;
+    int err;
+
+    ASSERT(NULL != os.outf);
+    ASSERT(NULL != data || 0 == bytes);
+
+    while (0 != bytes) {
+        count = (size_t)OUTPUT_BLOCK_SIZE - os.count[os.current];
+        if (count > bytes) count = (size_t)bytes;
+
+        memcpy(os.data[os.current] + os.count[os.current], data,
+          count);
+        os.count[os.current] += count;
+        os.offset += count;
+        data += count;
+        bytes -= count;
+
+        if ((size_t)OUTPUT_BLOCK_SIZE == os.count[os.current]) {
+            if (0 != (err = queue_block())) return err;
+        }
+    }
+    return output_error();
+}
+
+/*
+ * Append zero bytes until the output is a multiple of
+ * "modulus" bytes long.
+ */
+
+int
+pad_output(
+    int modulus)
+{
+    static U8 zeros[16];
+
+    ASSERT(modulus > 0 && modulus <= 16);
+
+    if (0 == os.offset % modulus) return output_error();
+    return write_output(zeros, modulus - os.offset % modulus);
+}
+
+/*
+ * Bytes written so far, which is also the file offset of the
+ * next byte written. Only TIFF output asks, and it is never
+ * allowed past 4GB.
+ */
+
+U32
+output_offset(
+    void)
+{
+    return (U32)os.offset;
+}
+
+/*
+ * Overwrite "bytes" bytes already written at "offset". If they
+ * are still in the current block this is just a copy; if not,
+ * everything queued is written first, and we seek back.
+ */
+
+int
+patch_output(
+    U32 offset,
+    U8 *data,
+    U32 bytes)
+{
+    ASSERT(NULL != os.outf);
+    ASSERT(NULL != data);
+    ASSERT(offset + bytes <= os.offset);
+
+    if (offset >= os.block_start) {
+        memcpy(os.data[os.current] + (offset - os.block_start), data,
+          (size_t)bytes);
+        return output_error();
+    }
+    if (0 != drain_output()) return os.err;
+
+    if (0 != fseek(os.outf, (long)offset, SEEK_SET) ||
+      bytes != (U32)fwrite(data, 1, (size_t)bytes, os.outf) ||
+      0 != fseek(os.outf, (long)os.offset, SEEK_SET))
+      os.err = ERR_WRITE;
+    return os.err;
+}
+
+/*
+ * End of output.c
+ */
@@ -1,6 +1,17 @@
-/* by Wolfram M. Koerner
- Wuerzburg, Germany, 21.10.1997
- koerner@bigfoot.com, w.koerner@usa.net
+/*
+ * ppm.c
+ *
+ * netpbm (PGM, PPM and PAM) writing routines for PNG-to-TIFF
+ * utility. Grayscale images become PGM, truecolor and palette
+ * images (expanded through the palette) become PPM, and anything
+ * with an alpha channel or 16-bit samples becomes PAM.
+ *
+ **********
+ *
+ * HISTORY
+ *
+ * 97-10-21 Created by Wolfram M. Koerner <w.koerner@usa.net>
+ *          Wuerzburg, Germany
  */
 
 #include <stdlib.h>
@@ -8,65 +19,165 @@
 #include <string.h>
 
 #include "ptot.h"
+
 #define DEFINE_ENUMS
 #include "errors.h"
 
-void kill_temp_files(IMG_INFO *image);
+#define PNM_PGM 5   /* Magic numbers ("P5", etc.) */
+#define PNM_PPM 6
+#define PNM_PAM 7
+
+static int pnm_type(IMG_INFO *);
+
+/*
+ * Choose the netpbm flavor for the image. Sub-byte samples
+ * have already been scaled up to 8 bits by the time we see
+ * them, so only 16-bit data and alpha force PAM.
+ */
+
+static int
+pnm_type(
+    IMG_INFO *image)
+{
+    ASSERT(NULL != image);
+
+    if (image->has_alpha || 16 == image->bits_per_sample)
+      return PNM_PAM;
+    if (image->is_palette || image->is_color) return PNM_PPM;
+    return PNM_PGM;
+}
+
+/*
+ * Return the conventional file extension for the image.
+ */
+
+char *
+PNM_extension(
+    IMG_INFO *image)
+{
+    switch (pnm_type(image)) {
+    case PNM_PGM:   return ".pgm";
+    case PNM_PPM:   return ".ppm";
+    default:        return ".pam";
+    }
+}
+
+/*
+ * Palette indices are stored in the pixel data file one per
+ * byte, scaled up to 8 bits like gray values. Rather than undo
+ * the scaling for every pixel, we index this table directly
+ * with the stored byte. Entries beyond the end of the palette
+ * come out black. Raw output (raw.c) uses the same table.
+ */
+
+void
+build_palette_lut(
+    IMG_INFO *image,
+    U8 *lut)
+{
+    int value, index, shift;
+
+    shift = 8 - image->bits_per_sample;
+    memset(lut, 0, 3 * 256);
+
+    for (value = 0; value < 256; ++value) {
+        index = value >> shift;
+        if (index < image->palette_size)
+          memcpy(lut + 3 * value, image->palette + 3 * index, 3);
+    }
+}
+
+/*
+ * Write image specified by IMG_INFO structure to netpbm file.
+ * Samples are already in netpbm order (big-endian for 16-bit),
+ * so apart from palette expansion this is a straight copy, done
+ * one scanline at a time into the output buffers.
+ */
 
 int
-write_PPM(
+write_PNM(
     FILE *outf,
     IMG_INFO *image)
 {
-    int err;
-    FILE* inf;
-    char c;
+    int err, type, maxval;
+    U32 row, col;
+    size_t in_size, out_size;
+    U8 *in_line, *out_line, *lut, *sp, *dp;
+    FILE *inf;
+    char *tupltype, header[128];
 
     ASSERT(NULL != outf);
     ASSERT(NULL != image);
-    ASSERT(NULL != image->pixel_data_file);
-
-    inf = fopen(image->pixel_data_file, "rb");
-    if (! inf)
-        return ERR_READ;
-
-    if (image->is_palette)                                 /* PALETTE */
-    {
-        printf("Sorry, no support for PALETTE PNG -> PPM/PGM\n");
-        printf("Truecolor 24-Bit PNG only!\n");
-        fclose(inf);
-        kill_temp_files(image);
-        return ERR_BAD_PNG;
+    ASSERT(NULL != image->pixel_data);
+
+    type = pnm_type(image);
+    maxval = (16 == image->bits_per_sample) ? 65535 : 255;
+
+    in_size = pixel_row_size(image);
+    out_size = in_size;
+    if (image->is_palette) out_size *= 3;
+
+    in_line = (U8 *)malloc(in_size);
+    out_line = in_line;
+    lut = NULL;
+
+    if (image->is_palette) {
+        out_line = (U8 *)malloc(out_size);
+        lut = (U8 *)malloc(3 * 256);
     }
-    
-    if (!image->is_color)                                 /* GRAY */
-    {
-        printf("Sorry, no support for GRAY PNG -> PPM/PGM\n");
-        printf("Truecolor 24-Bit PNG only!\n");
-        fclose(inf);
-        kill_temp_files(image);
-        return ERR_BAD_PNG;
+    err = ERR_MEMORY;
+    if (NULL == in_line || NULL == out_line) goto wp_err_out;
+    if (image->is_palette) {
+        if (NULL == lut) goto wp_err_out;
+        build_palette_lut(image, lut);
     }
+    if (0 != (err = open_output(outf))) goto wp_err_out;
+    inf = image->pixel_data;
+    err = ERR_READ;
+    if (0 != fseek(inf, 0L, SEEK_SET)) goto wp_err_out;
+
+    if (PNM_PAM == type) {
+        if (image->is_color || image->is_palette)
+          tupltype = image->has_alpha ? "RGB_ALPHA" : "RGB";
+        else tupltype = image->has_alpha ? "GRAYSCALE_ALPHA" :
+          "GRAYSCALE";
 
-    
-                                                          /* RGB TRUECOLOR */
-    fprintf(outf , "P6\n%d %d\n255\n", image->width, image->height);
-    while (! feof(inf))
-    {
-        c = getc(inf);
-        fwrite ((const void *)&c, 1, 1, outf);
+        sprintf(header, "P7\nWIDTH %lu\nHEIGHT %lu\nDEPTH %d\n"
+          "MAXVAL %d\nTUPLTYPE %s\nENDHDR\n",
+          (unsigned long)image->width, (unsigned long)image->height,
+          image->is_palette ? 3 : image->samples_per_pixel,
+          maxval, tupltype);
+    } else {
+        sprintf(header, "P%d\n%lu %lu\n%d\n", type,
+          (unsigned long)image->width,
+          (unsigned long)image->height, maxval);
     }
+    if (0 != (err = write_output((U8 *)header, strlen(header))))
+      goto wp_err_out;
 
-    fclose(inf);
-    kill_temp_files(image);
-    return 0;
+    for (row = 0; row < image->height; ++row) {
+        if (0 != (err = read_pixel_row(inf, in_line)))
+          goto wp_err_out;
+        if (image->is_palette) {
+            sp = in_line;
+            dp = out_line;
+            for (col = 0; col < image->width; ++col) {
+                memcpy(dp, lut + 3 * *sp++, 3);
+                dp += 3;
+            }
+        }
+        if (0 != (err = write_output(out_line, (U32)out_size)))
+          goto wp_err_out;
+    }
+    err = 0;
+wp_err_out:
+    if (0 != close_output() && 0 == err) err = ERR_WRITE;
+    if (out_line != in_line && NULL != out_line) free(out_line);
+    if (NULL != in_line) free(in_line);
+    if (NULL != lut) free(lut);
+    return err;
 }
 
-
-void kill_temp_files(IMG_INFO *image)
-{
-    remove(image->pixel_data_file);
-
-    if (NULL != image->png_data_size)
-        remove(image->png_data_file);
-}
+/*
+ * End of ppm.c
+ */
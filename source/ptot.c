@@ -41,16 +41,295 @@ static int decode_IHDR(void);
 static int decode_PLTE(void);
 static int decode_gAMA(void);
 static int decode_tRNS(void);
+static int decode_bKGD(void);
 static int decode_cHRM(void);
 static int decode_pHYs(void);
 static int decode_oFFs(void);
 static int decode_sCAL(void);
-static int skip_chunk_data(void);
 static int validate_image(IMG_INFO *);
+#ifndef _PTOT_LIBRARY_
+static int parse_option(char *);
+static int make_names(char *, char *, char *);
+static int load_image(char *, char *, IMG_INFO *);
+static int write_pages(IMG_INFO *);
+static int write_raw_files(FILE *, IMG_INFO *, char *);
+#endif
+
+/*
+ * Options default to writing TIFF, unless we were built as
+ * the dedicated PNG-to-PPM converter.
+ */
+
+PTOT_OPTIONS opts = {
+#ifdef _PNG2PPM_          /* WOK Wolfram M. Koerner */
+    FMT_PNM
+#else
+    FMT_TIFF
+#endif
+};
+
+/*
+ * Set by libptot.c while a program using us as a library is
+ * decoding; NULL when we are ptot itself.
+ */
+
+PTOT_CALLBACKS *ptot_callbacks;
+
+/*
+ * Release what read_PNG() allocated for an image, including its
+ * temporary files, so that the structure can be used again.
+ */
+
+void
+free_image(
+    IMG_INFO *image)
+{
+    int i;
+
+    ASSERT(NULL != image);
+
+    end_animation();
+    end_transforms();
+
+    for (i = 0; i < N_KEYWORDS; ++i) {
+        if (NULL != image->keywords[i]) free(image->keywords[i]);
+        image->keywords[i] = NULL;
+    }
+    free_tempfile(image->pixel_data);
+    free_tempfile(image->frame_data);
+    if (NULL != image->png_data) free(image->png_data);
+    if (NULL != image->frames) free(image->frames);
+    image->pixel_data = image->frame_data = NULL;
+    image->png_data = NULL;
+    image->png_data_size = image->png_data_alloc = 0;
+    image->frames = NULL;
+    image->frame_count = 0;
+}
+
+#ifndef _PTOT_LIBRARY_
+
+/*
+ * Parse a single "--name=value" (or "--name") option into the
+ * opts structure.
+ */
+
+static int
+parse_option(
+    char *arg)
+{
+    ASSERT(NULL != arg);
+
+    if (0 == strcmp(arg, "--format=tiff")) {
+        opts.output_format = FMT_TIFF;
+    } else if (0 == strcmp(arg, "--format=pnm")) {
+        opts.output_format = FMT_PNM;
+    } else if (0 == strcmp(arg, "--format=raw")) {
+        opts.output_format = FMT_RAW;
+    } else if (0 == strncmp(arg, "--row-align=", 12)) {
+        unsigned long n;
+
+        if (1 != sscanf(arg + 12, "%lu", &n) || 0 == n || n > 4096)
+          return ERR_USAGE;
+        opts.row_align = n;
+    } else if (0 == strncmp(arg, "--crop=", 7)) {
+        unsigned long x, y, w, h;
+
+        if (4 != sscanf(arg + 7, "%lu,%lu,%lu,%lu", &x, &y, &w, &h))
+          return ERR_USAGE;
+        if (0 == w || 0 == h) return ERR_USAGE;
+        opts.crop = TRUE;
+        opts.crop_x = x;
+        opts.crop_y = y;
+        opts.crop_width = w;
+        opts.crop_height = h;
+    } else if (0 == strncmp(arg, "--thumbnail=", 12)) {
+        unsigned long n;
+
+        if (1 != sscanf(arg + 12, "%lu", &n) || 0 == n)
+          return ERR_USAGE;
+        opts.thumbnail = n;
+    } else if (0 == strcmp(arg, "--expand-trns")) {
+        opts.expand_trns = TRUE;
+    } else if (0 == strncmp(arg, "--apply-gamma=", 14)) {
+        if (1 != sscanf(arg + 14, "%lf", &opts.target_gamma) ||
+          opts.target_gamma <= 0.0) return ERR_USAGE;
+    } else if (0 == strncmp(arg, "--max-text=", 11)) {
+        unsigned long n;
+
+        if (1 != sscanf(arg + 11, "%lu", &n) || 0 == n)
+          return ERR_USAGE;
+        opts.max_text = n;
+    } else if (0 == strncmp(arg, "--tmpdir=", 9)) {
+        if ('\0' == arg[9]) return ERR_USAGE;
+        opts.tmpdir = arg + 9;
+    } else if (0 == strncmp(arg, "--build-index=", 14)) {
+        if ('\0' == arg[14]) return ERR_USAGE;
+        opts.build_index = arg + 14;
+    } else if (0 == strncmp(arg, "--index=", 8)) {
+        if ('\0' == arg[8]) return ERR_USAGE;
+        opts.use_index = arg + 8;
+    } else if (0 == strncmp(arg, "--index-rows=", 13)) {
+        unsigned long n;
+
+        if (1 != sscanf(arg + 13, "%lu", &n) || 0 == n)
+          return ERR_USAGE;
+        opts.index_rows = n;
+    } else if (0 == strncmp(arg, "--cache-dir=", 12)) {
+        if ('\0' == arg[12]) return ERR_USAGE;
+        opts.cache_dir = arg + 12;
+    } else if (0 == strncmp(arg, "--max-memory=", 13)) {
+        unsigned long n, unit;
+        char suffix[2];
+
+        suffix[0] = '\0';
+        if (sscanf(arg + 13, "%lu%1s", &n, suffix) < 1 || 0 == n)
+          return ERR_USAGE;
+        switch (toupper(suffix[0])) {
+        case '\0': unit = 1L; break;
+        case 'K':   unit = 1L << 10; break;
+        case 'M':   unit = 1L << 20; break;
+        case 'G':   unit = 1L << 30; break;
+        default:    return ERR_USAGE;
+        }
+        if (n > (unsigned long)LONG_MAX / unit) return ERR_USAGE;
+        opts.max_memory = (long)(n * unit);
+    } else if (0 == strcmp(arg, "--memory-report")) {
+        opts.memory_report = TRUE;
+    } else if (0 == strcmp(arg, "--flatten")) {
+        opts.flatten = TRUE;
+        opts.flatten_color[0] = -1;
+    } else if (0 == strncmp(arg, "--flatten=", 10)) {
+        int r, g, b, n;
+
+        n = sscanf(arg + 10, "%d,%d,%d", &r, &g, &b);
+        if (1 == n) g = b = r;
+        else if (3 != n) return ERR_USAGE;
+        if (r < 0 || r > 255 || g < 0 || g > 255 || b < 0 || b > 255)
+          return ERR_USAGE;
+        opts.flatten = TRUE;
+        opts.flatten_color[0] = r;
+        opts.flatten_color[1] = g;
+        opts.flatten_color[2] = b;
+    } else if (0 == strncmp(arg, "--trace=", 8)) {
+        if ('\0' == arg[8]) return ERR_USAGE;
+        opts.trace = arg + 8;
+    } else return ERR_USAGE;
+
+    return 0;
+}
+
+/*
+ * Make the input file name from the name given on the command
+ * line, adding ".png" if it has no extension. If "basename" is
+ * not NULL, the name less any extension is copied there.
+ */
+
+static int
+make_names(
+    char *name,
+    char *infname,
+    char *basename)
+{
+    char *cp;
+
+    ASSERT(NULL != name);
+    ASSERT(NULL != infname);
+
+    if (strlen(name) + 6 > FILENAME_MAX) return ERR_USAGE;
+    strcpy(infname, name);
+    if (NULL != basename) strcpy(basename, name);
+
+    if (NULL == (cp = strrchr(name, '.'))) {
+        strcat(infname, ".png");
+    } else if (NULL != basename) basename[cp - name] = '\0';
+    return 0;
+}
+
+/*
+ * Read the PNG named on the command line and prepare it for
+ * output. "basename" is as for make_names().
+ */
+
+static int
+load_image(
+    char *name,
+    char *basename,
+    IMG_INFO *image)
+{
+    int err;
+    FILE *fp;
+    char infname[FILENAME_MAX];
+
+    ASSERT(NULL != image);
+
+    if (0 != (err = make_names(name, infname, basename))) return err;
+    if ((NULL != opts.build_index || NULL != opts.use_index) &&
+      0 != (err = index_source(infname))) return err;
+    if (NULL == (fp = fopen(infname, "rb"))) return ERR_READ;
+    err = read_PNG(fp, image);
+    fclose(fp);
+    if (0 != err) return err;
+    if (0 != image->frame_count) {
+        if (0 != (err = start_animation(image))) return err;
+    }
+    return setup_transforms(image);
+}
+
+/*
+ * Write the image to the open TIFF file: one page, or one for
+ * each frame of an animated PNG.
+ */
+
+static int
+write_pages(
+    IMG_INFO *image)
+{
+    int err;
+    U32 frame;
+
+    ASSERT(NULL != image);
+
+    if (0 == image->frame_count) return write_TIFF_image(image);
+
+    for (frame = 0; frame < image->frame_count; ++frame) {
+        if (0 != (err = compose_frame())) return err;
+        if (0 != (err = write_TIFF_image(image))) return err;
+    }
+    return 0;
+}
+
+/*
+ * Write the pixels to the open raw file "raw_name", and describe
+ * them in a JSON file of the same name ending in ".json".
+ */
+
+static int
+write_raw_files(
+    FILE *fp,
+    IMG_INFO *image,
+    char *raw_name)
+{
+    char json_name[FILENAME_MAX];
+    FILE *jfp;
+    int err;
+
+    ASSERT(NULL != raw_name);
+
+    if (0 != (err = write_RAW(fp, image))) return err;
+
+    strcpy(json_name, raw_name);
+    strcpy(json_name + strlen(json_name) - 4, ".json");
+    remove(json_name);
+    if (NULL == (jfp = fopen(json_name, "w"))) return ERR_WRITE;
+    err = write_RAW_description(jfp, image, raw_name);
+    if (0 != fclose(jfp) && 0 == err) err = ERR_WRITE;
+    return err;
+}
 
 /*
  * Main for PTOT.  Get filename from command line, massage the
  * extensions as necessary, and call the read/write routines.
+ * With --multipage, every file named goes into one TIFF.
  */
 
 int
@@ -58,49 +337,116 @@ main(
     int argc,
     char *argv[])
 {
-    int err;
+    int err, arg;
     FILE *fp;
-    char *cp, infname[FILENAME_MAX], outfname[FILENAME_MAX];
+    char infname[FILENAME_MAX], outfname[FILENAME_MAX], key[20];
     IMG_INFO *image;
 
     image = (IMG_INFO *)malloc((size_t)IMG_SIZE);
     if (NULL == image) error_exit(ERR_MEMORY);
 
-    if (argc < 2) error_exit(ERR_USAGE);
-    strcpy(infname, argv[1]);
-    strcpy(outfname, argv[1]);
-
-    if (NULL == (cp = strrchr(outfname, '.'))) {
-        strcat(infname, ".png");
-    } else (*cp = '\0');
-
-#ifdef _PNG2PPM_          /* WOK Wolfram M. Koerner */
-    strcat(outfname, ".ppm");
-#else
-    strcat(outfname, ".tif");
-#endif
-
-    if (NULL == (fp = fopen(infname, "rb")))
-      error_exit(ERR_READ);
-    err = read_PNG(fp, image);
-    fclose(fp);
-    if (0 != err) error_exit(err);
-
+    for (arg = 1; arg < argc; ++arg) {
+        if (0 != strncmp(argv[arg], "--", 2)) break;
+        if (0 == strcmp(argv[arg], "--multipage")) {
+            if (++arg >= argc) error_exit(ERR_USAGE);
+            opts.multipage = argv[arg];
+        } else if (0 != (err = parse_option(argv[arg])))
+          error_exit(err);
+    }
+    if (arg >= argc) error_exit(ERR_USAGE);
+    if (opts.crop && 0 != opts.thumbnail) error_exit(ERR_USAGE);
+    if (NULL != opts.build_index && NULL != opts.use_index)
+      error_exit(ERR_USAGE);
+    if (NULL != opts.cache_dir &&
+      (NULL != opts.multipage || NULL != opts.build_index ||
+      FMT_RAW == opts.output_format)) error_exit(ERR_USAGE);
+    if (NULL != opts.trace && 0 != (err = start_trace()))
+      error_exit(err);
+    /*
+     * Animation frames become TIFF pages. They are of no use
+     * to the other outputs, or to a cropped or reduced image.
+     * libptot.c leaves this off.
+     */
+    opts.animate = (FMT_TIFF == opts.output_format && !opts.crop &&
+      0 == opts.thumbnail);
+
+    if (NULL != opts.multipage) {
+        if (FMT_TIFF != opts.output_format) error_exit(ERR_USAGE);
+        if (NULL == (fp = fopen(opts.multipage, "wb")))
+          error_exit(ERR_WRITE);
+        if (0 != (err = open_TIFF(fp))) error_exit(err);
+
+        for (; arg < argc; ++arg) {
+            if (0 != (err = load_image(argv[arg], NULL, image)))
+              error_exit(err);
+            err = write_pages(image);
+            free_image(image);
+            if (0 != err) error_exit(err);
+        }
+        err = close_TIFF();
+        if (0 != fclose(fp) && 0 == err) err = ERR_WRITE;
+        if (opts.memory_report) report_tempfiles();
+        if (NULL != opts.trace && 0 != write_trace(opts.trace) &&
+          0 == err) err = ERR_WRITE;
+        if (0 != err) error_exit(err);
+        return 0;
+    }
+    /*
+     * With a cache, we may not need to read the image at all.
+     */
+    if (NULL != opts.cache_dir) {
+        if (0 != (err = make_names(argv[arg], infname, outfname)) ||
+          0 != (err = cache_key(infname, key))) error_exit(err);
+        if (fetch_cached(key, outfname)) {
+            if (NULL != opts.trace && 0 != write_trace(opts.trace))
+              error_exit(ERR_WRITE);
+            return 0;
+        }
+    }
+    if (0 != (err = load_image(argv[arg], outfname, image)))
+      error_exit(err);
+    /*
+     * The netpbm flavor (and so the extension) depends on
+     * the image, so we can only name the output now.
+     */
+    if (FMT_PNM == opts.output_format) {
+        strcat(outfname, PNM_extension(image));
+    } else if (FMT_RAW == opts.output_format) {
+        strcat(outfname, ".raw");
+    } else {
+        strcat(outfname, ".tif");
+    }
+    /*
+     * Replace, rather than overwrite, any existing output: it
+     * may be a link to a file in a cache directory.
+     */
+    remove(outfname);
     if (NULL == (fp = fopen(outfname, "wb")))
         error_exit(ERR_WRITE);
 
-#ifdef _PNG2PPM_          /* WOK Wolfram M. Koerner */
-    err = write_PPM(fp, image);
-#else
-    err = write_TIFF(fp, image);
-#endif
-    
+    if (FMT_PNM == opts.output_format) {
+        err = write_PNM(fp, image);
+    } else if (FMT_RAW == opts.output_format) {
+        err = write_raw_files(fp, image, outfname);
+    } else if (0 == (err = open_TIFF(fp))) {
+        err = write_pages(image);
+        if (0 == err) err = close_TIFF();
+        else close_TIFF();
+    }
     fclose(fp);
+    free_image(image);
+    if (opts.memory_report) report_tempfiles();
+    if (NULL != opts.trace && 0 != write_trace(opts.trace) && 0 == err)
+      err = ERR_WRITE;
 
     if (0 != err) error_exit(err);
+    if (NULL != opts.cache_dir && 0 != store_cached(key, outfname))
+      print_warning(WARN_NO_CACHE);
     return 0;
 }
 
+#endif /* _PTOT_LIBRARY_ */
+
 /*
  * Print warning, but continue.  A bad code should never be
  * passed here, so that causes an assertion failure and exit.
@@ -113,10 +459,27 @@ print_warning(
     ASSERT(PTOT_NMESSAGES > 0);
     ASSERT(code >= 0 && code < PTOT_NMESSAGES);
 
+    if (NULL != ptot_callbacks && NULL != ptot_callbacks->warning) {
+        (*ptot_callbacks->warning)(ptot_callbacks->user, code,
+          ptot_error_messages[code]);
+        return;
+    }
     fprintf(stderr, "WARNING: %s.\n", ptot_error_messages[code]);
     fflush(stderr);
 }
 
+/*
+ * Message for an error or warning code, for library callers.
+ */
+
+char *
+ptot_message(
+    int code)
+{
+    if (code < 0 || code >= PTOT_NMESSAGES) code = 0;
+    return ptot_error_messages[code];
+}
+
 /*
  * Print fatal error and exit.
  */
@@ -166,15 +529,38 @@ read_PNG(
     int err;
 
     ASSERT(NULL != inf);
+
+    if (0 != (err = open_input(inf))) {
+        close_input();
+        return err;
+    }
+    return decode_PNG(image);
+}
+
+/*
+ * Read a PNG from whatever input open_input() or
+ * open_input_memory() has set up, and close the input.
+ */
+
+int
+decode_PNG(
+    IMG_INFO *image)
+{
+    int err;
+
     ASSERT(NULL != image);
 
     memset(image, 0, IMG_SIZE);
     memset(&ps, 0, sizeof ps);
 
-    ps.inf = inf;
     ps.image = image;
-    if (NULL == (ps.buf = (U8 *)malloc(IOBUF_SIZE)))
-      return ERR_MEMORY;
+    if (NULL == (ps.buf = (U8 *)malloc(IOBUF_SIZE))) {
+        close_input();
+        return ERR_MEMORY;
+    }
+    ps.animate = opts.animate;
+    ps.text_max = (0 != opts.max_text) ? opts.max_text :
+      DEFAULT_MAX_TEXT;
     /*
      * Skip signature and possible MacBinary header, and
      * verify signature. A more robust implementation might
@@ -182,10 +568,10 @@ read_PNG(
      * 1k bytes or so, but in practice, the method shown
      * is adequate or file I/O applications.
      */
-    fread(ps.buf, 1, 8, inf);
+    read_input(ps.buf, 8);
     ps.buf[8] = '\0';
     if (0 != memcmp(ps.buf, PNG_Signature, 8)) {
-        fread(ps.buf, 1, 128, inf);
+        read_input(ps.buf, 128);
         ps.buf[128] = '\0';
         if (0 != memcmp(ps.buf+120, PNG_Signature, 8)) {
             err = ERR_BAD_PNG;
@@ -196,7 +582,10 @@ read_PNG(
     ps.got_first_chunk = ps.got_first_idat = FALSE;
     do {
         if (0 != (err = get_chunk_header())) goto err_out;
-        if (0 != (err = decode_chunk())) goto err_out;
+        TRACE_BEGIN(TRACE_CHUNK, ps.current_chunk_name);
+        err = decode_chunk();
+        TRACE_END(TRACE_CHUNK);
+        if (0 != err) goto err_out;
         /*
          * IHDR must be the first chunk.
          */
@@ -222,10 +611,12 @@ read_PNG(
     if (0 != (err = validate_image(image))) goto err_out;
 
     ASSERT(0 == ps.bytes_remaining);
-    if (EOF != getc(inf)) print_warning(WARN_EXTRA_BYTES);
+    if (0 != read_input(ps.buf, 1)) print_warning(WARN_EXTRA_BYTES);
 
     err = 0;
 err_out:
+    close_input();
+    remove_all_tempfiles();
     ASSERT(NULL != ps.buf);
     free(ps.buf);
     return err;
@@ -251,7 +642,16 @@ decode_chunk(
 
     case PNG_CN_IHDR:   err = decode_IHDR();    break;
     case PNG_CN_gAMA:   err = decode_gAMA();    break;
-    case PNG_CN_IDAT:   err = decode_IDAT();    break;
+    /*
+     * All IDATs are normally consumed by the first call to
+     * decode_IDAT(). We only see more here if the decoder
+     * stopped early, or if they are empty trailing chunks.
+     */
+    case PNG_CN_IDAT:
+        if (!ps.got_first_idat) err = decode_IDAT();
+        else if (ps.stop_inflate) err = seek_chunk_data();
+        else err = skip_chunk_data();
+        break;
     /*
      * PNG allows a suggested colormap for 24-bit images. TIFF
      * does not, and PLTE is not copy-safe, so we discard it.
@@ -262,6 +662,7 @@ decode_chunk(
         break;
 
     case PNG_CN_tRNS:   err = decode_tRNS();    break;
+    case PNG_CN_bKGD:   err = decode_bKGD();    break;
     case PNG_CN_cHRM:   err = decode_cHRM();    break;
     case PNG_CN_pHYs:   err = decode_pHYs();    break;
     case PNG_CN_oFFs:   err = decode_oFFs();    break;
@@ -269,10 +670,14 @@ decode_chunk(
 
     case PNG_CN_tEXt:   err = decode_text();    break;
     case PNG_CN_zTXt:   err = decode_text();    break;
+    case PNG_CN_iTXt:   err = decode_text();    break;
+
+    case PNG_CN_acTL:   err = decode_acTL();    break;
+    case PNG_CN_fcTL:   err = decode_fcTL();    break;
+    case PNG_CN_fdAT:   err = decode_fdAT();    break;
 
     case PNG_CN_tIME:   /* Will be recreated */
     case PNG_CN_hIST:   /* Not safe to copy */
-    case PNG_CN_bKGD:
         err = skip_chunk_data();
         break;
     case PNG_CN_IEND:   /* We're done */
@@ -283,7 +688,8 @@ decode_chunk(
      * really only applies to unknown chunks. We know what it is
      * just like PLTE, and that it's probably safe to put in the
      * output file. hIST and bKGD are not (modifications to the
-     * output file might invalidate them), so we leave them out.
+     * output file might invalidate them), so we leave them out;
+     * bKGD is only kept for --flatten.
      */
     case PNG_CN_sBIT:
         err = copy_unknown_chunk_data();
@@ -310,10 +716,9 @@ get_chunk_header(
 {
     int byte;
 
-    ASSERT(NULL != ps.inf);
     ASSERT(NULL != ps.buf);
 
-    if (8 != fread(ps.buf, 1, 8, ps.inf)) return ERR_READ;
+    if (8 != read_input(ps.buf, 8)) return ERR_READ;
 
     ps.bytes_remaining = BE_GET32(ps.buf);
     ps.current_chunk_name= BE_GET32(ps.buf+4);
@@ -340,11 +745,10 @@ U32
 get_chunk_data(
     U32 bytes_requested)
 {
-    ASSERT(NULL != ps.inf);
     ASSERT(NULL != ps.buf);
 
-    ps.bytes_in_buf = (U32)fread(ps.buf, 1,
-      (size_t)min(IOBUF_SIZE, bytes_requested), ps.inf);
+    ps.bytes_in_buf = read_input(ps.buf,
+      min(IOBUF_SIZE, bytes_requested));
 
     ASSERT((S32)(ps.bytes_remaining) >= ps.bytes_in_buf);
     ps.bytes_remaining -= ps.bytes_in_buf;
@@ -353,6 +757,28 @@ get_chunk_data(
     return ps.bytes_in_buf;
 }
 
+/*
+ * Skip the rest of the current chunk without reading it, when
+ * we know we have no further use for its contents. We can't
+ * check the CRC of a chunk we haven't read, so that check is
+ * turned off for this chunk. skip_input() reads and discards
+ * it if the input can't seek (a pipe, say).
+ */
+
+int
+seek_chunk_data(
+    void)
+{
+    ASSERT(NULL != ps.buf);
+
+    if (0 != skip_input(ps.bytes_remaining)) return ERR_READ;
+
+    ps.bytes_remaining = 0;
+    ps.bytes_in_buf = 0;
+    ps.skip_crc = TRUE;
+    return 0;
+}
+
 /*
  * Assuming we have read a chunk header and all the chunk data,
  * we now check to see that the CRC stored at the end of the
@@ -363,12 +789,12 @@ int
 verify_chunk_crc(
     void)
 {
-    ASSERT(NULL != ps.inf);
     ASSERT(NULL != ps.buf);
 
-    if (4 != fread(ps.buf, 1, 4, ps.inf)) return ERR_READ;
+    if (4 != read_input(ps.buf, 4)) return ERR_READ;
 
-    if ((ps.crc ^ 0xFFFFFFFFL) != BE_GET32(ps.buf)) {
+    if (ps.skip_crc) ps.skip_crc = FALSE;
+    else if ((ps.crc ^ 0xFFFFFFFFL) != BE_GET32(ps.buf)) {
         print_warning(WARN_BAD_CRC);
     }
     return 0;
@@ -384,7 +810,6 @@ static int
 decode_IHDR(
     void)
 {
-    ASSERT(NULL != ps.inf);
     ASSERT(NULL != ps.buf);
     ASSERT(NULL != ps.image);
 
@@ -428,8 +853,14 @@ decode_IHDR(
 
     if ((ps.buf[8] < 8) && (2 == ps.buf[9] || 4 == ps.buf[9] ||
       6 == ps.buf[9])) return ERR_BAD_PNG;
+    /*
+     * PNG limits both dimensions to 2^31-1.
+     */
+    if (0 == ps.image->width || ps.image->width > 0x7FFFFFFFL ||
+      0 == ps.image->height || ps.image->height > 0x7FFFFFFFL)
+      return ERR_BAD_PNG;
 
-    return 0;
+    return check_image_size(ps.image);
 }
 
 /*
@@ -440,7 +871,6 @@ static int
 decode_gAMA(
     void)
 {
-    ASSERT(NULL != ps.inf);
     ASSERT(NULL != ps.buf);
     ASSERT(NULL != ps.image);
 
@@ -471,7 +901,6 @@ decode_PLTE(
 {
     U32 bytes_read;
 
-    ASSERT(NULL != ps.inf);
     ASSERT(NULL != ps.buf);
     ASSERT(NULL != ps.image);
 
@@ -495,8 +924,9 @@ decode_PLTE(
 }
 
 /*
- * Copy transparency data into structure. We will later expand the
- * TIFF data into full alpha to account for its lack of this data.
+ * Copy transparency data into structure. With --expand-trns, the
+ * output stage later expands it into a full alpha channel, since
+ * TIFF has no equivalent.
  */
 
 static int
@@ -506,7 +936,6 @@ decode_tRNS(
     int i;
     U32 bytes_read;
 
-    ASSERT(NULL != ps.inf);
     ASSERT(NULL != ps.buf);
     ASSERT(NULL != ps.image);
 
@@ -521,7 +950,7 @@ decode_tRNS(
         memcpy(ps.image->palette_trans_bytes,
           ps.buf, (size_t)bytes_read);
 
-        for (i = bytes_read; i < ps.image->palette_size; ++i)
+        for (i = bytes_read; i < 256; ++i)
           ps.image->palette_trans_bytes[i] = 255;
 
     } else if (ps.image->is_color) {
@@ -531,18 +960,57 @@ decode_tRNS(
           ps.image->trans_values[i] = BE_GET16(ps.buf + 2 * i);
     } else {
         if (ps.bytes_remaining < 2) return ERR_BAD_PNG;
+        if (2 != get_chunk_data(2)) return ERR_READ;
         ps.image->trans_values[0] = BE_GET16(ps.buf);
     }
     return 0;
 }
 
+/*
+ * Copy the background color into the structure, for --flatten.
+ * A palette index is looked up now, so that the color is always
+ * RGB or gray. Gray and RGB values are in the image's own bit
+ * depth. An index past the end of the palette is ignored.
+ */
+
+static int
+decode_bKGD(
+    void)
+{
+    int i, entry;
+
+    ASSERT(NULL != ps.buf);
+    ASSERT(NULL != ps.image);
+
+    if (ps.image->is_palette) {
+        if (ps.bytes_remaining < 1) return ERR_BAD_PNG;
+        if (1 != get_chunk_data(1)) return ERR_READ;
+        entry = ps.buf[0];
+        if (entry >= ps.image->palette_size) return 0;
+        for (i = 0; i < 3; ++i) {
+            ps.image->background_color[i] =
+              ps.image->palette[3 * entry + i];
+        }
+    } else if (ps.image->is_color) {
+        if (ps.bytes_remaining < 6) return ERR_BAD_PNG;
+        if (6 != get_chunk_data(6)) return ERR_READ;
+        for (i = 0; i < 3; ++i)
+          ps.image->background_color[i] = BE_GET16(ps.buf + 2 * i);
+    } else {
+        if (ps.bytes_remaining < 2) return ERR_BAD_PNG;
+        if (2 != get_chunk_data(2)) return ERR_READ;
+        ps.image->background_color[0] = BE_GET16(ps.buf);
+    }
+    ps.image->has_background = TRUE;
+    return 0;
+}
+
 static int
 decode_cHRM(
     void)
 {
     int i;
 
-    ASSERT(NULL != ps.inf);
     ASSERT(NULL != ps.buf);
     ASSERT(NULL != ps.image);
 
@@ -559,7 +1027,6 @@ static int
 decode_pHYs(
     void)
 {
-    ASSERT(NULL != ps.inf);
     ASSERT(NULL != ps.buf);
     ASSERT(NULL != ps.image);
 
@@ -579,7 +1046,6 @@ static int
 decode_oFFs(
     void)
 {
-    ASSERT(NULL != ps.inf);
     ASSERT(NULL != ps.buf);
     ASSERT(NULL != ps.image);
 
@@ -607,7 +1073,6 @@ static int
 decode_sCAL(
     void)
 {
-    ASSERT(NULL != ps.inf);
     ASSERT(NULL != ps.buf);
     ASSERT(NULL != ps.image);
 
@@ -632,7 +1097,7 @@ decode_sCAL(
  * Skip all remaining data in current chunk.
  */
 
-static int
+int
 skip_chunk_data(
     void)
 {
@@ -656,14 +1121,28 @@ static int
 validate_image(
     IMG_INFO *image)
 {
+    U32 i;
+
     if (0 == image->width || 0 == image->height)
       return ERR_BAD_IMAGE;
     if (image->samples_per_pixel < 1 ||
       image->samples_per_pixel > 4) return ERR_BAD_IMAGE;
     if (image->is_palette && (image->palette_size < 1 ||
       image->palette_size > 256)) return ERR_BAD_IMAGE;
-    if (NULL == image->pixel_data_file) return ERR_BAD_IMAGE;
-
+    if (NULL == image->pixel_data && !ps.stream_rows)
+      return ERR_BAD_IMAGE;
+    /*
+     * An animation that ends early (a last fcTL with no image
+     * data) is cut short rather than rejected outright.
+     */
+    for (i = 0; i < image->frame_count; ++i) {
+        if (!image->frames[i].is_default &&
+          -1L == image->frames[i].data_offset) {
+            print_warning(WARN_BAD_PNG);
+            image->frame_count = i;
+            break;
+        }
+    }
     return 0;
 }
 
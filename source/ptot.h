@@ -49,8 +49,20 @@ typedef signed char     S8;
 typedef unsigned char   U8;
 typedef signed short    S16;
 typedef unsigned short  U16;
+/*
+ * S32 and U32 must be exactly 32 bits, because PUT32 and GET32
+ * use them to store TIFF fields. Where int is 32 bits we use it,
+ * since long is 64 on most 64-bit Unix systems. Sizes and file
+ * offsets that can pass 4GB are kept in size_t and long instead.
+ */
+#include <limits.h>
+#if UINT_MAX == 0xFFFFFFFFUL
+typedef signed int      S32;
+typedef unsigned int    U32;
+#else
 typedef signed long     S32;
 typedef unsigned long   U32;
+#endif
 
 #ifndef TRUE
 #  define TRUE 1
@@ -118,10 +130,16 @@ typedef unsigned long   U32;
 #define PNG_CN_hIST 0x68495354L
 #define PNG_CN_tEXt 0x74455874L
 #define PNG_CN_zTXt 0x7A545874L
+#define PNG_CN_iTXt 0x69545874L
 #define PNG_CN_pHYs 0x70485973L
 #define PNG_CN_oFFs 0x6F464673L
 #define PNG_CN_tIME 0x74494D45L
 #define PNG_CN_sCAL 0x7343414CL
+#define PNG_CN_sRGB 0x73524742L
+#define PNG_CN_iCCP 0x69434350L
+#define PNG_CN_acTL 0x6163544CL     /* APNG animation chunks */
+#define PNG_CN_fcTL 0x6663544CL
+#define PNG_CN_fdAT 0x66644154L
 
 #define PNG_CF_Ancillary    0x20000000L /* Chunk flags */
 #define PNG_CF_Private      0x00200000L
@@ -167,7 +185,8 @@ typedef unsigned long   U32;
 #define TIFF_DT_RATIONAL    5
 #define TIFF_DT_UNDEFINED   7
 
-#define TIFF_TAG_ImageWidth         256 /* Tag values */
+#define TIFF_TAG_NewSubfileType     254 /* Tag values */
+#define TIFF_TAG_ImageWidth         256
 #define TIFF_TAG_ImageLength        257
 #define TIFF_TAG_BitsPerSample      258
 #define TIFF_TAG_Compression        259
@@ -185,6 +204,7 @@ typedef unsigned long   U32;
 #define TIFF_TAG_XPosition          286
 #define TIFF_TAG_YPosition          287
 #define TIFF_TAG_ResolutionUnit     296
+#define TIFF_TAG_PageNumber         297
 #define TIFF_TAG_TransferFunction   301
 #define TIFF_TAG_Software           305
 #define TIFF_TAG_DateTime           306
@@ -219,6 +239,7 @@ typedef unsigned long   U32;
 #define TIFF_RU_NONE    1   /* Resolution units */
 #define TIFF_RU_CM      3
 #define TIFF_ES_UNASSOC 2   /* Extra sample type */
+#define TIFF_ST_PAGE    2   /* Subfile type: page of many */
 
 /*
  * Structure for holding miscellaneous image information. The
@@ -234,6 +255,29 @@ typedef unsigned long   U32;
 
 #define N_KEYWORDS 5
 
+#define APNG_DISPOSE_NONE       0   /* APNG frame dispose_op */
+#define APNG_DISPOSE_BACKGROUND 1
+#define APNG_DISPOSE_PREVIOUS   2
+#define APNG_BLEND_SOURCE       0   /* APNG frame blend_op */
+#define APNG_BLEND_OVER         1
+
+/*
+ * One frame of an animated PNG, as described by its fcTL chunk.
+ * The frame's pixels are kept (in the same layout as the main
+ * pixel data file) starting at data_offset in the image's
+ * frame_data file, or in pixel_data if the frame is the IDAT
+ * image.
+ */
+
+typedef struct _apng_frame {
+    U32 width, height;
+    U32 x_offset, y_offset;
+    U16 delay_num, delay_den;
+    int dispose_op, blend_op;
+    int is_default;             /* Frame is the IDAT image */
+    long data_offset;           /* -1 until decoded */
+} APNG_FRAME;
+
 typedef struct _image_info {
     U32 width, height;
     U32 xoffset, yoffset;
@@ -246,7 +290,8 @@ typedef struct _image_info {
     int samples_per_pixel;
     int bits_per_sample;
     int significant_bits[4];
-    int background_color[4];
+    int background_color[4];    /* From bKGD; gray in [0] */
+    int has_background;         /* bKGD seen */
     int is_color, has_alpha, has_trns;
     int is_interlaced, is_palette;
     int palette_size;
@@ -254,9 +299,15 @@ typedef struct _image_info {
     U16 trans_values[3];
     U8 palette_trans_bytes[256];
     char *keywords[N_KEYWORDS];
-    char *pixel_data_file;      /* Where to find the pixels */
-    U32 png_data_size;
-    char *png_data_file;    /* Untranslatable PNG chunks */
+    U8 keyword_is_utf8[N_KEYWORDS]; /* Text came from iTXt */
+    FILE *pixel_data;           /* Where to find the pixels */
+    U8 *png_data;               /* Untranslatable PNG chunks */
+    U32 png_data_size, png_data_alloc;
+    int is_animated;            /* Valid acTL seen */
+    U32 num_frames, num_plays;  /* As given in acTL */
+    U32 frame_count;            /* Frames actually described */
+    APNG_FRAME *frames;
+    FILE *frame_data;           /* Decoded fdAT data */
 } IMG_INFO;
 
 #define IMG_SIZE (sizeof (struct _image_info))
@@ -264,6 +315,57 @@ typedef struct _image_info {
 extern char *keyword_table[N_KEYWORDS];
 extern U16 ASCII_tags[N_KEYWORDS];
 
+/*
+ * Command-line options. These are filled in by main() and
+ * read by whichever module they affect.
+ */
+
+#define FMT_TIFF    0   /* Output formats */
+#define FMT_PNM     1
+#define FMT_RAW     2
+
+typedef struct _ptot_options {
+    int output_format;
+    int crop;                   /* --crop=x,y,w,h given */
+    U32 crop_x, crop_y, crop_width, crop_height;
+    U32 thumbnail;              /* Thumbnail size, 0 if none */
+    int expand_trns;            /* Turn tRNS into alpha */
+    double target_gamma;        /* --apply-gamma, 0.0 if none */
+    char *multipage;            /* --multipage output, or NULL */
+    U32 max_text;               /* --max-text, 0 for default */
+    char *tmpdir;               /* --tmpdir, or NULL */
+    char *build_index;          /* --build-index file, or NULL */
+    char *use_index;            /* --index file, or NULL */
+    U32 index_rows;             /* --index-rows, 0 for default */
+    char *cache_dir;            /* --cache-dir, or NULL */
+    long max_memory;            /* --max-memory, 0 if none */
+    int memory_report;          /* --memory-report given */
+    U32 row_align;              /* --row-align, 0 if none */
+    char *trace;                /* --trace file, or NULL */
+    int flatten;                /* --flatten given */
+    int flatten_color[3];       /* Its 8-bit RGB, or -1 for bKGD */
+    int animate;                /* Make APNG frames into pages */
+} PTOT_OPTIONS;
+
+/*
+ * Callbacks for programs using ptot as a library (see
+ * libptot.h). NULL members are not called.
+ */
+
+typedef struct _ptot_callbacks {
+    int (*info)(void *, IMG_INFO *);        /* Before the rows */
+    int (*row)(void *, U32, U8 *);          /* Each row, in order */
+    void (*warning)(void *, int, char *);   /* Instead of stderr */
+    void *user;                             /* Passed to each */
+} PTOT_CALLBACKS;
+
+extern PTOT_CALLBACKS *ptot_callbacks;
+
+#define DEFAULT_MAX_TEXT 0x1000000L /* 16MB */
+#define DEFAULT_INDEX_SPAN 0x100000L /* Rows per 1MB of image */
+
+extern PTOT_OPTIONS opts;
+
 /*
  * Local ASSERT macro.  Assumes the function Assert() is
  * defined somewhere in the calling program (in this case,
@@ -293,25 +395,123 @@ void print_warning(int);
 void error_exit(int);
 void Assert(char *, int);
 int read_PNG(FILE *, IMG_INFO *);
+int decode_PNG(IMG_INFO *);
+void free_image(IMG_INFO *);
 int get_chunk_header(void);
 U32 get_chunk_data(U32);
+int seek_chunk_data(void);
+int skip_chunk_data(void);
 int verify_chunk_crc(void);
 
 int decode_IDAT(void);
 U8 fill_buf(void);
-void flush_window(U32);
+int flush_window(U32);
 int decode_text(void);
 int copy_unknown_chunk_data(void);
 size_t new_line_size(IMG_INFO *, int, int);
 
 int get_local_byte_order(void);
 int write_TIFF(FILE *, IMG_INFO *);
-
-int create_tempfile(int);
+int open_TIFF(FILE *);
+int write_TIFF_image(IMG_INFO *);
+int close_TIFF(void);
+
+int write_PNM(FILE *, IMG_INFO *);
+char *PNM_extension(IMG_INFO *);
+void build_palette_lut(IMG_INFO *, U8 *);
+
+int write_RAW(FILE *, IMG_INFO *);
+int write_RAW_description(FILE *, IMG_INFO *, char *);
+
+int start_deflate(int (*)(U8 *, U32));
+int deflate_bytes(U8 *, U32);
+int finish_deflate(void);
+void end_deflate(void);
+
+size_t pixel_row_size(IMG_INFO *);
+int check_image_size(IMG_INFO *);
+int setup_transforms(IMG_INFO *);
+void end_transforms(void);
+int read_pixel_row(FILE *, U8 *);
+U16 *gamma_table(double, double, int);
+
+void check_sequence(U32);
+int decode_acTL(void);
+int decode_fcTL(void);
+int decode_fdAT(void);
+int start_animation(IMG_INFO *);
+int compose_frame(void);
+void end_animation(void);
+
+int open_input(FILE *);
+int open_input_memory(U8 *, size_t);
+void close_input(void);
+U32 next_input(U8 **, U32);
+U32 read_input(U8 *, U32);
+int skip_input(U32);
+int seek_input(long);
+long input_offset(void);
+
+int open_output(FILE *);
+int close_output(void);
+int write_output(U8 *, U32);
+int pad_output(int);
+U32 output_offset(void);
+int patch_output(U32, U8 *, U32);
+
+int start_adam7(void);
+int adam7_bytes(U8 *, U32);
+int finish_adam7(void);
+int scatter_adam7(FILE *);
+void end_adam7(void);
+
+FILE *new_tempfile(long);
+void free_tempfile(FILE *);
+int create_tempfile(int, long);
 int open_tempfile(int);
-void close_all_tempfiles(void);
+void report_tempfiles(void);
 void remove_all_tempfiles(void);
 
+int index_source(char *);
+int start_index(void);
+int restart_index(void);
+int end_index(void);
+void checkpoint_inflate(void);
+void resume_inflate(void);
+
+int cache_key(char *, char *);
+int png_fingerprint(char *, U32 *, U32 *, long *);
+int fetch_cached(char *, char *);
+int store_cached(char *, char *);
+
+/*
+ * Stages recorded by --trace (trace.c). TRACE_BEGIN and TRACE_END
+ * cost a test of "tracing" when it's off. The number given to
+ * TRACE_BEGIN goes with the event: a chunk name, a strip number,
+ * a byte count, as trace.c says for each stage.
+ */
+
+#define TRACE_CHUNK         0
+#define TRACE_INFLATE_BLOCK 1
+#define TRACE_FLUSH_WINDOW  2
+#define TRACE_REPACK        3
+#define TRACE_STRIP         4
+#define TRACE_READ_BLOCK    5
+#define TRACE_WRITE_BLOCK   6
+#define TRACE_INPUT_WAIT    7
+#define TRACE_OUTPUT_WAIT   8
+#define TRACE_UNFILTER_PASS 9
+#define TRACE_SCATTER_ROWS  10
+
+#define TRACE_BEGIN(s,n) (tracing?trace_event((s),'B',(U32)(n)):(void)0)
+#define TRACE_END(s)     (tracing?trace_event((s),'E',0L):(void)0)
+
+extern int tracing;
+
+int start_trace(void);
+void trace_event(int, int, U32);
+int write_trace(char *);
+
 /*
  * Interface to Mark Adler's inflate.c
  */
@@ -326,7 +526,10 @@ typedef void *voidp;
 #define slide (ps.inflate_window)
 #define WSIZE ((size_t)(ps.inflate_window_size))
 #define NEXTBYTE ((--ps.bytes_in_buf>=0)?(*ps.bufp++):fill_buf())
-#define FLUSH(n) flush_window(n)
+#define FLUSH(n) {int f_;TRACE_BEGIN(TRACE_FLUSH_WINDOW,(n));\
+  f_=flush_window(n);TRACE_END(TRACE_FLUSH_WINDOW);if(0!=f_)return 1;}
+#define CHECKPOINT checkpoint_inflate();
+#define RESUME resume_inflate();
 #define memzero(a,s) memset((a),0,(s))
 #define qflag 1
 
@@ -340,12 +543,11 @@ typedef void *voidp;
 #define IOBUF_SIZE 8192 /* Must be at least 768 for PLTE */
 
 typedef struct _png_state {
-    FILE *inf, *tf[7];
-    char *tfnames[7];
+    FILE *tf[7];
     IMG_INFO *image;
     U8 *buf, *bufp;
     U32 crc, bytes_remaining;
-    U32 inflated_chunk_size;
+    unsigned long inflated_chunk_size;
     U32 current_chunk_name;
     S32 bytes_in_buf;       /* Must be signed! */
     U32 inflate_window_size;
@@ -358,7 +560,26 @@ typedef struct _png_state {
     int interlace_pass;
     U32 current_row, current_col;
     int cur_filter;
+    void (*unfilter)(U8 *, U8 *, U8 *, size_t, size_t, int);
     int got_first_chunk;
     int got_first_idat;
+    int stop_inflate;       /* Set when no more rows are wanted */
+    int skip_crc;           /* Chunk data was skipped by seeking */
+    int cropping;
+    U32 crop_x, crop_y, crop_width, crop_height;
+    U32 thumb_factor;       /* Reduction, 1 if not a thumbnail */
+    int last_pass;          /* Last interlace pass needed */
+    U32 thumb_rows;         /* Rows summed into thumb_sums */
+    double *thumb_sums;
+    int animate;            /* Decode APNG frames */
+    U32 next_sequence;      /* Expected fcTL/fdAT number */
+    APNG_FRAME *frame;      /* Frame being decoded, or NULL */
+    U8 *text;               /* Text chunk being decoded */
+    U32 text_size, text_alloc;
+    U32 text_max;           /* Longest text we'll keep */
+    int stream_rows;        /* Rows go to a callback, not a file */
+    U8 *row_buf;            /* Unpacked sub-byte row */
+    int decode_err;         /* Error inside inflate, if any */
+    int adam7;              /* Passes go to adam7.c's threads */
 } PNG_STATE;
 
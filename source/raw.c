@@ -0,0 +1,279 @@
+/*
+ * raw.c
+ *
+ * Raw pixel output for PNG-to-TIFF utility. The pixels are
+ * written with no header at all, row after row, so that a
+ * program can map the file and index it directly. Everything
+ * needed to do so (and the rest of what we know about the image)
+ * goes in a small JSON file alongside.
+ *
+ * Samples are bytes, or 16-bit words in the machine's own byte
+ * order. Palette images are expanded through the palette, as
+ * for netpbm output. With --row-align, each row is padded with
+ * zeros to a multiple of that many bytes.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ptot.h"
+
+#define DEFINE_ENUMS
+#include "errors.h"
+
+static int raw_channels(IMG_INFO *);
+static size_t raw_row_size(IMG_INFO *);
+static int utf8_length(U8 *);
+static void write_json_string(FILE *, char *, int);
+
+/*
+ * Samples per pixel once palette images are expanded.
+ */
+
+static int
+raw_channels(
+    IMG_INFO *image)
+{
+    if (image->is_palette) return 3;
+    return image->samples_per_pixel;
+}
+
+/*
+ * Bytes from the start of one row to the start of the next.
+ */
+
+static size_t
+raw_row_size(
+    IMG_INFO *image)
+{
+    size_t bytes, align;
+
+    bytes = (size_t)image->width * raw_channels(image) *
+      ((16 == image->bits_per_sample) ? 2 : 1);
+    align = (0 == opts.row_align) ? 1 : (size_t)opts.row_align;
+    return ((bytes + align - 1) / align) * align;
+}
+
+/*
+ * Write the image's pixels to the raw file.
+ */
+
+int
+write_RAW(
+    FILE *outf,
+    IMG_INFO *image)
+{
+    int err;
+    U32 row, col;
+    size_t in_size, out_size;
+    U8 *in_line, *out_line, *lut, *sp, *dp;
+    FILE *inf;
+
+    ASSERT(NULL != outf);
+    ASSERT(NULL != image);
+    ASSERT(NULL != image->pixel_data);
+
+    in_size = pixel_row_size(image);
+    out_size = raw_row_size(image);
+
+    in_line = (U8 *)malloc(in_size);
+    out_line = (U8 *)malloc(out_size);
+    lut = NULL;
+    if (image->is_palette) lut = (U8 *)malloc(3 * 256);
+
+    err = ERR_MEMORY;
+    if (NULL == in_line || NULL == out_line) goto wr_err_out;
+    if (image->is_palette) {
+        if (NULL == lut) goto wr_err_out;
+        build_palette_lut(image, lut);
+    }
+    memset(out_line, 0, out_size);
+
+    if (0 != (err = open_output(outf))) goto wr_err_out;
+    inf = image->pixel_data;
+    err = ERR_READ;
+    if (0 != fseek(inf, 0L, SEEK_SET)) goto wr_err_out;
+
+    for (row = 0; row < image->height; ++row) {
+        if (0 != (err = read_pixel_row(inf, in_line)))
+          goto wr_err_out;
+        sp = in_line;
+        dp = out_line;
+        if (image->is_palette) {
+            for (col = 0; col < image->width; ++col) {
+                memcpy(dp, lut + 3 * *sp++, 3);
+                dp += 3;
+            }
+        } else if (16 == image->bits_per_sample) {
+            for (col = 0; col < in_size; col += 2) {
+                PUT16(dp, BE_GET16(sp));
+                sp += 2;
+                dp += 2;
+            }
+        } else memcpy(out_line, in_line, in_size);
+
+        if (0 != (err = write_output(out_line, (U32)out_size)))
+          goto wr_err_out;
+    }
+    err = 0;
+wr_err_out:
+    if (0 != close_output() && 0 == err) err = ERR_WRITE;
+    if (NULL != out_line) free(out_line);
+    if (NULL != in_line) free(in_line);
+    if (NULL != lut) free(lut);
+    return err;
+}
+
+/*
+ * Length of the UTF-8 sequence starting at "p", or 0 if there
+ * isn't a valid one there.
+ */
+
+static int
+utf8_length(
+    U8 *p)
+{
+    int length, i;
+
+    if (*p < 0x80) return 1;
+    else if (*p >= 0xC2 && *p <= 0xDF) length = 2;
+    else if (*p >= 0xE0 && *p <= 0xEF) length = 3;
+    else if (*p >= 0xF0 && *p <= 0xF4) length = 4;
+    else return 0;
+
+    for (i = 1; i < length; ++i) {
+        if (0x80 != (p[i] & 0xC0)) return 0;
+    }
+    return length;
+}
+
+/*
+ * Write a text string as a JSON string. Text from iTXt chunks
+ * ("is_utf8") is UTF-8, and is copied as it is, except that any
+ * byte not part of a valid sequence becomes U+FFFD. tEXt and
+ * zTXt text is Latin-1, and is converted.
+ */
+
+static void
+write_json_string(
+    FILE *fp,
+    char *text,
+    int is_utf8)
+{
+    U8 *p;
+    int length;
+
+    putc('"', fp);
+    for (p = (U8 *)text; '\0' != *p; p += length) {
+        length = 1;
+        if ('"' == *p || '\\' == *p) fprintf(fp, "\\%c", *p);
+        else if ('\n' == *p) fputs("\\n", fp);
+        else if (*p < 0x20 || 0x7F == *p)
+          fprintf(fp, "\\u%04x", *p);
+        else if (*p < 0x80) putc(*p, fp);
+        else if (!is_utf8) {
+            putc(0xC0 | (*p >> 6), fp);
+            putc(0x80 | (*p & 0x3F), fp);
+        } else if (0 == (length = utf8_length(p))) {
+            fputs("\\ufffd", fp);
+            length = 1;
+        } else fwrite(p, 1, (size_t)length, fp);
+    }
+    putc('"', fp);
+}
+
+/*
+ * Write the JSON description of the raw file "raw_name", which
+ * holds the image's pixels.
+ */
+
+int
+write_RAW_description(
+    FILE *fp,
+    IMG_INFO *image,
+    char *raw_name)
+{
+    static char *colors[] = { "white", "red", "green", "blue" };
+    size_t row_size;
+    char *color, *cp;
+    int i, first;
+
+    ASSERT(NULL != fp);
+    ASSERT(NULL != image);
+    ASSERT(NULL != raw_name);
+
+    if (image->is_color || image->is_palette)
+      color = image->has_alpha ? "rgb_alpha" : "rgb";
+    else color = image->has_alpha ? "gray_alpha" : "gray";
+    row_size = raw_row_size(image);
+    /*
+     * The raw file will be next to this one, so give its name
+     * without the directory.
+     */
+    for (cp = raw_name; '\0' != *cp; ++cp) {
+        if ('/' == *cp || '\\' == *cp || ':' == *cp)
+          raw_name = cp + 1;
+    }
+
+    fprintf(fp, "{\n  \"file\": ");
+    write_json_string(fp, raw_name, TRUE);
+    fprintf(fp, ",\n  \"width\": %lu,\n  \"height\": %lu,\n",
+      (unsigned long)image->width, (unsigned long)image->height);
+    fprintf(fp, "  \"channels\": %d,\n  \"color\": \"%s\",\n",
+      raw_channels(image), color);
+    fprintf(fp, "  \"bits_per_sample\": %d,\n",
+      (16 == image->bits_per_sample) ? 16 : 8);
+    fprintf(fp, "  \"byte_order\": \"%s\",\n",
+      (TIFF_BO_Intel == get_local_byte_order()) ? "little" : "big");
+    fprintf(fp, "  \"row_bytes\": %lu,\n  \"data_bytes\": %.0f,\n",
+      (unsigned long)row_size, (double)row_size * image->height);
+    fprintf(fp, "  \"source_interlaced\": %s",
+      image->is_interlaced ? "true" : "false");
+
+    if (0.0 != image->source_gamma)
+      fprintf(fp, ",\n  \"gamma\": %.5f", image->source_gamma);
+    if (0 != image->chromaticities[0]) {
+        fprintf(fp, ",\n  \"chromaticities\": {");
+        for (i = 0; i < 4; ++i) {
+            fprintf(fp, "%s\"%s\": [%.5f, %.5f]",
+              (0 == i) ? "" : ", ", colors[i],
+              image->chromaticities[2 * i] / 100000.0,
+              image->chromaticities[2 * i + 1] / 100000.0);
+        }
+        putc('}', fp);
+    }
+    if (0 != image->xres) {
+        fprintf(fp, ",\n  \"resolution\": {\"x\": %lu, \"y\": %lu, "
+          "\"unit\": \"%s\"}", (unsigned long)image->xres,
+          (unsigned long)image->yres,
+          (PNG_MU_Meter == image->resolution_unit) ? "meter" :
+          "none");
+    }
+    if (0 != image->xoffset || 0 != image->yoffset) {
+        fprintf(fp, ",\n  \"offset\": {\"x\": %ld, \"y\": %ld, "
+          "\"unit\": \"%s\"}", (long)(S32)image->xoffset,
+          (long)(S32)image->yoffset,
+          (PNG_MU_Micrometer == image->offset_unit) ?
+          "micrometer" : "pixel");
+    }
+    first = TRUE;
+    for (i = 0; i < N_KEYWORDS; ++i) {
+        if (NULL == image->keywords[i]) continue;
+        fprintf(fp, first ? ",\n  \"text\": {\n    " : ",\n    ");
+        write_json_string(fp, keyword_table[i], TRUE);
+        fprintf(fp, ": ");
+        write_json_string(fp, image->keywords[i],
+          image->keyword_is_utf8[i]);
+        first = FALSE;
+    }
+    if (!first) fprintf(fp, "\n  }");
+    fprintf(fp, "\n}\n");
+
+    if (0 != fflush(fp) || ferror(fp)) return ERR_WRITE;
+    return 0;
+}
+
+/*
+ * End of raw.c
+ */
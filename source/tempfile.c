@@ -3,6 +3,19 @@
  *
  * Temporary file handline for ptot.
  *
+ * Temporary files are open streams rather than names, so that
+ * they can be anonymous: they have no name that another copy of
+ * ptot could collide with, and they vanish when closed, or when
+ * the program exits, even if it crashes. They go in the --tmpdir
+ * directory if given, else in $TMPDIR, else wherever tmpfile()
+ * puts them.
+ *
+ * With --max-memory, a file whose largest size is known when it
+ * is created is kept in memory instead, as long as all such
+ * files together stay within the budget. This needs fmemopen()
+ * (POSIX.1-2008), so it is only built with _PTOT_MEMFILES_
+ * defined; without it, --max-memory just reports.
+ *
  **********
  *
  * HISTORY
@@ -11,9 +24,20 @@
  *          <URL:http://www.piclab.com/piclab/index.html>
  */
 
+#if defined(_PTOT_MEMFILES_)
+#  define _XOPEN_SOURCE 700     /* For fmemopen() too */
+#elif defined(_PTOT_POSIX_)
+#  define _XOPEN_SOURCE 500     /* For mkstemp() and fdopen() */
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+
+#ifdef _PTOT_POSIX_
+#  include <unistd.h>
+#endif
 
 #include "ptot.h"
 
@@ -22,51 +46,240 @@
 
 extern PNG_STATE ps;
 
-int
-create_tempfile(
-    int pass)
+#ifndef _PTOT_POSIX_
+/*
+ * Without mkstemp() we can't unlink a file and keep it open, so
+ * files in a given directory have names, which we remember so
+ * free_tempfile() can remove them.
+ */
+
+#define MAX_NAMED 16
+
+static struct _named_tempfile {
+    FILE *fp;
+    char *name;
+} named[MAX_NAMED];
+static unsigned long serial;
+#endif
+
+/*
+ * Scratch storage used, for --max-memory and its report.
+ */
+
+#define MAX_MEMFILES 16
+
+static struct _scratch_state {
+    struct _memfile {
+        FILE *fp;
+        U8 *buf;
+        long size;
+    } mem[MAX_MEMFILES];
+    long in_memory;         /* Held now in memory files */
+    long peak;              /* Most ever held at once */
+    long on_disk;           /* Written to disk files in all */
+    int memory_files, disk_files;
+} scratch;
+
+static FILE *new_memfile(long);
+static FILE *new_diskfile(void);
+
+/*
+ * Open a new temporary file for update, that will hold no more
+ * than "size" bytes, or -1L if we can't tell. Returns NULL if it
+ * can't be created.
+ */
+
+FILE *
+new_tempfile(
+    long size)
 {
-    char temp_name[FILENAME_MAX];
+    FILE *fp;
 
-    ASSERT(pass >= 0 && pass < 7);
-    ASSERT(NULL == ps.tf[pass]);
+    fp = NULL;
+    if (0 != opts.max_memory && size >= 0 &&
+      size <= opts.max_memory - scratch.in_memory)
+      fp = new_memfile(size);
+
+    if (NULL != fp) {
+        ++scratch.memory_files;
+        return fp;
+    }
+    if (NULL != (fp = new_diskfile())) ++scratch.disk_files;
+    return fp;
+}
+
+/*
+ * Memory files have a buffer of their full size from the start,
+ * with a byte to spare for the null fmemopen() may add.
+ */
+
+static FILE *
+new_memfile(
+    long size)
+{
+#ifdef _PTOT_MEMFILES_
+    int slot;
+    FILE *fp;
+    U8 *buf;
 
-    if (NULL == ps.tfnames[pass]) {
-        sprintf(temp_name, "pngpass%d.tmp", pass);
-        ps.tfnames[pass] = (char *)malloc(strlen(temp_name) + 1);
-        if (NULL == ps.tfnames[pass]) return ERR_MEMORY;
-        strcpy(ps.tfnames[pass], temp_name);
+    for (slot = 0; slot < MAX_MEMFILES; ++slot) {
+        if (NULL == scratch.mem[slot].fp) break;
     }
-    ps.tf[pass] = fopen(ps.tfnames[pass], "wb");
-    if (NULL == ps.tf[pass]) return ERR_WRITE;
+    if (MAX_MEMFILES == slot) return NULL;
+    if ((unsigned long)size >= (size_t)-1) return NULL;
 
+    if (NULL == (buf = (U8 *)malloc((size_t)size + 1))) return NULL;
+    if (NULL == (fp = fmemopen(buf, (size_t)size + 1, "w+b"))) {
+        free(buf);
+        return NULL;
+    }
+    scratch.mem[slot].fp = fp;
+    scratch.mem[slot].buf = buf;
+    scratch.mem[slot].size = size;
+    scratch.in_memory += size;
+    if (scratch.in_memory > scratch.peak)
+      scratch.peak = scratch.in_memory;
+    return fp;
+#else
+    return NULL;
+#endif
+}
+
+static FILE *
+new_diskfile(
+    void)
+{
+    char *dir, name[FILENAME_MAX];
+    FILE *fp;
+#ifdef _PTOT_POSIX_
+    int fd;
+#else
+    int slot, tries;
+#endif
+
+    dir = opts.tmpdir;
+    if (NULL == dir) dir = getenv("TMPDIR");
+    if (NULL == dir || '\0' == *dir) return tmpfile();
+
+    if (strlen(dir) + 16 > FILENAME_MAX) return NULL;
+#ifdef _PTOT_POSIX_
+    sprintf(name, "%s/ptotXXXXXX", dir);
+    if (-1 == (fd = mkstemp(name))) return NULL;
+    unlink(name);
+
+    if (NULL == (fp = fdopen(fd, "w+b"))) close(fd);
+    return fp;
+#else
+    for (slot = 0; slot < MAX_NAMED; ++slot) {
+        if (NULL == named[slot].fp) break;
+    }
+    if (MAX_NAMED == slot) return NULL;
+    /*
+     * Names are made unique by a serial number, started from
+     * the clock so another copy of ptot is unlikely to be using
+     * the same ones, and skipping any that exist.
+     */
+    if (0 == serial) serial = (unsigned long)time(NULL);
+    for (tries = 0; tries < 100; ++tries) {
+        sprintf(name, "%s/pt%06lx.tmp", dir, serial++ & 0xFFFFFFL);
+        if (NULL == (fp = fopen(name, "rb"))) break;
+        fclose(fp);
+    }
+    if (100 == tries) return NULL;
+
+    named[slot].name = (char *)malloc(strlen(name) + 1);
+    if (NULL == named[slot].name) return NULL;
+    strcpy(named[slot].name, name);
+
+    if (NULL == (fp = fopen(name, "w+b"))) {
+        free(named[slot].name);
+        named[slot].name = NULL;
+    }
+    named[slot].fp = fp;
+    return fp;
+#endif
+}
+
+/*
+ * Close a temporary file, which is the end of it.
+ */
+
+void
+free_tempfile(
+    FILE *fp)
+{
+    long size;
+    int slot;
+
+    if (NULL == fp) return;
+    for (slot = 0; slot < MAX_MEMFILES; ++slot) {
+        if (fp != scratch.mem[slot].fp) continue;
+        fclose(fp);
+        free(scratch.mem[slot].buf);
+        scratch.in_memory -= scratch.mem[slot].size;
+        scratch.mem[slot].fp = NULL;
+        scratch.mem[slot].buf = NULL;
+        return;
+    }
+    if (0 == fseek(fp, 0L, SEEK_END) && (size = ftell(fp)) > 0)
+      scratch.on_disk += size;
+    fclose(fp);
+#ifndef _PTOT_POSIX_
+    for (slot = 0; slot < MAX_NAMED; ++slot) {
+        if (fp != named[slot].fp) continue;
+        remove(named[slot].name);
+        free(named[slot].name);
+        named[slot].name = NULL;
+        named[slot].fp = NULL;
+    }
+#endif
+}
+
+/*
+ * The pass files hold each interlace pass (or the whole image,
+ * in file 0) while IDAT is being decoded.
+ */
+
+int
+create_tempfile(
+    int pass,
+    long size)
+{
+    ASSERT(pass >= 0 && pass < 7);
+
+    free_tempfile(ps.tf[pass]);
+    if (NULL == (ps.tf[pass] = new_tempfile(size))) return ERR_WRITE;
     return 0;
 }
 
+/*
+ * Go back to the start of a pass file to read it.
+ */
+
 int
 open_tempfile(
     int pass)
 {
     ASSERT(pass >= 0 && pass < 7);
-    ASSERT(NULL != ps.tfnames[pass]);
-
-    if (NULL != ps.tf[pass]) fclose(ps.tf[pass]);
-    ps.tf[pass] = fopen(ps.tfnames[pass], "rb");
-    if (NULL == ps.tf[pass]) return ERR_READ;
+    ASSERT(NULL != ps.tf[pass]);
 
+    if (0 != fflush(ps.tf[pass])) return ERR_WRITE;
+    rewind(ps.tf[pass]);
     return 0;
 }
 
+/*
+ * For --memory-report: where the scratch data went.
+ */
+
 void
-close_all_tempfiles(
+report_tempfiles(
     void)
 {
-    int pass;
-
-    for (pass = 0; pass < 7; ++pass) {
-        if (NULL != ps.tf[pass]) fclose(ps.tf[pass]);
-        ps.tf[pass] = NULL;
-    }
+    fprintf(stderr, "Scratch: %d in memory (peak %ld bytes of %ld), "
+      "%d on disk (%ld bytes)\n", scratch.memory_files, scratch.peak,
+      opts.max_memory, scratch.disk_files, scratch.on_disk);
+    fflush(stderr);
 }
 
 void
@@ -76,8 +289,7 @@ remove_all_tempfiles(
     int pass;
 
     for (pass = 0; pass < 7; ++pass) {
-        if (NULL != ps.tf[pass]) fclose(ps.tf[pass]);
-        if (NULL != ps.tfnames[pass]) remove(ps.tfnames[pass]);
+        free_tempfile(ps.tf[pass]);
+        ps.tf[pass] = NULL;
     }
 }
-
@@ -21,33 +21,67 @@
 #define DEFINE_ENUMS
 #include "errors.h"
 
-#define MAX_TAGS 40
+/*
+ * TIFF offsets are 32 bits, and patch_output() seeks with a
+ * long, so the file must end before whichever runs out first.
+ */
+
+#if LONG_MAX < 0xFFFFFFFFL
+#  define MAX_TIFF_SIZE ((U32)LONG_MAX)
+#else
+#  define MAX_TIFF_SIZE 0xFFFFFFFFL
+#endif
 
 U16 ASCII_tags[N_KEYWORDS] = {
     TIFF_TAG_Artist, TIFF_TAG_Copyright, TIFF_TAG_Software,
     TIFF_TAG_Model, TIFF_TAG_ImageDescription
 };
 
+/*
+ * A directory entry waiting to be written. Data of four bytes
+ * or less goes in the entry itself; anything longer is kept in
+ * the data pool until its place in the file is known.
+ */
+
+typedef struct _tiff_tag {
+    U16 tag;
+    U16 data_type;
+    U32 count;
+    U32 data_size;
+    U32 pool_offset;    /* Where the data is in ts.pool */
+    U8 value[4];        /* Or the data itself */
+} TIFF_TAG;
+
 /*
  * Local statics
  */
 
-static int write_tag(U16, int, U32, U8 *);
-static int get_tag_pos(U16);
-static int write_basic_tags(void);
+static int add_tag(U16, int, U32, U8 *);
+static int compare_tags(const void *, const void *);
+static int add_basic_tags(void);
+static void pack_1(U8 *, U8 *, U32);
+static void pack_2(U8 *, U8 *, U32);
+static void pack_4(U8 *, U8 *, U32);
+static void pack_16(U8 *, U8 *, U32);
+static int plan_strips(void);
 static int write_strips(void);
-static int write_extended_tags(void);
-static int write_png_data(void);
-static int write_ifd(void);
-static void align_file_offset(int);
+static int add_extended_tags(void);
+static int add_png_chunks(void);
+static int write_directory(void);
 
 static struct _tiff_state {
     IMG_INFO *image;
     FILE *outf;
-    int tag_count;
     U16 byte_order;
-    U32 file_offset;
-    U8 ifd[12 * MAX_TAGS];
+    U32 ifd_link;       /* Where the next IFD's offset goes */
+    U32 page;           /* Number of images written */
+    TIFF_TAG *tags;
+    int tag_count, max_tags;
+    U8 *pool;           /* Tag data too big for its entry */
+    U32 pool_size, max_pool;
+    int err;            /* First failure adding a tag */
+    size_t line_size;   /* The strips, as planned */
+    U32 rows_per_strip, total_strips, strip_size;
     U8 *buf;
 } ts;
 
@@ -107,38 +141,91 @@ write_TIFF(
 {
     int err;
 
+    if (0 != (err = open_TIFF(outf))) return err;
+    err = write_TIFF_image(image);
+    if (0 == err) err = close_TIFF();
+    else close_TIFF();
+    return err;
+}
+
+/*
+ * A TIFF file may hold any number of images. open_TIFF() writes
+ * the file header, each write_TIFF_image() appends an image and
+ * links its IFD to the one before, and close_TIFF() cleans up.
+ */
+
+int
+open_TIFF(
+    FILE *outf)
+{
+    int err;
+
     ASSERT(NULL != outf);
-    ASSERT(NULL != image);
-    ASSERT(NULL != image->pixel_data_file);
 
     if (NULL == (ts.buf = (U8 *)malloc(IOBUF_SIZE)))
       return ERR_MEMORY;
+    if (0 != (err = open_output(outf))) return err;
     ts.outf = outf;
-    ts.image = image;
+    ts.image = NULL;
     ts.byte_order = get_local_byte_order();
+    ts.ifd_link = 4;
+    ts.page = 0;
+    ts.tags = NULL;
+    ts.pool = NULL;
+    ts.max_tags = 0;
+    ts.max_pool = 0;
+    return 0;
+}
 
-    PUT16(ts.buf, ts.byte_order);
-    PUT16(ts.buf+2, TIFF_MagicNumber);
-    PUT32(ts.buf+4, 0); /* Will be filled in later */
+/*
+ * Each image is planned before anything is written: all the
+ * tags and their data are gathered, then write_directory() works
+ * out where everything goes and writes the header (for the first
+ * image), the tag data and the IFD as one block, with the strips
+ * following. So the IFD's offset is known when the header or the
+ * IFD before it is written, and only the link from an earlier
+ * image ever has to be patched.
+ */
 
-    if (8 != fwrite(ts.buf, 1, 8, outf)) return ERR_WRITE;
-    ts.file_offset = 8;
-    ts.tag_count = 0;
-    memset(ts.ifd, 0, 12 * MAX_TAGS);
+int
+write_TIFF_image(
+    IMG_INFO *image)
+{
+    int err;
 
-    if (0 != (err = write_basic_tags())) return err;
+    ASSERT(NULL != ts.outf);
+    ASSERT(NULL != image);
+    ASSERT(NULL != image->pixel_data);
+
+    ts.image = image;
+    ts.tag_count = 0;
+    ts.pool_size = 0;
+    ts.err = 0;
+
+    if (0 != (err = add_basic_tags())) return err;
+    if (0 != (err = plan_strips())) return err;
+    if (0 != (err = add_extended_tags())) return err;
+    if (0 != (err = add_png_chunks())) return err;
+    if (0 != (err = write_directory())) return err;
     if (0 != (err = write_strips())) return err;
-    remove(image->pixel_data_file);
-    if (0 != (err = write_extended_tags())) return err;
+    ++ts.page;
+    return 0;
+}
 
-    if (0 != image->png_data_size) {
-        ASSERT(NULL != image->png_data_file);
-        if (0 != (err = write_png_data())) return err;
-        remove(image->png_data_file);
-    }
-    err = write_ifd();
+int
+close_TIFF(
+    void)
+{
+    int err;
 
-    free(ts.buf);
+    err = close_output();
+    if (NULL != ts.buf) free(ts.buf);
+    if (NULL != ts.tags) free(ts.tags);
+    if (NULL != ts.pool) free(ts.pool);
+    ts.buf = NULL;
+    ts.tags = NULL;
+    ts.pool = NULL;
+    ts.outf = NULL;
     return err;
 }
 
@@ -147,120 +234,178 @@ write_TIFF(
  */
 static data_sizes[] = { 0, 1, 1, 2, 4, 8, 1, 1, 2, 4, 8, 4, 8 };
 
-#define DIRENT(index,byte) (ts.ifd+12*(index)+(byte))
-
 /*
- * Find where to insert the new tag into the sorted IFD
- * by simple linear search.
+ * Add a tag to the directory being planned, copying its data.
+ * The table and the pool grow as needed, so there is no limit
+ * on the number of tags. A failure is kept in ts.err for
+ * write_directory() to report, so callers needn't check.
  */
 
 static int
-get_tag_pos(
-    U16 newtag)
-{
-    int tag, tagpos, newpos = 0;
-
-    while (newpos < ts.tag_count) {
-        tag = GET16(DIRENT(newpos,0));
-        if (tag > newtag) break;
-        ++newpos;
-        ASSERT(newpos < MAX_TAGS);
-    }
-    for (tagpos = ++ts.tag_count; tagpos > newpos; --tagpos) {
-        memcpy(DIRENT(tagpos,0), DIRENT(tagpos-1,0), 12);
-    }
-    PUT16(DIRENT(newpos,0), newtag);
-    return newpos;
-}
-
-static int
-write_tag(
-    U16 newtag,
+add_tag(
+    U16 tag,
     int data_type,
     U32 count,
     U8 *buffer)
 {
-    U32 data_size;
-    int newpos;
+    TIFF_TAG *tp;
+    U32 data_size, pool_size;
+    void *grown;
 
-    ASSERT(ts.tag_count < MAX_TAGS);
     ASSERT(data_type > 0 && data_type <= 12);
     ASSERT(NULL != buffer);
-    ASSERT(NULL != ts.outf);
 
-    newpos = get_tag_pos(newtag);
-    PUT16(DIRENT(newpos,2), data_type);
-    PUT32(DIRENT(newpos,4), count);
+    if (0 != ts.err) return ts.err;
+
+    if (ts.tag_count == ts.max_tags) {
+        grown = realloc(ts.tags, (size_t)(ts.max_tags + 16) *
+          sizeof (TIFF_TAG));
+        if (NULL == grown) return (ts.err = ERR_MEMORY);
+        ts.tags = (TIFF_TAG *)grown;
+        ts.max_tags += 16;
+    }
+    tp = &ts.tags[ts.tag_count++];
+    tp->tag = tag;
+    tp->data_type = data_type;
+    tp->count = count;
+    tp->data_size = data_size = count * data_sizes[data_type];
+    tp->pool_offset = 0;
 
-    data_size = count * data_sizes[data_type];
     if (data_size <= 4) {
-        memcpy(DIRENT(newpos,8), buffer, 4);
-        if (data_size < 4)
-           memset(DIRENT(newpos,8+data_size), 0,
-             (size_t)(4-data_size));
-    } else {
-        align_file_offset(2);
-        PUT32(DIRENT(newpos,8), ts.file_offset);
-        fwrite(buffer, data_sizes[data_type], (size_t)count,
-          ts.outf);
-        ts.file_offset += count * data_sizes[data_type];
+        memset(tp->value, 0, 4);
+        memcpy(tp->value, buffer, (size_t)data_size);
+        return 0;
     }
+    /*
+     * Keep every item at an even offset, as TIFF asks.
+     */
+    pool_size = ts.pool_size + data_size + (data_size & 1);
+    if (pool_size > ts.max_pool) {
+        U32 new_max = (0 == ts.max_pool) ? 1024 : ts.max_pool;
+
+        while (new_max < pool_size) new_max *= 2;
+        if (NULL == (grown = realloc(ts.pool, (size_t)new_max)))
+          return (ts.err = ERR_MEMORY);
+        ts.pool = (U8 *)grown;
+        ts.max_pool = new_max;
+    }
+    tp->pool_offset = ts.pool_size;
+    memcpy(ts.pool + ts.pool_size, buffer, (size_t)data_size);
+    if (0 != (data_size & 1)) ts.pool[ts.pool_size + data_size] = 0;
+    ts.pool_size = pool_size;
     return 0;
 }
 
+/*
+ * TIFF wants the directory sorted by tag.
+ */
+
+static int
+compare_tags(
+    const void *a,
+    const void *b)
+{
+    return (int)((const TIFF_TAG *)a)->tag -
+      (int)((const TIFF_TAG *)b)->tag;
+}
+
+/*
+ * Lay out and write the header (for the first image only), the
+ * tag data and the IFD, and link the IFD into the file. The
+ * strips go straight after the IFD, so their offsets are filled
+ * in here too.
+ */
+
 static int
-write_png_data(
+write_directory(
     void)
 {
-    int newpos;
-    FILE *inf;
-    size_t bytes;
+    U32 header_size, data_start, ifd_offset, ifd_size, strip_start;
+    U32 block_size, strip;
+    TIFF_TAG *tp;
+    U8 *block, *bp;
+    int i, err;
 
-    ASSERT(NULL != ts.image->png_data_file);
+    ASSERT(NULL != ts.buf);
+    ASSERT(NULL != ts.outf);
 
-    if (NULL == (inf = fopen(ts.image->png_data_file, "rb")))
-      return ERR_READ;
+    if (0 != ts.err) return ts.err;
+    if (0 != (err = pad_output(2))) return err;
 
-    newpos = get_tag_pos(TIFF_TAG_PNGChunks);
-    PUT16(DIRENT(newpos,2), TIFF_DT_UNDEFINED);
-    PUT32(DIRENT(newpos,4), ts.image->png_data_size);
+    header_size = (0 == ts.page) ? 8 : 0;
+    data_start = output_offset() + header_size;
+    ifd_offset = data_start + ts.pool_size;
+    ifd_size = 2 + 12 * ts.tag_count + 4;
+    strip_start = ifd_offset + ifd_size;
+    /*
+     * All the strips (and a pad byte each) must end before
+     * MAX_TIFF_SIZE. Rather than write offsets that have wrapped,
+     * or that can't be sought to, refuse the image.
+     */
+    if (strip_start < data_start || strip_start > MAX_TIFF_SIZE ||
+      MAX_TIFF_SIZE - strip_start < ts.total_strips ||
+      ts.image->height > (MAX_TIFF_SIZE - strip_start -
+      ts.total_strips) / ts.line_size) return ERR_TOO_BIG;
 
-    align_file_offset(2);
-    PUT32(DIRENT(newpos,8), ts.file_offset);
-    while (0 != ts.image->png_data_size) {
+    qsort(ts.tags, (size_t)ts.tag_count, sizeof (TIFF_TAG),
+      compare_tags);
 
-        bytes = fread(ts.buf, 1, (size_t)min(IOBUF_SIZE,
-          ts.image->png_data_size), inf);
-        fwrite(ts.buf, 1, bytes, ts.outf);
-        ts.image->png_data_size -= bytes;
-        ts.file_offset += bytes;
+    block_size = header_size + ts.pool_size + ifd_size;
+    if (NULL == (block = (U8 *)malloc((size_t)block_size)))
+      return ERR_MEMORY;
+    bp = block;
+    if (0 != header_size) {
+        PUT16(ts.buf, ts.byte_order);
+        PUT16(ts.buf + 2, TIFF_MagicNumber);
+        PUT32(ts.buf + 4, ifd_offset);
+        memcpy(bp, ts.buf, 8);
+        bp += 8;
     }
-    fclose(inf);
-    return 0;
-}
+    for (i = 0; i < ts.tag_count; ++i) {
+        tp = &ts.tags[i];
+        if (TIFF_TAG_StripOffsets != tp->tag) continue;
 
-#undef DIRENT
+        for (strip = 0; strip < ts.total_strips; ++strip) {
+            PUT32(ts.buf + 4 * strip, strip_start +
+              strip * ts.strip_size);
+        }
+        if (tp->data_size <= 4) memcpy(tp->value, ts.buf, 4);
+        else memcpy(ts.pool + tp->pool_offset, ts.buf,
+          (size_t)tp->data_size);
+    }
+    if (0 != ts.pool_size) memcpy(bp, ts.pool, (size_t)ts.pool_size);
+    bp += ts.pool_size;
 
-/*
- * Some data structures must be at even byte offsets in the
- * file. Some must be aligned on 32-bit boundaries. We handle
- * those cases by simply adding pad bytes where needed.
- */
+    PUT16(ts.buf, ts.tag_count);
+    memcpy(bp, ts.buf, 2);
+    bp += 2;
+    for (i = 0; i < ts.tag_count; ++i) {
+        tp = &ts.tags[i];
+        PUT16(ts.buf, tp->tag);
+        PUT16(ts.buf + 2, tp->data_type);
+        PUT32(ts.buf + 4, tp->count);
+        if (tp->data_size <= 4) memcpy(ts.buf + 8, tp->value, 4);
+        else PUT32(ts.buf + 8, data_start + tp->pool_offset);
+        memcpy(bp, ts.buf, 12);
+        bp += 12;
+    }
+    memset(bp, 0, 4);
 
-static void
-align_file_offset(
-    int modulus)
-{
-    ASSERT(modulus > 0 && modulus <= 16);
+    err = write_output(block, block_size);
+    free(block);
+    if (0 != err) return err;
 
-    while (0 != (ts.file_offset % modulus)) {
-        putc(0, ts.outf);
-        ++ts.file_offset;
+    if (0 != ts.page) {
+        PUT32(ts.buf, ifd_offset);
+        if (0 != (err = patch_output(ts.ifd_link, ts.buf, 4)))
+          return err;
     }
+    ts.ifd_link = strip_start - 4;
+    return 0;
 }
 
 static int
-write_basic_tags(
+add_basic_tags(
     void)
 {
     int i;
@@ -270,33 +415,46 @@ write_basic_tags(
     ASSERT(NULL != ts.image);
 
     PUT32(ts.buf, ts.image->width);
-    write_tag(TIFF_TAG_ImageWidth, TIFF_DT_LONG, 1, ts.buf);
+    add_tag(TIFF_TAG_ImageWidth, TIFF_DT_LONG, 1, ts.buf);
 
     PUT32(ts.buf, ts.image->height);
-    write_tag(TIFF_TAG_ImageLength, TIFF_DT_LONG, 1, ts.buf);
+    add_tag(TIFF_TAG_ImageLength, TIFF_DT_LONG, 1, ts.buf);
 
     if (ts.image->is_palette) short_val = TIFF_PI_PLTE;
     else if (ts.image->is_color) short_val = TIFF_PI_RGB;
     else short_val = TIFF_PI_GRAY;
     PUT16(ts.buf, short_val);
-    write_tag(TIFF_TAG_PhotometricInterpretation,
+    add_tag(TIFF_TAG_PhotometricInterpretation,
       TIFF_DT_SHORT, 1, ts.buf);
 
     PUT16(ts.buf, TIFF_CT_NONE);
-    write_tag(TIFF_TAG_Compression, TIFF_DT_SHORT, 1, ts.buf);
+    add_tag(TIFF_TAG_Compression, TIFF_DT_SHORT, 1, ts.buf);
 
     PUT16(ts.buf, TIFF_PC_CONTIG);
-    write_tag(TIFF_TAG_PlanarConfiguration, TIFF_DT_SHORT, 1,
+    add_tag(TIFF_TAG_PlanarConfiguration, TIFF_DT_SHORT, 1,
       ts.buf);
 
     for (i = 0; i < ts.image->samples_per_pixel; ++i) {
         PUT16(ts.buf + 2 * i, ts.image->bits_per_sample);
     }
-    write_tag(TIFF_TAG_BitsPerSample, TIFF_DT_SHORT,
+    add_tag(TIFF_TAG_BitsPerSample, TIFF_DT_SHORT,
       ts.image->samples_per_pixel, ts.buf);
 
     PUT16(ts.buf, ts.image->samples_per_pixel);
-    write_tag(TIFF_TAG_SamplesPerPixel, TIFF_DT_SHORT, 1, ts.buf);
+    add_tag(TIFF_TAG_SamplesPerPixel, TIFF_DT_SHORT, 1, ts.buf);
+    /*
+     * Mark the images of a --multipage file, or the frames of
+     * an animation, as pages of one document. We don't know the
+     * page count yet, and TIFF lets us say so with a zero.
+     */
+    if (NULL != opts.multipage || 0 != ts.image->frame_count) {
+        PUT32(ts.buf, TIFF_ST_PAGE);
+        add_tag(TIFF_TAG_NewSubfileType, TIFF_DT_LONG, 1, ts.buf);
+
+        PUT16(ts.buf, ts.page);
+        PUT16(ts.buf + 2, 0);
+        add_tag(TIFF_TAG_PageNumber, TIFF_DT_SHORT, 2, ts.buf);
+    }
 
     if (ts.image->is_palette) {
         int index, cmap_size;
@@ -319,24 +477,24 @@ write_basic_tags(
             *bluep++ = *srcp;
             *bluep++ = *srcp++;
         }
-        write_tag(TIFF_TAG_ColorMap, TIFF_DT_SHORT, 3 * cmap_size,
+        add_tag(TIFF_TAG_ColorMap, TIFF_DT_SHORT, 3 * cmap_size,
           ts.buf);
     }
     /*
-     * Being truly lossless-minded here, we should check for the
-     * transparency information in the structure and expand that
-     * into a full alpha channel in the TIFF. This is left as an
-     * exercise for the reader. :-)
+     * Transparency information (tRNS) has no TIFF equivalent.
+     * With --expand-trns it has been turned into a full alpha
+     * channel by the time we get here (see xform.c); otherwise
+     * it is dropped.
      */
-    if (ts.image->has_alpha /* || ts.image->has_trns */) {
+    if (ts.image->has_alpha) {
         PUT16(ts.buf, TIFF_ES_UNASSOC);
-        write_tag(TIFF_TAG_ExtraSamples, TIFF_DT_SHORT, 1, ts.buf);
+        add_tag(TIFF_TAG_ExtraSamples, TIFF_DT_SHORT, 1, ts.buf);
     }
     return 0;
 }
 
 static int
-write_extended_tags(
+add_extended_tags(
     void)
 {
     int i;
@@ -353,17 +511,17 @@ write_extended_tags(
             tiff_unit = TIFF_RU_CM;
         }
         PUT16(ts.buf, tiff_unit);
-        write_tag(TIFF_TAG_ResolutionUnit, TIFF_DT_SHORT, 1,
+        add_tag(TIFF_TAG_ResolutionUnit, TIFF_DT_SHORT, 1,
           ts.buf);
 
         PUT32(ts.buf, ts.image->xres);
         PUT32(ts.buf+4, 100L); /* Convert micrometers to cm */
-        write_tag(TIFF_TAG_XResolution, TIFF_DT_RATIONAL,
+        add_tag(TIFF_TAG_XResolution, TIFF_DT_RATIONAL,
           1, ts.buf);
 
         PUT32(ts.buf, ts.image->yres);
         PUT32(ts.buf+4, 100L);
-        write_tag(TIFF_TAG_YResolution, TIFF_DT_RATIONAL,
+        add_tag(TIFF_TAG_YResolution, TIFF_DT_RATIONAL,
           1, ts.buf);
     }
     /*
@@ -378,7 +536,7 @@ write_extended_tags(
         if (TIFF_RU_NONE != tiff_unit) {
             if (0xFFFF == tiff_unit) {
                 PUT16(ts.buf, tiff_unit = TIFF_RU_CM);
-                write_tag(TIFF_TAG_ResolutionUnit, TIFF_DT_SHORT, 1,
+                add_tag(TIFF_TAG_ResolutionUnit, TIFF_DT_SHORT, 1,
                   ts.buf);
             }
             ASSERT(TIFF_RU_CM == tiff_unit);
@@ -415,12 +573,12 @@ write_extended_tags(
             }
             PUT32(ts.buf, xoff);
             PUT32(ts.buf + 4, 10000L);
-            write_tag(TIFF_TAG_XPosition, TIFF_DT_RATIONAL, 1,
+            add_tag(TIFF_TAG_XPosition, TIFF_DT_RATIONAL, 1,
               ts.buf);
 
             PUT32(ts.buf, yoff);
             PUT32(ts.buf + 4, 10000L);
-            write_tag(TIFF_TAG_YPosition, TIFF_DT_RATIONAL, 1,
+            add_tag(TIFF_TAG_YPosition, TIFF_DT_RATIONAL, 1,
               ts.buf);
         }
     }
@@ -434,14 +592,14 @@ write_extended_tags(
             PUT32(ts.buf + 8 * i, ts.image->chromaticities[i]);
             PUT32(ts.buf + 8 * i + 4, 100000L);
         }
-        write_tag(TIFF_TAG_WhitePoint, TIFF_DT_RATIONAL, 2,
+        add_tag(TIFF_TAG_WhitePoint, TIFF_DT_RATIONAL, 2,
           ts.buf);
 
         for (i = 0; i < 6; ++i) {
             PUT32(ts.buf + 8 * i, ts.image->chromaticities[i+2]);
             PUT32(ts.buf + 8 * i + 4, 100000L);
         }
-        write_tag(TIFF_TAG_PrimaryChromaticities, TIFF_DT_RATIONAL,
+        add_tag(TIFF_TAG_PrimaryChromaticities, TIFF_DT_RATIONAL,
           6, ts.buf);
     }
     /*
@@ -449,7 +607,7 @@ write_extended_tags(
      */
     for (i = 0; i < N_KEYWORDS; ++i) {
         if (NULL != ts.image->keywords[i]) {
-            write_tag(ASCII_tags[i], TIFF_DT_ASCII,
+            add_tag(ASCII_tags[i], TIFF_DT_ASCII,
               strlen(ts.image->keywords[i]) + 1,
               ts.image->keywords[i]);
         }
@@ -458,71 +616,140 @@ write_extended_tags(
      * Map gAMA chunk to TransferFunction tag
      */
     if (0.0 != ts.image->source_gamma) {
-        U32 count, index;
-        double maxval;
-
-        count = 1 << ts.image->bits_per_sample;
-        if (2 * count > IOBUF_SIZE) return ERR_WRITE;
-
-        PUT16(ts.buf, 0);
-        maxval = (double)count - 1.0;
-
-        for (index = 1; index < count; ++index) {
-            PUT16(ts.buf + 2 * index,
-              (U16)floor(0.5 + 65535 * pow((double)index / maxval,
-              1.0 / ts.image->source_gamma)));
+        U32 count, index, step;
+        U16 *table;
+        U8 *tf;
+
+        /*
+         * The 16-bit curve holds every shorter one too: sample
+         * i of a b-bit image is entry i * 65535 / (2^b - 1).
+         */
+        count = 1L << ts.image->bits_per_sample;
+        step = 65535L / (count - 1);
+        table = gamma_table(ts.image->source_gamma, 1.0, 16);
+        tf = (U8 *)malloc((size_t)(2 * count));
+        if (NULL == table || NULL == tf) {
+            if (NULL != tf) free(tf);
+            return ERR_MEMORY;
         }
-        write_tag(TIFF_TAG_TransferFunction, TIFF_DT_SHORT,
-          count, ts.buf);
+        for (index = 0; index < count; ++index)
+          PUT16(tf + 2 * index, table[index * step]);
+
+        add_tag(TIFF_TAG_TransferFunction, TIFF_DT_SHORT,
+          count, tf);
+        free(tf);
     }
     return 0;
 }
 
+/*
+ * Copy-safe chunks we couldn't translate go into the PNGChunks
+ * tag, exactly as they were in the PNG file. The TransferFunction
+ * of a 1-bit image has only two entries, 0 and 65535 whatever the
+ * gamma, so such images also get a gAMA chunk there.
+ */
+
 static int
-write_ifd(
+add_png_chunks(
     void)
 {
-    int err;
+    U32 size;
+    U8 *data, *gama;
+
+    size = ts.image->png_data_size;
+    if (0.0 != ts.image->source_gamma &&
+      ts.image->bits_per_sample < 2) size += 16;
+    if (0 == size) return 0;
+
+    if (NULL == (data = (U8 *)malloc((size_t)size))) return ERR_MEMORY;
+    if (0 != ts.image->png_data_size) {
+        ASSERT(NULL != ts.image->png_data);
+        memcpy(data, ts.image->png_data,
+          (size_t)ts.image->png_data_size);
+    }
+    if (size != ts.image->png_data_size) {
+        gama = data + ts.image->png_data_size;
+        BE_PUT32(gama, 4);
+        BE_PUT32(gama + 4, PNG_CN_gAMA);
+        BE_PUT32(gama + 8,
+          (U32)floor(0.5 + 100000.0 * ts.image->source_gamma));
+        BE_PUT32(gama + 12,
+          update_crc(0xFFFFFFFFL, gama + 4, 8) ^ 0xFFFFFFFFL);
+    }
+    add_tag(TIFF_TAG_PNGChunks, TIFF_DT_UNDEFINED, size, data);
+    free(data);
+    return 0;
+}
 
-    ASSERT(NULL != ts.buf);
-    ASSERT(NULL != ts.outf);
-    ASSERT(ts.tag_count <= MAX_TAGS);
+/*
+ * Put a row from the pixel data file into TIFF's layout, given
+ * the number of samples in it: 1, 2 and 4-bit samples are packed
+ * back into bytes, and 16-bit samples go into native byte order.
+ * 8-bit rows are right as they are. There is a function for each
+ * sample size, chosen once per image, so that the loops have
+ * nothing to decide.
+ */
 
-    align_file_offset(2);
-    if (ts.file_offset == (U32)ftell(ts.outf)) err = 0;
-    else err = ERR_WRITE;
+#define PACK_BITS(name, bits) \
+static void \
+name( \
+    U8 *lp, \
+    U8 *pp, \
+    U32 count) \
+{ \
+    U32 col; \
+    int shift; \
+    U8 byte; \
+\
+    byte = 0; \
+    shift = 8; \
+    for (col = 0; col < count; ++col) { \
+        shift -= bits; \
+        byte |= (U8)((*pp++ >> (8 - bits)) << shift); \
+        if (0 == shift) { \
+            *lp++ = byte; \
+            byte = 0; \
+            shift = 8; \
+        } \
+    } \
+    if (8 != shift) *lp = byte; \
+}
 
-    PUT16(ts.buf, ts.tag_count);
-    fwrite(ts.buf, 2, 1, ts.outf);
-    fwrite(ts.ifd, 12, ts.tag_count, ts.outf);
-    PUT32(ts.buf, 0L);
-    fwrite(ts.buf, 4, 1, ts.outf);
+PACK_BITS(pack_1, 1)
+PACK_BITS(pack_2, 2)
+PACK_BITS(pack_4, 4)
 
-    PUT32(ts.buf, ts.file_offset);
-    fseek(ts.outf, 4L, SEEK_SET);
-    fwrite(ts.buf, 1, 4, ts.outf);
+#undef PACK_BITS
 
-    return 0;
+static void
+pack_16(
+    U8 *lp,
+    U8 *pp,
+    U32 count)
+{
+    U32 sample;
+
+    for (sample = 0; sample < count; ++sample) {
+        PUT16(lp, BE_GET16(pp));
+        lp += 2;
+        pp += 2;
+    }
 }
 
 /*
- * Write out the actual pixel data into approximately 8k strips
- * (larger if needed to fit the StripOffsets data into one I/O
- * buffer) and write the related tags.
+ * Divide the pixel data into approximately 8k strips (larger if
+ * needed to fit the StripOffsets data into one I/O buffer) and
+ * add the related tags. The offsets aren't known until the
+ * directory is laid out, so StripOffsets is added as zeros and
+ * filled in by write_directory().
  */
 
-#define BPS (ts.image->bits_per_sample)
-#define SPP (ts.image->samples_per_pixel)
-#define OKW(x) ((x)<ts.image->width)
-
 static int
-write_strips(
+plan_strips(
     void)
 {
-    size_t line_size, strip_size;
-    U32 strip, total_strips, rows_per_strip;
-    U8 *line_buf;
-    FILE *inf;
+    U32 strip, rows_per_strip, total_strips;
+    size_t line_size;
 
     line_size = new_line_size(ts.image, 0, 1);
     if (line_size > 4096) {
@@ -533,123 +760,115 @@ write_strips(
     ASSERT(0 != rows_per_strip);
 
     do {
-        strip_size = rows_per_strip * line_size;
+        ts.strip_size = rows_per_strip * line_size;
         total_strips = (ts.image->height + (rows_per_strip - 1)) /
           rows_per_strip;
         rows_per_strip *= 2;
     } while (4 * total_strips > IOBUF_SIZE);
     rows_per_strip /= 2;
 
-    PUT32(ts.buf, rows_per_strip);
-    write_tag(TIFF_TAG_RowsPerStrip, TIFF_DT_LONG, 1, ts.buf);
+    ts.line_size = line_size;
+    ts.rows_per_strip = rows_per_strip;
+    ts.total_strips = total_strips;
 
+    PUT32(ts.buf, rows_per_strip);
+    add_tag(TIFF_TAG_RowsPerStrip, TIFF_DT_LONG, 1, ts.buf);
+    /*
+     * The last strip holds only the rows that are left over.
+     */
     for (strip = 0; strip < total_strips; ++strip) {
-        PUT32(ts.buf + 4 * strip, strip_size);
+        PUT32(ts.buf + 4 * strip, ts.strip_size);
     }
-    write_tag(TIFF_TAG_StripByteCounts, TIFF_DT_LONG,
+    PUT32(ts.buf + 4 * (total_strips - 1), line_size *
+      (ts.image->height - (total_strips - 1) * rows_per_strip));
+    add_tag(TIFF_TAG_StripByteCounts, TIFF_DT_LONG,
       total_strips, ts.buf);
+    /*
+     * Strips start at even offsets.
+     */
+    if (0 != (ts.strip_size & 1)) ++ts.strip_size;
 
-    align_file_offset(2);
-    if (0 != (strip_size & 1)) ++strip_size;
-
-    for (strip = 0; strip < total_strips; ++strip) {
-        PUT32(ts.buf + 4 * strip, ts.file_offset +
-          4 * total_strips + strip * strip_size);
-    }
-    write_tag(TIFF_TAG_StripOffsets, TIFF_DT_LONG,
+    memset(ts.buf, 0, (size_t)(4 * total_strips));
+    return add_tag(TIFF_TAG_StripOffsets, TIFF_DT_LONG,
       total_strips, ts.buf);
+}
+
+/*
+ * Write out the pixel data, as planned by plan_strips(), straight
+ * after the IFD.
+ */
+
+#define BPS (ts.image->bits_per_sample)
+#define SPP (ts.image->samples_per_pixel)
+
+static int
+write_strips(
+    void)
+{
+    U32 strip, scanline, samples;
+    U8 *line_buf, *pixel_buf, *lp;
+    void (*pack)(U8 *, U8 *, U32);
+    FILE *inf;
+    int err;
+
     /*
      * Write the strip data from the pixel data file.
      */
-    if (NULL == (line_buf = (U8 *)malloc(line_size)))
-      return ERR_MEMORY;
-
-    ASSERT(NULL != ts.image->pixel_data_file);
-    if (NULL == (inf = fopen(ts.image->pixel_data_file, "rb"))) {
-        free(line_buf);
-        return ERR_READ;
+    line_buf = (U8 *)malloc(ts.line_size);
+    pixel_buf = (U8 *)malloc(pixel_row_size(ts.image));
+    if (NULL == line_buf || NULL == pixel_buf) {
+        err = ERR_MEMORY;
+        goto ws_err_out;
     }
-    for (strip = 0; strip < total_strips; ++strip) {
-        U32 row, col, scanline;
-
-        scanline = 0;
-        align_file_offset(2);
-
-        for (row = 0; row < rows_per_strip; ++row) {
-            int bit, byte, step, sample;
-            U16 word;
-            U8 *lp;
-
-            lp = line_buf;
-            if (BPS < 8) step = 8 / BPS;
-            else step = 1;
-
-            for (col = 0; col < ts.image->width; col += step) {
-                switch (BPS) {
-                case 1:
-                    ASSERT(1 == SPP);
-
-                    *lp = getc(inf) & 0x80;
-                    for (bit = 1; bit < 8; ++bit) {
-                        if (!OKW(col+bit)) break;
-                        byte = getc(inf);
-                        if (0 != (byte & 0x80)) {
-                            *lp |= (1 << (7 - bit));
-                        }
-                    }
-                    ++lp;
-                    break;
-                case 2:
-                    ASSERT(1 == SPP);
-
-                    *lp = getc(inf) & 0xC0;
-                    if OKW(col+1) *lp |= ((getc(inf) >> 2) & 0x30);
-                    if OKW(col+2) *lp |= ((getc(inf) >> 4) & 0x0C);
-                    if OKW(col+3) *lp |= ((getc(inf) >> 6) & 0x03);
-                    ++lp;
-                    break;
-                case 4:
-                    ASSERT(1 == SPP);
-
-                    *lp = getc(inf) & 0xF0;
-                    if OKW(col+1) *lp |= ((getc(inf) >> 4) & 0x0F);
-                    ++lp;
-                    break;
-                case 8:
-                    for (sample = 0; sample < SPP; ++sample) {
-                        *lp++ = (0xFF & getc(inf));
-                    }
-                    break;
-                case 16:
-                    for (sample = 0; sample < SPP; ++sample) {
-                         word = ((getc(inf) << 8) & 0xFF00);
-                         word |= (0xFF & getc(inf));
-                         PUT16(lp, word);
-                         lp += 2;
-                    }
-                    break;
-                default:
-                    ASSERT(FALSE);
-                }
-            }
-            ASSERT(lp - line_buf == line_size);
-            if (line_size != fwrite(line_buf, 1, line_size, ts.outf)) {
-                fclose(inf);
-                free(line_buf);
-                return ERR_WRITE;
+    ASSERT(NULL != ts.image->pixel_data);
+    inf = ts.image->pixel_data;
+    if (0 != fseek(inf, 0L, SEEK_SET)) {
+        err = ERR_READ;
+        goto ws_err_out;
+    }
+    scanline = 0;
+
+    samples = ts.image->width * SPP;
+    pack = NULL;
+    switch (BPS) {
+    case 1:     pack = pack_1; break;
+    case 2:     pack = pack_2; break;
+    case 4:     pack = pack_4; break;
+    case 8:     break;
+    case 16:    pack = pack_16; break;
+    default:    ASSERT(FALSE);
+    }
+    ASSERT(BPS >= 8 || 1 == SPP);
+
+    for (strip = 0; strip < ts.total_strips; ++strip) {
+        U32 row;
+
+        if (0 != (err = pad_output(2))) goto ws_err_out;
+        TRACE_BEGIN(TRACE_STRIP, strip);
+
+        for (row = 0; row < ts.rows_per_strip; ++row) {
+            if (0 != (err = read_pixel_row(inf, pixel_buf)))
+              goto ws_err_out;
+            lp = pixel_buf;
+            if (NULL != pack) {
+                (*pack)(line_buf, pixel_buf, samples);
+                lp = line_buf;
             }
-            ts.file_offset += line_size;
+            if (0 != (err = write_output(lp, (U32)ts.line_size)))
+              goto ws_err_out;
             if (++scanline >= ts.image->height) break;
         }
+        TRACE_END(TRACE_STRIP);
     }
-    fclose(inf);
-    free(line_buf);
-    return 0;
+    err = 0;
+ws_err_out:
+    if (NULL != line_buf) free(line_buf);
+    if (NULL != pixel_buf) free(pixel_buf);
+    return err;
 }
 
 #undef SPP
 #undef BPS
-#undef OKW
 
 /*
  * End of TIFF.C
@@ -0,0 +1,294 @@
+/*
+ * trace.c
+ *
+ * Timeline of a conversion for --trace. Each stage of the work
+ * (parsing a chunk, inflating a Deflate block, flushing the
+ * inflate window, writing a strip, and so on) is recorded with
+ * its start and end times, and the lot is written at the end as
+ * Chrome trace events, which chrome://tracing and Perfetto can
+ * show as one timeline per thread.
+ *
+ * Recording has to cost next to nothing, so every thread adds
+ * to a buffer of its own without taking any lock; the buffers
+ * are only gathered when the trace is written, once the other
+ * threads are done. With tracing off, TRACE_BEGIN and TRACE_END
+ * just test a flag.
+ *
+ * Times come from gettimeofday() when built with _PTOT_POSIX_.
+ * Otherwise all we have is clock(), which counts processor time
+ * rather than time passing, so waits don't show.
+ */
+
+#ifdef _PTOT_POSIX_
+#  define _XOPEN_SOURCE 500     /* For gettimeofday() */
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _PTOT_POSIX_
+#  include <sys/time.h>
+#endif
+#ifdef _PTOT_THREADS_
+#  include <pthread.h>
+#endif
+
+#include "ptot.h"
+
+#define DEFINE_ENUMS
+#include "errors.h"
+
+#define TRACE_GROW 4096     /* Events added to a buffer at a time */
+
+/*
+ * Names of the stages, by their TRACE_ numbers in ptot.h, and of
+ * the number recorded when each begins (NULL if it means nothing).
+ */
+
+static struct _trace_stage {
+    char *name;
+    char *arg_name;
+} trace_stages[] = {
+    { "chunk",          "type" },
+    { "inflate_block",  NULL },
+    { "flush_window",   "bytes" },
+    { "repack_tempfiles", NULL },
+    { "strip",          "strip" },
+    { "read_block",     NULL },
+    { "write_block",    "bytes" },
+    { "input_wait",     NULL },
+    { "output_wait",    NULL },
+    { "unfilter_pass",  "pass" },
+    { "scatter_rows",   "first_row" }
+};
+
+typedef struct _trace_event {
+    double time;            /* Microseconds since start_trace() */
+    U32 arg;
+    U8 stage;
+    U8 phase;               /* 'B'egin or 'E'nd */
+} TRACE_EVENT;
+
+typedef struct _trace_buffer {
+    TRACE_EVENT *events;
+    U32 count, alloc;
+    int tid;
+    struct _trace_buffer *next;
+} TRACE_BUFFER;
+
+static TRACE_BUFFER *get_buffer(void);
+static double trace_time(void);
+static void free_buffers(void);
+
+int tracing = FALSE;
+
+static struct _trace_state {
+    TRACE_BUFFER *buffers;  /* One per thread, newest first */
+    int next_tid;
+    double start;
+#ifdef _PTOT_THREADS_
+    pthread_key_t key;
+    pthread_mutex_t lock;
+#else
+    TRACE_BUFFER *only;
+#endif
+} trs;
+
+/*
+ * Start recording. Times are from now.
+ */
+
+int
+start_trace(
+    void)
+{
+    memset(&trs, 0, sizeof trs);
+    trs.next_tid = 1;
+#ifdef _PTOT_THREADS_
+    if (0 != pthread_key_create(&trs.key, NULL)) return ERR_MEMORY;
+    pthread_mutex_init(&trs.lock, NULL);
+#endif
+    trs.start = trace_time();
+    /*
+     * Make the main thread's buffer now, so that it is thread 1.
+     */
+    if (NULL == get_buffer()) return ERR_MEMORY;
+    tracing = TRUE;
+    return 0;
+}
+
+/*
+ * Record the beginning or end of a stage. Use the TRACE_BEGIN
+ * and TRACE_END macros rather than calling this directly. If we
+ * run out of memory the rest of this thread's events are lost,
+ * but the conversion carries on.
+ */
+
+void
+trace_event(
+    int stage,
+    int phase,
+    U32 arg)
+{
+    TRACE_BUFFER *bp;
+    TRACE_EVENT *ep;
+
+    ASSERT(stage >= 0 && stage < (int)(sizeof trace_stages /
+      sizeof trace_stages[0]));
+
+    if (NULL == (bp = get_buffer())) return;
+    if (bp->count == bp->alloc) {
+        ep = (TRACE_EVENT *)realloc(bp->events,
+          (size_t)(bp->alloc + TRACE_GROW) * sizeof (TRACE_EVENT));
+        if (NULL == ep) return;
+        bp->events = ep;
+        bp->alloc += TRACE_GROW;
+    }
+    ep = &bp->events[bp->count++];
+    ep->time = trace_time() - trs.start;
+    ep->arg = arg;
+    ep->stage = (U8)stage;
+    ep->phase = (U8)phase;
+}
+
+/*
+ * The calling thread's buffer, made the first time it's wanted.
+ */
+
+static TRACE_BUFFER *
+get_buffer(
+    void)
+{
+    TRACE_BUFFER *bp;
+
+#ifdef _PTOT_THREADS_
+    bp = (TRACE_BUFFER *)pthread_getspecific(trs.key);
+#else
+    bp = trs.only;
+#endif
+    if (NULL != bp) return bp;
+
+    if (NULL == (bp = (TRACE_BUFFER *)malloc(sizeof *bp))) return NULL;
+    bp->events = NULL;
+    bp->count = bp->alloc = 0;
+#ifdef _PTOT_THREADS_
+    if (0 != pthread_setspecific(trs.key, bp)) {
+        free(bp);
+        return NULL;
+    }
+    pthread_mutex_lock(&trs.lock);
+#else
+    trs.only = bp;
+#endif
+    bp->tid = trs.next_tid++;
+    bp->next = trs.buffers;
+    trs.buffers = bp;
+#ifdef _PTOT_THREADS_
+    pthread_mutex_unlock(&trs.lock);
+#endif
+    return bp;
+}
+
+static double
+trace_time(
+    void)
+{
+#ifdef _PTOT_POSIX_
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec * 1000000.0 + (double)tv.tv_usec;
+#else
+    return (double)clock() * (1000000.0 / CLOCKS_PER_SEC);
+#endif
+}
+
+/*
+ * Stop recording, and write everything recorded to "filename".
+ * Every other thread must have finished by now. Each thread is
+ * named after the first stage it recorded, except the main one.
+ */
+
+int
+write_trace(
+    char *filename)
+{
+    FILE *fp;
+    TRACE_BUFFER *bp;
+    TRACE_EVENT *ep;
+    struct _trace_stage *sp;
+    U32 i;
+    int first, err;
+
+    ASSERT(NULL != filename);
+
+    if (!tracing) return 0;
+    tracing = FALSE;
+
+    if (NULL == (fp = fopen(filename, "w"))) {
+        free_buffers();
+        return ERR_WRITE;
+    }
+    fprintf(fp, "{\"traceEvents\": [");
+    first = TRUE;
+
+    for (bp = trs.buffers; NULL != bp; bp = bp->next) {
+        fprintf(fp, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", "
+          "\"pid\": 1, \"tid\": %d, \"args\": {\"name\": ",
+          first ? "" : ",", bp->tid);
+        if (1 == bp->tid) fprintf(fp, "\"main\"}}");
+        else if (0 == bp->count) fprintf(fp, "\"thread\"}}");
+        else fprintf(fp, "\"%s\"}}",
+          trace_stages[bp->events[0].stage].name);
+        first = FALSE;
+
+        for (i = 0; i < bp->count; ++i) {
+            ep = &bp->events[i];
+            sp = &trace_stages[ep->stage];
+            fprintf(fp, ",\n{\"name\": \"%s\", \"ph\": \"%c\", "
+              "\"ts\": %.0f, \"pid\": 1, \"tid\": %d",
+              sp->name, ep->phase, ep->time, bp->tid);
+
+            if ('B' != ep->phase || NULL == sp->arg_name) {
+                fprintf(fp, "}");
+            } else if (TRACE_CHUNK == ep->stage) {
+                fprintf(fp, ", \"args\": {\"%s\": \"%c%c%c%c\"}}",
+                  sp->arg_name, (int)(ep->arg >> 24) & 0xFF,
+                  (int)(ep->arg >> 16) & 0xFF,
+                  (int)(ep->arg >> 8) & 0xFF, (int)ep->arg & 0xFF);
+            } else {
+                fprintf(fp, ", \"args\": {\"%s\": %lu}}",
+                  sp->arg_name, (unsigned long)ep->arg);
+            }
+        }
+    }
+    fprintf(fp, "\n], \"displayTimeUnit\": \"ms\"}\n");
+
+    err = (0 != fflush(fp) || ferror(fp)) ? ERR_WRITE : 0;
+    if (0 != fclose(fp) && 0 == err) err = ERR_WRITE;
+    free_buffers();
+    return err;
+}
+
+static void
+free_buffers(
+    void)
+{
+    TRACE_BUFFER *bp;
+
+    while (NULL != (bp = trs.buffers)) {
+        trs.buffers = bp->next;
+        if (NULL != bp->events) free(bp->events);
+        free(bp);
+    }
+#ifdef _PTOT_THREADS_
+    pthread_key_delete(trs.key);
+    pthread_mutex_destroy(&trs.lock);
+#endif
+}
+
+/*
+ * End of trace.c
+ */
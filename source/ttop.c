@@ -0,0 +1,943 @@
+/*
+ * ttop.c
+ *
+ * Convert TIFF (Tag Image File Format) file to PNG (Portable
+ * Network Graphic), the reverse of ptot. Takes a filename
+ * argument on the command line, and converts the first image in
+ * the file, which must be uncompressed, with its samples
+ * interleaved: gray, RGB or palette, with or without alpha. That
+ * covers everything ptot writes.
+ *
+ * What ptot put into tags goes back into chunks: resolution and
+ * position into pHYs and oFFs, the chromaticity tags into cHRM,
+ * the ASCII tags into tEXt, and a TransferFunction that is a
+ * gamma curve into gAMA. Chunks ptot could only keep in the
+ * PNGChunks tag are copied back out as they were.
+ *
+ * The image data is compressed by deflate.c, on several threads
+ * if built with _PTOT_THREADS_.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "ptot.h"
+
+#define DEFINE_ENUMS
+#include "errors.h"
+#define DEFINE_STRINGS
+#include "errors.h"
+
+#define IDAT_SIZE   65536L  /* Largest IDAT chunk written */
+
+/*
+ * ptot's mapping between text keywords and ASCII tags.
+ */
+
+static struct _text_tag {
+    U16 tag;
+    char *keyword;
+} text_tags[N_KEYWORDS] = {
+    { TIFF_TAG_Artist,              "Author" },
+    { TIFF_TAG_Copyright,           "Copyright" },
+    { TIFF_TAG_Software,            "Software" },
+    { TIFF_TAG_Model,               "Source" },
+    { TIFF_TAG_ImageDescription,    "Title" }
+};
+
+static U8 png_signature[8] = {
+    0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A
+};
+
+static int read_directory(void);
+static int read_tag(U8 *);
+static U32 get_number(U8 *, int);
+static int get_array(U8 *, int, U32, U32 **);
+static double get_rational(U8 *);
+static int check_image(void);
+static int write_PNG(void);
+static int write_chunk(U32, U8 *, U32);
+static int copy_chunks(int);
+static U32 transfer_gamma(void);
+static int palette_entries(U32 *);
+static int write_image_data(void);
+static int choose_filter(U8 *, U8 *);
+static int put_idat(U8 *, U32);
+static void free_TIFF(void);
+
+static struct _ttop_state {
+    FILE *inf, *outf;
+    int motorola;           /* File is big-endian */
+    U32 width, height;
+    int bits_per_sample, samples_per_pixel;
+    int compression, photometric, planar, has_alpha;
+    U32 rows_per_strip, strip_count;
+    U32 *strip_offsets, *strip_counts;
+    U32 *colormap, colormap_count;
+    U32 *transfer, transfer_count;
+    double xres, yres, xpos, ypos;
+    int resolution_unit;
+    double chromaticities[8];
+    int have_chromaticities;
+    char *text[N_KEYWORDS];
+    U8 *png_chunks;
+    U32 png_chunks_size;
+    int color_type, bpp;    /* bpp is bytes per pixel, at least 1 */
+    U32 gamma;              /* For gAMA, or 0 if none */
+    U32 row_bytes;
+    U8 *row, *prior;        /* Row being filtered and the one above */
+    U8 *filtered[5];        /* The row under each filter */
+    U8 *idat;
+    U32 idat_size;
+} tt;
+
+/*
+ * Main for TTOP. Get filename from command line, massage the
+ * extensions as necessary, and call the read/write routines.
+ */
+
+int
+main(
+    int argc,
+    char *argv[])
+{
+    int err;
+    char infname[FILENAME_MAX], outfname[FILENAME_MAX], *cp;
+
+    if (2 != argc || '-' == argv[1][0]) error_exit(ERR_USAGE);
+    if (strlen(argv[1]) + 6 > FILENAME_MAX) error_exit(ERR_USAGE);
+
+    strcpy(infname, argv[1]);
+    strcpy(outfname, argv[1]);
+    if (NULL == (cp = strrchr(argv[1], '.'))) strcat(infname, ".tif");
+    else outfname[cp - argv[1]] = '\0';
+    strcat(outfname, ".png");
+
+    if (NULL == (tt.inf = fopen(infname, "rb"))) error_exit(ERR_READ);
+    if (0 == (err = read_directory()) && 0 == (err = check_image())) {
+        if (NULL == (tt.outf = fopen(outfname, "wb"))) err = ERR_WRITE;
+        else {
+            err = write_PNG();
+            if (0 != fclose(tt.outf) && 0 == err) err = ERR_WRITE;
+        }
+    }
+    fclose(tt.inf);
+    free_TIFF();
+
+    if (0 != err) error_exit(err);
+    return 0;
+}
+
+/*
+ * Print warning, but continue.
+ */
+
+void
+print_warning(
+    int code)
+{
+    ASSERT(code >= 0 && code < PTOT_NMESSAGES);
+
+    fprintf(stderr, "WARNING: %s.\n", ptot_error_messages[code]);
+    fflush(stderr);
+}
+
+/*
+ * Print fatal error and exit. The usage message in errors.h is
+ * ptot's, so we have our own.
+ */
+
+void
+error_exit(
+    int code)
+{
+    int msgindex;
+
+    if (code < 0 || code >= PTOT_NMESSAGES) msgindex = 0;
+    else msgindex = code;
+
+    if (ERR_USAGE == code) {
+        fprintf(stderr, "ERROR: Usage: ttop filename[.tif].\n");
+    } else fprintf(stderr, "ERROR: %s.\n",
+      ptot_error_messages[msgindex]);
+    fflush(stderr);
+
+    if (0 == code) exit(1);
+    else exit(code);
+}
+
+void
+Assert(
+    char *filename,
+    int lineno)
+{
+    fprintf(stderr, "ASSERTION FAILURE: "
+      "Line %d of file \"%s\".\n", lineno, filename);
+    fflush(stderr);
+    exit(2);
+}
+
+/*
+ * TIFF-specific code begins here.
+ *
+ * read_directory() reads the header and the first image file
+ * directory, and keeps what we need from the tags in "tt".
+ */
+
+static int
+read_directory(
+    void)
+{
+    int err;
+    U8 header[8], *entries;
+    U32 offset, tag_count, i;
+
+    tt.resolution_unit = 2; /* TIFF's default, inches */
+    tt.planar = TIFF_PC_CONTIG;
+    tt.compression = TIFF_CT_NONE;
+    tt.samples_per_pixel = 1;
+    tt.bits_per_sample = 1;
+    tt.rows_per_strip = 0xFFFFFFFFL;
+    tt.photometric = -1;
+
+    if (8 != fread(header, 1, 8, tt.inf)) return ERR_BAD_TIFF;
+    if ('I' == header[0] && 'I' == header[1]) tt.motorola = FALSE;
+    else if ('M' == header[0] && 'M' == header[1]) tt.motorola = TRUE;
+    else return ERR_BAD_TIFF;
+    if (TIFF_MagicNumber != get_number(header + 2, 2))
+      return ERR_BAD_TIFF;
+
+    offset = get_number(header + 4, 4);
+    if (0 != fseek(tt.inf, (long)offset, SEEK_SET) ||
+      2 != fread(header, 1, 2, tt.inf)) return ERR_BAD_TIFF;
+    tag_count = get_number(header, 2);
+    /*
+     * Entries, then the offset of the next directory.
+     */
+    entries = (U8 *)malloc((size_t)(12 * tag_count + 4));
+    if (NULL == entries) return ERR_MEMORY;
+
+    err = ERR_BAD_TIFF;
+    if (12 * tag_count + 4 != fread(entries, 1,
+      (size_t)(12 * tag_count + 4), tt.inf)) goto rd_err_out;
+    if (0 != get_number(entries + 12 * tag_count, 4))
+      print_warning(WARN_PAGES);
+
+    for (i = 0; i < tag_count; ++i) {
+        if (0 != (err = read_tag(entries + 12 * i))) goto rd_err_out;
+    }
+    err = 0;
+rd_err_out:
+    free(entries);
+    return err;
+}
+
+/*
+ * Read one directory entry and its data. Tags we don't use, and
+ * data types we don't know, are skipped.
+ */
+
+static int
+read_tag(
+    U8 *entry)
+{
+    int err, type, size, i;
+    U32 tag, count, total, value;
+    U8 *data;
+    char **textp;
+
+    tag = get_number(entry, 2);
+    type = (int)get_number(entry + 2, 2);
+    count = get_number(entry + 4, 4);
+
+    switch (type) {
+        case TIFF_DT_BYTE:
+        case TIFF_DT_ASCII:
+        case TIFF_DT_UNDEFINED: size = 1; break;
+        case TIFF_DT_SHORT:     size = 2; break;
+        case TIFF_DT_LONG:      size = 4; break;
+        case TIFF_DT_RATIONAL:  size = 8; break;
+        default: return 0;
+    }
+    if (0 == count) return 0;
+    if (count > 0x7FFFFFFFL / size) return ERR_BAD_TIFF;
+    total = count * size;
+    /*
+     * One byte more than the data, so that text is always
+     * terminated.
+     */
+    if (NULL == (data = (U8 *)malloc((size_t)total + 1)))
+      return ERR_MEMORY;
+    data[total] = '\0';
+
+    if (total <= 4) memcpy(data, entry + 8, (size_t)total);
+    else if (0 != fseek(tt.inf, (long)get_number(entry + 8, 4),
+      SEEK_SET) || total != fread(data, 1, (size_t)total, tt.inf)) {
+        free(data);
+        return ERR_BAD_TIFF;
+    }
+    value = (2 == size || 4 == size) ? get_number(data, size) : 0;
+    err = 0;
+
+    switch (tag) {
+        case TIFF_TAG_ImageWidth:   tt.width = value; break;
+        case TIFF_TAG_ImageLength:  tt.height = value; break;
+        case TIFF_TAG_Compression:  tt.compression = (int)value; break;
+        case TIFF_TAG_PlanarConfiguration:
+            tt.planar = (int)value;
+            break;
+        case TIFF_TAG_PhotometricInterpretation:
+            tt.photometric = (int)value;
+            break;
+        case TIFF_TAG_SamplesPerPixel:
+            tt.samples_per_pixel = (int)value;
+            break;
+        case TIFF_TAG_RowsPerStrip: tt.rows_per_strip = value; break;
+        case TIFF_TAG_ResolutionUnit:
+            tt.resolution_unit = (int)value;
+            break;
+        case TIFF_TAG_BitsPerSample:
+            /*
+             * One for each sample, which must all be the same.
+             */
+            tt.bits_per_sample = (int)value;
+            for (i = 1; i < (int)count; ++i) {
+                if (value != get_number(data + size * i, size))
+                  err = ERR_BAD_TIFF;
+            }
+            break;
+        case TIFF_TAG_StripOffsets:
+            tt.strip_count = count;
+            err = get_array(data, size, count, &tt.strip_offsets);
+            break;
+        case TIFF_TAG_StripByteCounts:
+            if (count < tt.strip_count) tt.strip_count = count;
+            err = get_array(data, size, count, &tt.strip_counts);
+            break;
+        case TIFF_TAG_ColorMap:
+            tt.colormap_count = count;
+            err = get_array(data, size, count, &tt.colormap);
+            break;
+        case TIFF_TAG_TransferFunction:
+            tt.transfer_count = count;
+            err = get_array(data, size, count, &tt.transfer);
+            break;
+        case TIFF_TAG_XResolution:
+            if (8 == size) tt.xres = get_rational(data);
+            break;
+        case TIFF_TAG_YResolution:
+            if (8 == size) tt.yres = get_rational(data);
+            break;
+        case TIFF_TAG_XPosition:
+            if (8 == size) tt.xpos = get_rational(data);
+            break;
+        case TIFF_TAG_YPosition:
+            if (8 == size) tt.ypos = get_rational(data);
+            break;
+        case TIFF_TAG_WhitePoint:
+            if (8 != size || 2 != count) break;
+            for (i = 0; i < 2; ++i)
+              tt.chromaticities[i] = get_rational(data + 8 * i);
+            tt.have_chromaticities |= 1;
+            break;
+        case TIFF_TAG_PrimaryChromaticities:
+            if (8 != size || 6 != count) break;
+            for (i = 0; i < 6; ++i)
+              tt.chromaticities[i + 2] = get_rational(data + 8 * i);
+            tt.have_chromaticities |= 2;
+            break;
+        case TIFF_TAG_PNGChunks:
+            if (1 != size) break;
+            if (NULL != tt.png_chunks) free(tt.png_chunks);
+            tt.png_chunks = data;
+            tt.png_chunks_size = total;
+            return 0;
+        default:
+            for (i = 0; i < N_KEYWORDS; ++i) {
+                if (tag != text_tags[i].tag) continue;
+                if (TIFF_DT_ASCII != type) break;
+                textp = &tt.text[i];
+                if (NULL != *textp) free(*textp);
+                *textp = (char *)data;
+                return 0;
+            }
+            break;
+    }
+    free(data);
+    return err;
+}
+
+/*
+ * An unsigned number of "size" bytes in the file's byte order.
+ * Done a byte at a time, because entries aren't aligned.
+ */
+
+static U32
+get_number(
+    U8 *p,
+    int size)
+{
+    U32 value;
+    int i;
+
+    value = 0;
+    for (i = 0; i < size; ++i) {
+        if (tt.motorola) value = (value << 8) | p[i];
+        else value |= (U32)p[i] << (8 * i);
+    }
+    return value;
+}
+
+/*
+ * Copy "count" SHORT or LONG values into a new array, replacing
+ * the one at "*array".
+ */
+
+static int
+get_array(
+    U8 *data,
+    int size,
+    U32 count,
+    U32 **array)
+{
+    U32 i;
+
+    if (2 != size && 4 != size) return ERR_BAD_TIFF;
+    if (NULL != *array) free(*array);
+    if (NULL == (*array = (U32 *)malloc((size_t)count * 4)))
+      return ERR_MEMORY;
+    for (i = 0; i < count; ++i)
+      (*array)[i] = get_number(data + size * i, size);
+    return 0;
+}
+
+static double
+get_rational(
+    U8 *data)
+{
+    U32 denominator;
+
+    if (0 == (denominator = get_number(data + 4, 4))) return 0.0;
+    return (double)get_number(data, 4) / (double)denominator;
+}
+
+/*
+ * See that the image is one we can convert, and work out its
+ * PNG color type.
+ */
+
+static int
+check_image(
+    void)
+{
+    int base, bits;
+    U32 strip, rows;
+
+    if (0 == tt.width || 0 == tt.height) return ERR_BAD_TIFF;
+    if (TIFF_CT_NONE != tt.compression) return ERR_BAD_TIFF;
+    if (tt.samples_per_pixel > 1 && TIFF_PC_CONTIG != tt.planar)
+      return ERR_BAD_TIFF;
+
+    bits = tt.bits_per_sample;
+    switch (tt.photometric) {
+        case 0: /* WhiteIsZero */
+        case TIFF_PI_GRAY:
+            base = 1;
+            tt.color_type = 0;
+            break;
+        case TIFF_PI_RGB:
+            base = 3;
+            tt.color_type = PNG_CB_Color;
+            break;
+        case TIFF_PI_PLTE:
+            base = 1;
+            tt.color_type = PNG_CB_Palette | PNG_CB_Color;
+            if (bits > 8 || NULL == tt.colormap ||
+              tt.colormap_count < (3L << bits)) return ERR_BAD_TIFF;
+            break;
+        default:
+            return ERR_BAD_TIFF;
+    }
+    /*
+     * An extra sample is taken to be alpha, even if the file
+     * doesn't say what it is (or that it is premultiplied).
+     */
+    if (tt.samples_per_pixel == base + 1 &&
+      TIFF_PI_PLTE != tt.photometric) {
+        tt.has_alpha = TRUE;
+        tt.color_type |= PNG_CB_Alpha;
+    } else if (tt.samples_per_pixel == base) tt.has_alpha = FALSE;
+    else return ERR_BAD_TIFF;
+
+    if (1 != bits && 2 != bits && 4 != bits && 8 != bits &&
+      16 != bits) return ERR_BAD_TIFF;
+    if (bits < 8 && (tt.has_alpha || TIFF_PI_RGB == tt.photometric))
+      return ERR_BAD_TIFF;
+
+    if ((double)tt.width * tt.samples_per_pixel * bits >
+      8.0 * (0x7FFFFFFFL - 1)) return ERR_TOO_BIG;
+    tt.row_bytes = (U32)(((double)tt.width * tt.samples_per_pixel *
+      bits + 7) / 8);
+    tt.bpp = (tt.samples_per_pixel * bits + 7) / 8;
+    /*
+     * Every strip must be there, and big enough.
+     */
+    if (0 == tt.rows_per_strip) return ERR_BAD_TIFF;
+    if (tt.rows_per_strip > tt.height) tt.rows_per_strip = tt.height;
+    if (NULL == tt.strip_offsets || tt.strip_count <
+      (tt.height - 1) / tt.rows_per_strip + 1) return ERR_BAD_TIFF;
+    if (NULL != tt.strip_counts) {
+        for (strip = 0; strip * tt.rows_per_strip < tt.height;
+          ++strip) {
+            rows = min(tt.rows_per_strip,
+              tt.height - strip * tt.rows_per_strip);
+            if ((double)tt.strip_counts[strip] <
+              (double)rows * tt.row_bytes) return ERR_BAD_TIFF;
+        }
+    }
+    return 0;
+}
+
+/*
+ * PNG-specific code begins here.
+ *
+ * write_PNG() writes the whole PNG file. Ancillary chunks go
+ * before PLTE if they must, and after it otherwise.
+ */
+
+static int
+write_PNG(
+    void)
+{
+    int err, i;
+    U8 buf[32];
+    U32 entries, length;
+    double unit;
+    char *text;
+
+    if (8 != fwrite(png_signature, 1, 8, tt.outf)) return ERR_WRITE;
+
+    BE_PUT32(buf, tt.width);
+    BE_PUT32(buf + 4, tt.height);
+    buf[8] = (U8)tt.bits_per_sample;
+    buf[9] = (U8)tt.color_type;
+    buf[10] = buf[11] = buf[12] = 0;
+    if (0 != (err = write_chunk(PNG_CN_IHDR, buf, 13))) return err;
+
+    tt.gamma = transfer_gamma();
+    if (0 != (err = copy_chunks(TRUE))) return err;
+
+    if (0 != tt.gamma) {
+        BE_PUT32(buf, tt.gamma);
+        if (0 != (err = write_chunk(PNG_CN_gAMA, buf, 4))) return err;
+    }
+    if (3 == tt.have_chromaticities) {
+        for (i = 0; i < 8; ++i) {
+            BE_PUT32(buf + 4 * i,
+              (U32)floor(0.5 + 100000.0 * tt.chromaticities[i]));
+        }
+        if (0 != (err = write_chunk(PNG_CN_cHRM, buf, 32))) return err;
+    }
+    /*
+     * ptot writes resolution in pixels per centimeter, but we
+     * may as well take inches too. Positions are in the same
+     * unit, and PNG wants them in micrometers.
+     */
+    if (TIFF_RU_CM == tt.resolution_unit) unit = 100.0;
+    else if (2 == tt.resolution_unit) unit = 1.0 / 0.0254;
+    else unit = 1.0;
+
+    if (0.0 != tt.xres && 0.0 != tt.yres) {
+        BE_PUT32(buf, (U32)floor(0.5 + tt.xres * unit));
+        BE_PUT32(buf + 4, (U32)floor(0.5 + tt.yres * unit));
+        buf[8] = (TIFF_RU_NONE == tt.resolution_unit) ?
+          PNG_MU_None : PNG_MU_Meter;
+        if (0 != (err = write_chunk(PNG_CN_pHYs, buf, 9))) return err;
+    }
+    if ((0.0 != tt.xpos || 0.0 != tt.ypos) &&
+      TIFF_RU_NONE != tt.resolution_unit) {
+        BE_PUT32(buf, (U32)floor(0.5 + 1000000.0 * tt.xpos / unit));
+        BE_PUT32(buf + 4, (U32)floor(0.5 + 1000000.0 * tt.ypos / unit));
+        buf[8] = PNG_MU_Micrometer;
+        if (0 != (err = write_chunk(PNG_CN_oFFs, buf, 9))) return err;
+    }
+
+    if (TIFF_PI_PLTE == tt.photometric) {
+        U8 *plte;
+        U32 index;
+
+        if (0 != (err = palette_entries(&entries))) return err;
+        if (NULL == (plte = (U8 *)malloc((size_t)(3 * entries))))
+          return ERR_MEMORY;
+        for (index = 0; index < entries; ++index) {
+            for (i = 0; i < 3; ++i) {
+                plte[3 * index + i] = (U8)(tt.colormap[index +
+                  ((U32)i << tt.bits_per_sample)] >> 8);
+            }
+        }
+        err = write_chunk(PNG_CN_PLTE, plte, 3 * entries);
+        free(plte);
+        if (0 != err) return err;
+    }
+    if (0 != (err = copy_chunks(FALSE))) return err;
+
+    for (i = 0; i < N_KEYWORDS; ++i) {
+        if (NULL == tt.text[i]) continue;
+        length = strlen(text_tags[i].keyword) + 1 + strlen(tt.text[i]);
+        if (NULL == (text = (char *)malloc((size_t)length + 1)))
+          return ERR_MEMORY;
+        strcpy(text, text_tags[i].keyword);
+        strcpy(text + strlen(text_tags[i].keyword) + 1, tt.text[i]);
+        err = write_chunk(PNG_CN_tEXt, (U8 *)text, length);
+        free(text);
+        if (0 != err) return err;
+    }
+
+    if (0 != (err = write_image_data())) return err;
+    return write_chunk(PNG_CN_IEND, NULL, 0);
+}
+
+static int
+write_chunk(
+    U32 name,
+    U8 *data,
+    U32 length)
+{
+    U8 buf[8];
+    U32 crc;
+
+    ASSERT(NULL != data || 0 == length);
+
+    BE_PUT32(buf, length);
+    BE_PUT32(buf + 4, name);
+    crc = update_crc(0xFFFFFFFFL, buf + 4, 4);
+    if (0 != length) crc = update_crc(crc, data, length);
+    crc ^= 0xFFFFFFFFL;
+
+    if (8 != fwrite(buf, 1, 8, tt.outf)) return ERR_WRITE;
+    if (0 != length && length != fwrite(data, 1, (size_t)length,
+      tt.outf)) return ERR_WRITE;
+    BE_PUT32(buf, crc);
+    if (4 != fwrite(buf, 1, 4, tt.outf)) return ERR_WRITE;
+    return 0;
+}
+
+/*
+ * Copy chunks from the PNGChunks tag, as they are, CRC and all:
+ * those that must come before PLTE if "early" is set, and the
+ * rest if not. Critical chunks have no business there, and a
+ * chunk we have already made from the tags is not copied twice.
+ */
+
+static int
+copy_chunks(
+    int early)
+{
+    U8 *p, *end;
+    U32 length, name;
+    int is_early;
+
+    if (NULL == tt.png_chunks) return 0;
+    p = tt.png_chunks;
+    end = p + tt.png_chunks_size;
+
+    while (end - p >= 12) {
+        length = BE_GET32(p);
+        name = BE_GET32(p + 4);
+        if (length > (U32)(end - p) - 12) {
+            print_warning(WARN_BAD_VAL);
+            break;
+        }
+        is_early = (PNG_CN_sBIT == name || PNG_CN_sRGB == name ||
+          PNG_CN_iCCP == name || PNG_CN_gAMA == name ||
+          PNG_CN_cHRM == name);
+
+        if (is_early == early && 0 != (name & PNG_CF_Ancillary) &&
+          !(PNG_CN_gAMA == name && 0 != tt.gamma) &&
+          !(PNG_CN_cHRM == name && 3 == tt.have_chromaticities) &&
+          PNG_CN_pHYs != name && PNG_CN_oFFs != name) {
+            if (length + 12 != fwrite(p, 1, (size_t)(length + 12),
+              tt.outf)) return ERR_WRITE;
+        }
+        p += length + 12;
+    }
+    return 0;
+}
+
+/*
+ * If the TransferFunction is ptot's rendering of a gAMA chunk,
+ * return the chunk's value. A first guess from the middle of the
+ * curve is close; then we look near it for the value that gives
+ * back the whole table, worked out just as gamma_table() in
+ * xform.c does it. Returns 0 if nothing does.
+ */
+
+static U32
+transfer_gamma(
+    void)
+{
+    U32 count, step, index, value;
+    S32 guess, delta, gamma;
+    double maxval, exponent;
+
+    if (NULL == tt.transfer) return 0;
+    count = 1L << tt.bits_per_sample;
+    if (count < 4 || (count != tt.transfer_count &&
+      3 * count != tt.transfer_count)) return 0;
+
+    step = 65535L / (count - 1);
+    value = tt.transfer[count / 2];
+    if (0 == value || value >= 65535L) return 0;
+    guess = (S32)floor(0.5 + 100000.0 *
+      log((double)(count / 2) / (double)(count - 1)) /
+      log((double)value / 65535.0));
+
+    maxval = 65535.0;
+    for (delta = 0; delta <= 100; ++delta) {
+        gamma = guess + ((delta & 1) ? -(delta + 1) / 2 : delta / 2);
+        if (gamma <= 0) continue;
+        exponent = 1.0 / ((double)gamma / 100000.0 * 1.0);
+
+        for (index = 1; index < count; ++index) {
+            value = (U32)floor(0.5 + maxval *
+              pow((double)(index * step) / maxval, exponent));
+            if (value != tt.transfer[index]) break;
+        }
+        if (index == count && 0 == tt.transfer[0]) return (U32)gamma;
+    }
+    return 0;
+}
+
+/*
+ * ptot fills the ColorMap out to full size with black, so we
+ * drop black entries from the end, but never one that a pixel
+ * uses. That takes a pass over the pixels.
+ */
+
+static int
+palette_entries(
+    U32 *entries)
+{
+    U32 row, col, highest, used, size, n;
+    int shift, mask;
+
+    ASSERT(NULL != tt.colormap);
+
+    size = 1L << tt.bits_per_sample;    /* Reds, greens, blues */
+    for (n = size; n > 1; --n) {
+        if (0 != tt.colormap[n - 1] || 0 != tt.colormap[size + n - 1]
+          || 0 != tt.colormap[2 * size + n - 1]) break;
+    }
+
+    if (NULL == (tt.row = (U8 *)malloc((size_t)tt.row_bytes)))
+      return ERR_MEMORY;
+    mask = (1 << tt.bits_per_sample) - 1;
+    highest = 0;
+
+    for (row = 0; row < tt.height; ++row) {
+        if (0 == row % tt.rows_per_strip && 0 != fseek(tt.inf,
+          (long)tt.strip_offsets[row / tt.rows_per_strip], SEEK_SET))
+          return ERR_READ;
+        if (tt.row_bytes != fread(tt.row, 1, (size_t)tt.row_bytes,
+          tt.inf)) return ERR_READ;
+
+        for (col = 0; col < tt.width; ++col) {
+            shift = 8 - tt.bits_per_sample *
+              (int)(1 + col % (8 / tt.bits_per_sample));
+            used = (tt.row[col * tt.bits_per_sample / 8] >> shift) &
+              mask;
+            if (used > highest) highest = used;
+        }
+    }
+    free(tt.row);
+    tt.row = NULL;
+
+    *entries = max(n, highest + 1);
+    return 0;
+}
+
+/*
+ * Read the strips a row at a time, filter each row and pass it
+ * to the compressor, whose output becomes the IDAT chunks.
+ */
+
+static int
+write_image_data(
+    void)
+{
+    int err, i, k;
+    U32 row, j;
+    U8 *tp;
+
+    tt.row = (U8 *)malloc((size_t)tt.row_bytes);
+    tt.prior = (U8 *)malloc((size_t)tt.row_bytes);
+    tt.idat = (U8 *)malloc((size_t)IDAT_SIZE);
+    if (NULL == tt.row || NULL == tt.prior || NULL == tt.idat)
+      return ERR_MEMORY;
+    for (i = 0; i < 5; ++i) {
+        tt.filtered[i] = (U8 *)malloc((size_t)tt.row_bytes + 1);
+        if (NULL == tt.filtered[i]) return ERR_MEMORY;
+        tt.filtered[i][0] = (U8)i;
+    }
+    memset(tt.prior, 0, (size_t)tt.row_bytes);
+    tt.idat_size = 0;
+
+    if (0 != (err = start_deflate(put_idat))) return err;
+
+    for (row = 0; row < tt.height; ++row) {
+        err = ERR_READ;
+        if (0 == row % tt.rows_per_strip && 0 != fseek(tt.inf,
+          (long)tt.strip_offsets[row / tt.rows_per_strip], SEEK_SET))
+          goto wi_err_out;
+        if (tt.row_bytes != fread(tt.row, 1, (size_t)tt.row_bytes,
+          tt.inf)) goto wi_err_out;
+        /*
+         * PNG's 16-bit samples are big-endian, and its gray is
+         * black at zero. Inverting a sample of any size inverts
+         * all its bits, so there is no need to unpack them.
+         */
+        if (16 == tt.bits_per_sample && !tt.motorola) {
+            for (j = 0; j < tt.row_bytes; j += 2) {
+                k = tt.row[j];
+                tt.row[j] = tt.row[j + 1];
+                tt.row[j + 1] = (U8)k;
+            }
+        }
+        if (0 == tt.photometric) {
+            k = tt.has_alpha ? tt.bpp / 2 : tt.bpp;
+            for (tp = tt.row; tp < tt.row + tt.row_bytes;
+              tp += tt.bpp) {
+                for (i = 0; i < k; ++i) tp[i] ^= 0xFF;
+            }
+        }
+        i = choose_filter(tt.row, tt.prior);
+        if (0 != (err = deflate_bytes(tt.filtered[i],
+          tt.row_bytes + 1))) goto wi_err_out;
+
+        tp = tt.prior;
+        tt.prior = tt.row;
+        tt.row = tp;
+    }
+    if (0 != (err = finish_deflate())) goto wi_err_out;
+    if (0 != tt.idat_size)
+      err = write_chunk(PNG_CN_IDAT, tt.idat, tt.idat_size);
+wi_err_out:
+    end_deflate();
+    return err;
+}
+
+/*
+ * Filter the row every way, and return the number of the filter
+ * to use. We take the one
+ * whose bytes, as signed differences, have the smallest sum of
+ * absolute values, as the PNG specification suggests. Palette
+ * images and those of less than 8 bits are better left alone.
+ */
+
+static int
+choose_filter(
+    U8 *row,
+    U8 *prior)
+{
+    U32 i, sum, best_sum;
+    int a, b, c, p, pa, pb, pc, f, best;
+    U8 *none, *sub, *up, *avg, *paeth;
+
+    none = tt.filtered[0] + 1;
+    memcpy(none, row, (size_t)tt.row_bytes);
+    if (TIFF_PI_PLTE == tt.photometric || tt.bits_per_sample < 8)
+      return 0;
+    sub = tt.filtered[1] + 1;
+    up = tt.filtered[2] + 1;
+    avg = tt.filtered[3] + 1;
+    paeth = tt.filtered[4] + 1;
+
+    for (i = 0; i < tt.row_bytes; ++i) {
+        a = (i < (U32)tt.bpp) ? 0 : row[i - tt.bpp];
+        b = prior[i];
+        c = (i < (U32)tt.bpp) ? 0 : prior[i - tt.bpp];
+
+        sub[i] = (U8)(row[i] - a);
+        up[i] = (U8)(row[i] - b);
+        avg[i] = (U8)(row[i] - ((a + b) >> 1));
+
+        p = a + b - c;
+        pa = abs(p - a);
+        pb = abs(p - b);
+        pc = abs(p - c);
+        if (pa <= pb && pa <= pc) p = a;
+        else if (pb <= pc) p = b;
+        else p = c;
+        paeth[i] = (U8)(row[i] - p);
+    }
+    best = 0;
+    best_sum = 0xFFFFFFFFL;
+    for (f = 0; f < 5; ++f) {
+        sum = 0;
+        for (i = 1; i <= tt.row_bytes; ++i) {
+            c = tt.filtered[f][i];
+            sum += (c < 128) ? c : 256 - c;
+        }
+        if (sum < best_sum) {
+            best_sum = sum;
+            best = f;
+        }
+    }
+    return best;
+}
+
+/*
+ * Compressed data from deflate.c, gathered into IDAT chunks.
+ */
+
+static int
+put_idat(
+    U8 *data,
+    U32 count)
+{
+    int err;
+    U32 n;
+
+    while (0 != count) {
+        n = min(count, IDAT_SIZE - tt.idat_size);
+        memcpy(tt.idat + tt.idat_size, data, (size_t)n);
+        tt.idat_size += n;
+        data += n;
+        count -= n;
+
+        if (IDAT_SIZE == tt.idat_size) {
+            err = write_chunk(PNG_CN_IDAT, tt.idat, tt.idat_size);
+            if (0 != err) return err;
+            tt.idat_size = 0;
+        }
+    }
+    return 0;
+}
+
+static void
+free_TIFF(
+    void)
+{
+    int i;
+
+    if (NULL != tt.strip_offsets) free(tt.strip_offsets);
+    if (NULL != tt.strip_counts) free(tt.strip_counts);
+    if (NULL != tt.colormap) free(tt.colormap);
+    if (NULL != tt.transfer) free(tt.transfer);
+    if (NULL != tt.png_chunks) free(tt.png_chunks);
+    for (i = 0; i < N_KEYWORDS; ++i) {
+        if (NULL != tt.text[i]) free(tt.text[i]);
+    }
+    if (NULL != tt.row) free(tt.row);
+    if (NULL != tt.prior) free(tt.prior);
+    for (i = 0; i < 5; ++i) {
+        if (NULL != tt.filtered[i]) free(tt.filtered[i]);
+    }
+    if (NULL != tt.idat) free(tt.idat);
+}
+
+/*
+ * End of ttop.c
+ */
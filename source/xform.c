@@ -0,0 +1,620 @@
+/*
+ * xform.c
+ *
+ * Pixel transformations applied while the output modules read
+ * scanlines back from the pixel data file. setup_transforms()
+ * is called once the PNG has been read; it rewrites the image
+ * description to match what the transformations will produce,
+ * so the output modules never need to know about them. They
+ * then call read_pixel_row() for each scanline.
+ *
+ * With --flatten, alpha is composited over a background color
+ * and dropped, so the output modules never see it at all.
+ *
+ * Scanlines are in "pixel data file" layout both before and
+ * after: one byte per sample, with 1, 2, and 4-bit values
+ * scaled up to 8 bits, or two bytes per sample in PNG (big-
+ * endian) order for 16-bit images.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "ptot.h"
+
+#define DEFINE_ENUMS
+#include "errors.h"
+
+static void expand_palette_trns(U8 *, U8 *);
+static void expand_gray_trns(U8 *, U8 *);
+static void expand_rgb_trns(U8 *, U8 *);
+static void set_background(IMG_INFO *);
+static void flatten_ga_8(U8 *, U8 *);
+static void flatten_rgba_8(U8 *, U8 *);
+static void flatten_ga_16(U8 *, U8 *);
+static void flatten_rgba_16(U8 *, U8 *);
+static void apply_gamma(U8 *);
+
+static struct _xform_state {
+    IMG_INFO source;        /* Image as stored in the data file */
+    size_t in_size;         /* Bytes in one stored scanline */
+    U8 *in_line;
+    void (*expand_trns)(U8 *, U8 *);
+    void (*flatten)(U8 *, U8 *);
+    U8 *alpha_line;         /* Expanded line, to be flattened */
+    U32 back[3];            /* Background, in output samples */
+    U8 rgba_lut[4 * 256];   /* Palette index -> RGBA */
+    U8 alpha_lut[256];      /* 8-bit gray -> alpha */
+    U32 key;                /* Transparent color, packed */
+    U16 *gamma;             /* Gamma table, NULL if none */
+    U8 gamma8[256];         /* Same, for 8-bit samples */
+    int out_samples;        /* Samples per pixel, after */
+    int color_samples;      /* Those not alpha */
+} xs;
+
+/*
+ * Put sample "s" over background "b" with alpha "a", into "d",
+ * rounded to nearest. For the t that can arise, t / 255 is
+ * exactly (t + (t >> 8)) >> 8, and the same goes for 65535, so
+ * there is no division; nothing overflows a U32.
+ */
+
+#define BLEND_8(d, s, b, a) { \
+    U32 t_ = (U32)(s) * (a) + (b) * (255 - (a)) + 128; \
+    (d) = (U8)((t_ + (t_ >> 8)) >> 8); \
+}
+
+#define BLEND_16(d, s, b, a) { \
+    U32 t_ = (U32)(s) * (a) + (b) * (65535L - (a)) + 32768L; \
+    (d) = (U16)((t_ + (t_ >> 16)) >> 16); \
+}
+
+/*
+ * Gamma tables are expensive to build (a pow() per entry, and
+ * 65536 entries at 16 bits), and the same few are wanted over
+ * and over, so we keep the last several around.
+ */
+
+#define GAMMA_CACHE_SIZE 4
+
+static struct _gamma_cache {
+    double source, target;
+    int depth;
+    U16 *table;
+} gamma_cache[GAMMA_CACHE_SIZE];
+static int gamma_cache_next;
+
+/*
+ * Return a table mapping "depth"-bit samples encoded with the
+ * PNG file gamma "source" to samples for a display whose gamma
+ * is "target". Tables belong to the cache; don't free them.
+ * Returns NULL if out of memory.
+ */
+
+U16 *
+gamma_table(
+    double source,
+    double target,
+    int depth)
+{
+    int i;
+    U32 count, index;
+    double maxval, exponent;
+    U16 *table;
+
+    ASSERT(0.0 != source && 0.0 != target);
+    ASSERT(depth > 0 && depth <= 16);
+
+    for (i = 0; i < GAMMA_CACHE_SIZE; ++i) {
+        if (NULL != gamma_cache[i].table &&
+          source == gamma_cache[i].source &&
+          target == gamma_cache[i].target &&
+          depth == gamma_cache[i].depth)
+          return gamma_cache[i].table;
+    }
+    count = 1L << depth;
+    if (NULL == (table = (U16 *)malloc((size_t)(count * 2))))
+      return NULL;
+
+    maxval = (double)count - 1.0;
+    exponent = 1.0 / (source * target);
+
+    table[0] = 0;
+    for (index = 1; index < count; ++index) {
+        table[index] = (U16)floor(0.5 + maxval *
+          pow((double)index / maxval, exponent));
+    }
+    i = gamma_cache_next;
+    gamma_cache_next = (i + 1) % GAMMA_CACHE_SIZE;
+
+    if (NULL != gamma_cache[i].table) free(gamma_cache[i].table);
+    gamma_cache[i].source = source;
+    gamma_cache[i].target = target;
+    gamma_cache[i].depth = depth;
+    gamma_cache[i].table = table;
+    return table;
+}
+
+/*
+ * Bytes per scanline in pixel data file layout.
+ */
+
+size_t
+pixel_row_size(
+    IMG_INFO *image)
+{
+    size_t size;
+
+    ASSERT(NULL != image);
+
+    size = (size_t)image->width * image->samples_per_pixel;
+    if (16 == image->bits_per_sample) size *= 2;
+    return size;
+}
+
+/*
+ * Refuse images whose sizes we can't hold. A scanline, even
+ * once expanded through the palette, must fit in a size_t for
+ * our buffers and in a U32 for the writers; and the whole pixel
+ * data file must fit in a long, which is what stdio gives us for
+ * file offsets. With a 64-bit long that is anything PNG can
+ * describe whose rows are under 4GB; with a 32-bit long the
+ * pixel data is limited to 2GB. Checking once, here, is what
+ * lets the rest of the code multiply sizes without wrapping.
+ */
+
+int
+check_image_size(
+    IMG_INFO *image)
+{
+    unsigned long bytes, row_max;
+
+    ASSERT(NULL != image);
+
+    if (0 == image->width || 0 == image->height) return ERR_BAD_IMAGE;
+
+    bytes = image->samples_per_pixel;
+    if (16 == image->bits_per_sample) bytes *= 2;
+    if (image->is_palette) bytes = 3;
+
+    row_max = 0xFFFFFFFFUL;
+    if ((size_t)-1 < row_max) row_max = (unsigned long)(size_t)-1;
+    /*
+     * Allow one more byte per row for the PNG filter type.
+     */
+    if (image->width > (row_max - 1) / bytes) return ERR_TOO_BIG;
+
+    bytes = (unsigned long)pixel_row_size(image);
+    if (image->height > (unsigned long)LONG_MAX / bytes)
+      return ERR_TOO_BIG;
+    return 0;
+}
+
+/*
+ * Decide which transformations apply to this image, build
+ * their lookup tables, and update the image description.
+ */
+
+int
+setup_transforms(
+    IMG_INFO *image)
+{
+    int index, depth, err;
+    U16 key;
+    size_t size;
+
+    ASSERT(NULL != image);
+
+    end_transforms();
+    xs.source = *image;
+    xs.in_size = pixel_row_size(image);
+    xs.expand_trns = NULL;
+    xs.flatten = NULL;
+    xs.gamma = NULL;
+    if (opts.flatten) set_background(image);
+    /*
+     * Flattening a palette image needs no work per pixel: each
+     * palette entry is composited with its tRNS alpha, once,
+     * here. It is done before gamma correction, as for every
+     * other image, since the background is in the file's own
+     * encoding.
+     */
+    if (opts.flatten && image->is_palette && image->has_trns) {
+        for (index = 0; index < image->palette_size; ++index) {
+            U32 alpha = image->palette_trans_bytes[index];
+            U8 *entry = image->palette + 3 * index;
+            int i;
+
+            for (i = 0; i < 3; ++i)
+              BLEND_8(entry[i], entry[i], xs.back[i], alpha);
+        }
+        image->has_trns = FALSE;
+    }
+    /*
+     * Gamma correction. Palette images are corrected once, in
+     * the palette, before anything else uses it. Sub-byte gray
+     * samples are already scaled to 8 bits in the data file, and
+     * after correction they no longer fit in fewer, so they
+     * become 8-bit. The tRNS key is matched against the original
+     * samples, so it needs no correcting.
+     */
+    if (0.0 != opts.target_gamma && 0.0 == image->source_gamma)
+      print_warning(WARN_NO_GAMA);
+
+    if (0.0 != opts.target_gamma && 0.0 != image->source_gamma) {
+        depth = (16 == image->bits_per_sample) ? 16 : 8;
+        xs.gamma = gamma_table(image->source_gamma,
+          opts.target_gamma, depth);
+        if (NULL == xs.gamma) return ERR_MEMORY;
+        if (8 == depth) {
+            for (index = 0; index < 256; ++index)
+              xs.gamma8[index] = (U8)xs.gamma[index];
+        }
+        if (image->is_palette) {
+            for (index = 0; index < 3 * image->palette_size; ++index)
+              image->palette[index] = xs.gamma8[image->palette[index]];
+            xs.gamma = NULL;
+        }
+        image->source_gamma = 1.0 / opts.target_gamma;
+    }
+    /*
+     * tRNS expansion. Palette images turn into 8-bit RGBA
+     * through a table holding a whole output pixel for every
+     * possible stored byte. Gray and RGB images get an alpha
+     * channel that is clear only where the pixel matches the
+     * transparent color. --flatten needs the alpha channel too,
+     * and then takes it away again below.
+     */
+    if ((opts.expand_trns || opts.flatten) && image->has_trns &&
+      !image->has_alpha) {
+        if (image->is_palette) {
+            memset(xs.rgba_lut, 0, sizeof xs.rgba_lut);
+
+            for (index = 0; index < 256; ++index) {
+                int entry = index >> (8 - image->bits_per_sample);
+
+                xs.rgba_lut[4 * index + 3] = 255;
+                if (entry >= image->palette_size) continue;
+                memcpy(xs.rgba_lut + 4 * index,
+                  image->palette + 3 * entry, 3);
+                xs.rgba_lut[4 * index + 3] =
+                  image->palette_trans_bytes[entry];
+            }
+            xs.expand_trns = expand_palette_trns;
+            image->is_palette = FALSE;
+            image->is_color = TRUE;
+            image->samples_per_pixel = 4;
+            image->bits_per_sample = 8;
+        } else if (image->is_color) {
+            /*
+             * 16-bit samples are compared one at a time. An
+             * out of range 8-bit color can never match.
+             */
+            xs.key = 0xFFFFFFFFL;
+            if (16 != image->bits_per_sample &&
+              image->trans_values[0] < 256 &&
+              image->trans_values[1] < 256 &&
+              image->trans_values[2] < 256) {
+                xs.key = ((U32)image->trans_values[0] << 16) |
+                  (image->trans_values[1] << 8) |
+                  image->trans_values[2];
+            }
+            xs.expand_trns = expand_rgb_trns;
+            image->samples_per_pixel = 4;
+        } else {
+            key = image->trans_values[0];
+            if (image->bits_per_sample < 8) {
+                key = (key * 255) /
+                  ((1 << image->bits_per_sample) - 1);
+                image->bits_per_sample = 8;
+            }
+            xs.key = key;
+            for (index = 0; index < 256; ++index)
+              xs.alpha_lut[index] = (index == key) ? 0 : 255;
+
+            xs.expand_trns = expand_gray_trns;
+            image->samples_per_pixel = 2;
+        }
+        image->has_alpha = TRUE;
+        image->has_trns = FALSE;
+    }
+    /*
+     * Flattening. Gray-alpha and RGBA images lose their alpha
+     * sample, composited over the background; a kernel for each
+     * layout does a whole scanline.
+     */
+    if (opts.flatten && image->has_alpha) {
+        if (16 == image->bits_per_sample) {
+            xs.flatten = image->is_color ? flatten_rgba_16 :
+              flatten_ga_16;
+        } else {
+            xs.flatten = image->is_color ? flatten_rgba_8 :
+              flatten_ga_8;
+        }
+        --image->samples_per_pixel;
+        image->has_alpha = FALSE;
+    }
+    if (NULL != xs.gamma) {
+        if (image->bits_per_sample < 8) image->bits_per_sample = 8;
+        xs.out_samples = image->samples_per_pixel;
+        xs.color_samples = xs.out_samples;
+        if (image->has_alpha) --xs.color_samples;
+    }
+    if (0 != (err = check_image_size(image))) return err;
+
+    if (NULL != xs.expand_trns || NULL != xs.flatten) {
+        xs.in_line = (U8 *)malloc(xs.in_size);
+        if (NULL == xs.in_line) return ERR_MEMORY;
+    }
+    if (NULL != xs.expand_trns && NULL != xs.flatten) {
+        size = pixel_row_size(image) / image->samples_per_pixel *
+          (image->samples_per_pixel + 1);
+        if (NULL == (xs.alpha_line = (U8 *)malloc(size)))
+          return ERR_MEMORY;
+    }
+    return 0;
+}
+
+/*
+ * Release anything setup_transforms() allocated.
+ */
+
+void
+end_transforms(
+    void)
+{
+    if (NULL != xs.in_line) free(xs.in_line);
+    if (NULL != xs.alpha_line) free(xs.alpha_line);
+    xs.in_line = xs.alpha_line = NULL;
+    xs.expand_trns = NULL;
+    xs.flatten = NULL;
+    xs.gamma = NULL;
+}
+
+/*
+ * Read one scanline from the pixel data file and transform it
+ * into the buffer passed, which must have room for a line of
+ * the image as described after setup_transforms().
+ */
+
+int
+read_pixel_row(
+    FILE *inf,
+    U8 *row)
+{
+    ASSERT(NULL != inf);
+    ASSERT(NULL != row);
+
+    if (NULL == xs.expand_trns && NULL == xs.flatten) {
+        if (xs.in_size != fread(row, 1, xs.in_size, inf))
+          return ERR_READ;
+    } else {
+        if (xs.in_size != fread(xs.in_line, 1, xs.in_size, inf))
+          return ERR_READ;
+        if (NULL == xs.flatten) (*xs.expand_trns)(xs.in_line, row);
+        else if (NULL == xs.expand_trns) (*xs.flatten)(xs.in_line, row);
+        else {
+            (*xs.expand_trns)(xs.in_line, xs.alpha_line);
+            (*xs.flatten)(xs.alpha_line, row);
+        }
+    }
+    if (NULL != xs.gamma) apply_gamma(row);
+    return 0;
+}
+
+/*
+ * The expansion loops. Each one handles a whole scanline with
+ * no per-pixel branches, building the alpha value from the
+ * result of the comparison, so that they run straight through
+ * (and a compiler may vectorize them).
+ */
+
+static void
+expand_palette_trns(
+    U8 *src,
+    U8 *dst)
+{
+    U32 col;
+
+    for (col = 0; col < xs.source.width; ++col) {
+        memcpy(dst, xs.rgba_lut + 4 * *src++, 4);
+        dst += 4;
+    }
+}
+
+static void
+expand_gray_trns(
+    U8 *src,
+    U8 *dst)
+{
+    U32 col;
+    U16 sample;
+
+    if (16 != xs.source.bits_per_sample) {
+        for (col = 0; col < xs.source.width; ++col) {
+            dst[0] = *src;
+            dst[1] = xs.alpha_lut[*src++];
+            dst += 2;
+        }
+        return;
+    }
+    for (col = 0; col < xs.source.width; ++col) {
+        sample = BE_GET16(src);
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = dst[3] = (U8)-(sample != (U16)xs.key);
+        src += 2;
+        dst += 4;
+    }
+}
+
+static void
+expand_rgb_trns(
+    U8 *src,
+    U8 *dst)
+{
+    U32 col, pixel;
+    U16 *key;
+    int opaque;
+
+    if (16 != xs.source.bits_per_sample) {
+        for (col = 0; col < xs.source.width; ++col) {
+            pixel = ((U32)src[0] << 16) | (src[1] << 8) | src[2];
+            dst[0] = src[0];
+            dst[1] = src[1];
+            dst[2] = src[2];
+            dst[3] = (U8)-(pixel != xs.key);
+            src += 3;
+            dst += 4;
+        }
+        return;
+    }
+    key = xs.source.trans_values;
+    for (col = 0; col < xs.source.width; ++col) {
+        opaque = (BE_GET16(src) != key[0]) |
+          (BE_GET16(src + 2) != key[1]) |
+          (BE_GET16(src + 4) != key[2]);
+        memcpy(dst, src, 6);
+        dst[6] = dst[7] = (U8)-opaque;
+        src += 6;
+        dst += 8;
+    }
+}
+
+/*
+ * Work out the --flatten background: the color given, or else
+ * the PNG's bKGD, or else white. It is kept as samples of the
+ * depth the kernels will see, which is 16 bits for 16-bit
+ * images and 8 for everything else (sub-byte gray is scaled up
+ * in the data file). A color given for a gray image is turned
+ * into its luminance.
+ */
+
+static void
+set_background(
+    IMG_INFO *image)
+{
+    U32 full, value, limit;
+    int i, gray, depth;
+
+    depth = image->bits_per_sample;
+    full = (16 == depth) ? 65535L : 255;
+    gray = !image->is_color && !image->is_palette;
+
+    for (i = 0; i < 3; ++i) {
+        if (opts.flatten_color[0] >= 0) {
+            value = (U32)opts.flatten_color[i] * (full / 255);
+        } else if (image->has_background) {
+            value = image->background_color[gray ? 0 : i];
+            if (gray && depth < 8) {
+                limit = (1 << depth) - 1;
+                value = (min(value, limit) * 255) / limit;
+            }
+            value = min(value, full);
+        } else value = full;
+        xs.back[i] = value;
+    }
+    if (gray && opts.flatten_color[0] >= 0) {
+        xs.back[0] = (299L * opts.flatten_color[0] +
+          587L * opts.flatten_color[1] +
+          114L * opts.flatten_color[2] + 500) / 1000 * (full / 255);
+    }
+}
+
+/*
+ * The flattening kernels, one for each pixel layout, so that
+ * the number of color samples is a constant and the inner loop
+ * unrolls. Like the expansion loops they have no per-pixel
+ * branches, and are written so a compiler may vectorize them.
+ */
+
+#define FLATTEN_8(name, colors) \
+static void \
+name( \
+    U8 *src, \
+    U8 *dst) \
+{ \
+    U32 col, alpha; \
+    int i; \
+\
+    for (col = 0; col < xs.source.width; ++col) { \
+        alpha = src[colors]; \
+        for (i = 0; i < colors; ++i) \
+          BLEND_8(dst[i], src[i], xs.back[i], alpha); \
+        src += colors + 1; \
+        dst += colors; \
+    } \
+}
+
+#define FLATTEN_16(name, colors) \
+static void \
+name( \
+    U8 *src, \
+    U8 *dst) \
+{ \
+    U32 col, alpha; \
+    U16 value; \
+    int i; \
+\
+    for (col = 0; col < xs.source.width; ++col) { \
+        alpha = BE_GET16(src + 2 * colors); \
+        for (i = 0; i < colors; ++i) { \
+            BLEND_16(value, BE_GET16(src + 2 * i), xs.back[i], alpha); \
+            dst[2 * i] = (U8)(value >> 8); \
+            dst[2 * i + 1] = (U8)value; \
+        } \
+        src += 2 * (colors + 1); \
+        dst += 2 * colors; \
+    } \
+}
+
+FLATTEN_8(flatten_ga_8, 1)
+FLATTEN_8(flatten_rgba_8, 3)
+FLATTEN_16(flatten_ga_16, 1)
+FLATTEN_16(flatten_rgba_16, 3)
+
+#undef FLATTEN_8
+#undef FLATTEN_16
+
+/*
+ * Gamma-correct a scanline in place, leaving alpha alone. With
+ * no alpha, 8-bit lines are one straight table lookup per byte.
+ */
+
+static void
+apply_gamma(
+    U8 *row)
+{
+    U32 col, count;
+    int sample;
+    U16 value;
+
+    if (16 != xs.source.bits_per_sample) {
+        if (xs.color_samples == xs.out_samples) {
+            count = xs.source.width * xs.color_samples;
+            for (col = 0; col < count; ++col)
+              row[col] = xs.gamma8[row[col]];
+            return;
+        }
+        for (col = 0; col < xs.source.width; ++col) {
+            for (sample = 0; sample < xs.color_samples; ++sample)
+              row[sample] = xs.gamma8[row[sample]];
+            row += xs.out_samples;
+        }
+        return;
+    }
+    for (col = 0; col < xs.source.width; ++col) {
+        for (sample = 0; sample < xs.color_samples; ++sample) {
+            value = xs.gamma[BE_GET16(row + 2 * sample)];
+            row[2 * sample] = (U8)(value >> 8);
+            row[2 * sample + 1] = (U8)value;
+        }
+        row += 2 * xs.out_samples;
+    }
+}
+
+/*
+ * End of xform.c
+ */
@@ -1,9 +1,9 @@
 /*
  * zchunks.c
  *
- * Code for handling deflated chunks (IDAT and zTXt) is naturally
- * much larger than that for all the other chunks, so I move it all
- * here (as well as tEXt, which shares code with zTXt).
+ * Code for handling deflated chunks (IDAT, zTXt and iTXt) is
+ * naturally much larger than that for all the other chunks, so I
+ * move it all here (as well as tEXt, which shares code with zTXt).
  *
  **********
  *
@@ -22,12 +22,14 @@
 #define DEFINE_ENUMS
 #include "errors.h"
 
+#define INFLATE_WINDOW_SIZE 32768L  /* Largest zlib window */
+
 extern PNG_STATE ps;
 
 /*
- * Interlacing tables
+ * Interlacing tables, shared with adam7.c
  */
-static int
+int
     interlace_pattern[8][8] = {
         { 0, 5, 3, 5, 1, 5, 3, 5 },
         { 6, 6, 6, 6, 6, 6, 6, 6 },
@@ -44,18 +46,36 @@ static int
 
 static int zlib_start(void);
 static void zlib_end(void);
-static void unfilter(int);
-static void write_byte(void);
+static void unfilter_1(U8 *, U8 *, U8 *, size_t, size_t, int);
+static void unfilter_2(U8 *, U8 *, U8 *, size_t, size_t, int);
+static void unfilter_3(U8 *, U8 *, U8 *, size_t, size_t, int);
+static void unfilter_4(U8 *, U8 *, U8 *, size_t, size_t, int);
+static void unfilter_6(U8 *, U8 *, U8 *, size_t, size_t, int);
+static void unfilter_8(U8 *, U8 *, U8 *, size_t, size_t, int);
+static void write_row(void);
+static void put_row(U8 *, size_t);
+static long pass_file_size(int);
 static int repack_tempfiles(void);
+static int set_crop_window(void);
+static int set_thumbnail(void);
+static void box_filter_row(void);
+static void reduce_image_info(void);
+static int store_text(U8 *, U32);
+static int grow_buffer(U8 **, U32 *, U32, U32);
+static int store_png_data(U8 *, U32);
 
 /*
  * Decode IDAT chunk. Most of the real work is done inside
  * the NEXTBYTE and FLUSH macros that interface with inflate.c.
+ * APNG frames come through here too (see decode_fdAT()), with
+ * ps.frame set and the frame's size in the image structure.
  */
 
 #define IS_ZTXT (PNG_CN_zTXt == ps.current_chunk_name)
 #define IS_TEXT (PNG_CN_tEXt == ps.current_chunk_name)
+#define IS_ITXT (PNG_CN_iTXt == ps.current_chunk_name)
 #define IS_IDAT (PNG_CN_IDAT == ps.current_chunk_name)
+#define IS_FDAT (PNG_CN_fdAT == ps.current_chunk_name)
 
 int
 decode_IDAT(
@@ -73,9 +93,35 @@ decode_IDAT(
         ps.image->is_palette = ps.image->is_color = FALSE;
     }
     ps.got_first_idat = TRUE;
+    /*
+     * A library caller with a row callback gets the rows of a
+     * plain image straight from the unfilter, and we never
+     * write a pass file. Interlaced images and reduced ones
+     * go to the pass files as usual.
+     */
+    ps.stream_rows = (NULL == ps.frame && NULL != ptot_callbacks &&
+      NULL != ptot_callbacks->row && !ps.image->is_interlaced &&
+      0 == opts.thumbnail && !opts.crop);
+
+    if (NULL == ps.frame && NULL != ptot_callbacks &&
+      NULL != ptot_callbacks->info &&
+      0 != ptot_callbacks->info(ptot_callbacks->user, ps.image)) {
+        err = ERR_STOPPED;
+        goto di_err_out;
+    }
     bpp = ps.image->bits_per_sample / 8;
     if (0 == bpp) bpp = 1;
     ps.byte_offset = ps.image->samples_per_pixel * bpp;
+
+    switch (ps.byte_offset) {
+    case 1: ps.unfilter = unfilter_1; break;
+    case 2: ps.unfilter = unfilter_2; break;
+    case 3: ps.unfilter = unfilter_3; break;
+    case 4: ps.unfilter = unfilter_4; break;
+    case 6: ps.unfilter = unfilter_6; break;
+    case 8: ps.unfilter = unfilter_8; break;
+    default: ASSERT(FALSE);
+    }
     /*
      * Allocate largest line needed for filtering
      */
@@ -87,35 +133,87 @@ decode_IDAT(
         err = ERR_MEMORY;
         goto di_err_out;
     }
+    if (ps.image->bits_per_sample < 8 && NULL ==
+      (ps.row_buf = (U8 *)malloc((size_t)ps.image->width))) {
+        err = ERR_MEMORY;
+        goto di_err_out;
+    }
     memset(ps.this_line, 0, ps.line_size);
     memset(ps.last_line, 0, ps.line_size);
 
     ps.current_row = ps.interlace_pass = ps.line_x = 0;
     ps.cur_filter = 255;
+    ps.stop_inflate = FALSE;
+    ps.decode_err = 0;
+
+    if (0 != (err = set_crop_window())) goto di_err_out;
+    if (0 != (err = set_thumbnail())) goto di_err_out;
 
     ps.bytes_in_buf = 0L;   /* Required before calling NEXTBYTE */
     ps.bufp = ps.buf;
 
-    if (0 != (err = zlib_start())) goto di_err_out;
-    if (0 != (err = create_tempfile(0))) goto di_err_out;
+    if (0 != (err = start_adam7())) goto di_err_out;
+    if (!ps.stream_rows && !ps.adam7 &&
+      0 != (err = create_tempfile(0, pass_file_size(0))))
+      goto di_err_out;
 
     if (ps.image->is_interlaced) {
-        for (pass = 1; pass <= 6; ++pass) {
-            if (0 != (err = create_tempfile(pass)))
-              goto di_err_out;
+        for (pass = 1; pass <= 6 && !ps.adam7; ++pass) {
+            if (0 != (err = create_tempfile(pass,
+              pass_file_size(pass)))) goto di_err_out;
         }
         ps.line_size = new_line_size(ps.image, 0, 8);
     } else {
         ps.line_size = new_line_size(ps.image, 0, 1);
     }
-    if (0 != (err = inflate())) goto di_err_out;
-
-    close_all_tempfiles();
-    err = repack_tempfiles();
+    if (0 != (err = zlib_start())) goto di_err_out;
+    if (0 != (err = start_index())) goto di_err_out;
+    /*
+     * A failure after starting from an index checkpoint may be
+     * the index's fault, and then we go round again from the
+     * start of the image data.
+     */
+    while (0 != inflate() && !ps.stop_inflate) {
+        if (!restart_index()) {
+            err = ERR_INFLATE;
+            goto di_err_out;
+        }
+    }
+    if (0 != (err = ps.decode_err)) goto di_err_out;
+    if (ps.adam7 && 0 != (err = finish_adam7())) goto di_err_out;
+    /*
+     * Short image data shows up when a pass file is read back,
+     * but rows that went straight to the caller must be checked
+     * here.
+     */
+    if (ps.stream_rows && !ps.stop_inflate &&
+      ps.current_row < ps.image->height) {
+        err = ERR_EARLY_EOI;
+        goto di_err_out;
+    }
+    /*
+     * If we stopped before the end of the compressed data,
+     * don't bother reading the rest of it.
+     */
+    if (ps.stop_inflate) {
+        if (0 != (err = seek_chunk_data())) goto di_err_out;
+    }
+    if (!ps.stream_rows) {
+        TRACE_BEGIN(TRACE_REPACK, 0);
+        err = repack_tempfiles();
+        TRACE_END(TRACE_REPACK);
+    }
+    if (0 == err) reduce_image_info();
 di_err_out:
     if (NULL != ps.this_line) free(ps.this_line);
     if (NULL != ps.last_line) free(ps.last_line);
+    if (NULL != ps.row_buf) free(ps.row_buf);
+    ps.row_buf = NULL;
+    if (NULL != ps.thumb_sums) free(ps.thumb_sums);
+    ps.thumb_sums = NULL;
+    end_adam7();
 
+    if (0 != end_index() && 0 == err) err = ERR_WRITE;
     zlib_end();
     return err;
 }
@@ -130,7 +228,6 @@ static int
 zlib_start(
     void)
 {
-    ASSERT(NULL != ps.inf);
     ASSERT(NULL != ps.buf);
 
     ps.sum1 = 1;    /* Precondition Adler checksum */
@@ -138,14 +235,18 @@ zlib_start(
     ps.inflate_flags = (NEXTBYTE << 8);
     ps.inflate_flags |= NEXTBYTE;
 
-    ps.inflate_window_size =
-      1L << (((ps.inflate_flags >> 12) & 0x0F) + 8);
-
-    if (ps.inflate_window_size > 32768) return ERR_COMP_HDR;
-
     if ( (0 != (ps.inflate_flags % 31)) ||
       (8 != ((ps.inflate_flags >> 8) & 0x0F)) ||
+      (((ps.inflate_flags >> 12) & 0x0F) > 7) ||
       (0 != (ps.inflate_flags & 0x0020)) ) return ERR_COMP_HDR;
+    /*
+     * The window size in the header (CINFO) is only what the
+     * compressor used; a smaller window than ours decodes just
+     * the same. So we always use the largest, since output is
+     * flushed each time the window fills: a 1K window would mean
+     * a flush_window() call for every 1K of image data.
+     */
+    ps.inflate_window_size = INFLATE_WINDOW_SIZE;
 
     ps.inflate_window =
       (U8 *)malloc((size_t)(ps.inflate_window_size));
@@ -165,11 +266,15 @@ zlib_end(
 {
     U16 sum1, sum2;
 
-    ASSERT(NULL != ps.inf);
     ASSERT(NULL != ps.buf);
 
     if (NULL == ps.inflate_window) return;
     free(ps.inflate_window);
+    ps.inflate_window = NULL;
+    /*
+     * No checksum to verify if we didn't read to the end.
+     */
+    if (ps.stop_inflate || 0 != ps.decode_err) return;
 
     sum2 = NEXTBYTE << 8;
     sum2 |= NEXTBYTE;
@@ -181,53 +286,213 @@ zlib_end(
 }
 
 /*
- * Unfilter the image data byte passed in, and put it into the
- * ps.this_line[] array for write_pixel to find.
+ * Work out which part of the image we are to keep, clipping the
+ * requested rectangle to the image. With no --crop option, this
+ * is the whole image.
+ */
+
+static int
+set_crop_window(
+    void)
+{
+    ASSERT(NULL != ps.image);
+
+    ps.cropping = opts.crop;
+    if (!ps.cropping) {
+        ps.crop_x = ps.crop_y = 0;
+        ps.crop_width = ps.image->width;
+        ps.crop_height = ps.image->height;
+        return 0;
+    }
+    if (opts.crop_x >= ps.image->width ||
+      opts.crop_y >= ps.image->height) return ERR_CROP;
+
+    ps.crop_x = opts.crop_x;
+    ps.crop_y = opts.crop_y;
+    ps.crop_width = min(opts.crop_width, ps.image->width - ps.crop_x);
+    ps.crop_height =
+      min(opts.crop_height, ps.image->height - ps.crop_y);
+    return 0;
+}
+
+/*
+ * Choose how to make a --thumbnail=N image: as small as we can
+ * while keeping the longer side at least N pixels. Interlaced
+ * images already contain reduced images--pass 1 alone is every
+ * 8th pixel each way, passes 1-3 every 4th, and passes 1-5
+ * every 2nd--so we simply stop decoding after the last pass
+ * needed. Others are reduced by averaging each factor-by-factor
+ * box of pixels as the rows come out of the unfilter.
+ */
+
+static int
+set_thumbnail(
+    void)
+{
+    U32 longside, factor;
+    size_t sums;
+
+    ASSERT(NULL != ps.image);
+
+    ps.thumb_factor = 1;
+    ps.last_pass = 6;
+    ps.thumb_rows = 0;
+    if (0 == opts.thumbnail) return 0;
+
+    longside = max(ps.image->width, ps.image->height);
+
+    if (ps.image->is_interlaced) {
+        for (factor = 8; factor > 1; factor /= 2) {
+            if ((longside + factor - 1) / factor >= opts.thumbnail)
+              break;
+        }
+        ps.thumb_factor = factor;
+        switch (factor) {
+        case 8: ps.last_pass = 0;   break;
+        case 4: ps.last_pass = 2;   break;
+        case 2: ps.last_pass = 4;   break;
+        default: ps.last_pass = 6;  break;
+        }
+        return 0;
+    }
+    factor = longside / opts.thumbnail;
+    ps.thumb_factor = max(1, factor);
+    if (1 == ps.thumb_factor) return 0;
+
+    sums = (size_t)((ps.image->width + ps.thumb_factor - 1) /
+      ps.thumb_factor) * ps.image->samples_per_pixel;
+    ps.thumb_sums = (double *)malloc(sums * sizeof (double));
+    if (NULL == ps.thumb_sums) return ERR_MEMORY;
+    memset(ps.thumb_sums, 0, sums * sizeof (double));
+
+    return 0;
+}
+
+/*
+ * Now that the pixels are in the data file, make the image
+ * description match what we actually kept.
  */
 
 static void
-unfilter(
-    int inbyte)
+reduce_image_info(
+    void)
 {
-    int prediction, pA, pB, pC, dA, dB, dC;
-
-    ASSERT(NULL != ps.this_line);
-    ASSERT(NULL != ps.last_line);
-
-    if (PNG_PF_None == ps.cur_filter) prediction = 0;
-    else {
-        pA = ((ps.line_x < ps.byte_offset) ? 0 :
-          ps.this_line[ps.line_x - ps.byte_offset]);
-        pB = ps.last_line[ps.line_x];
-        pC = ((ps.line_x < ps.byte_offset) ? 0 :
-          ps.last_line[ps.line_x - ps.byte_offset]);
-
-        switch (ps.cur_filter) {
-        case PNG_PF_Sub:
-            prediction = pA;
-            break;
-        case PNG_PF_Up:
-            prediction = pB;
-            break;
-        case PNG_PF_Average:
-            prediction = ((pA + pB) / 2);
-            break;
-        case PNG_PF_Paeth:
-            prediction = pA + pB - pC;
-            dA = abs(prediction - pA);
-            dB = abs(prediction - pB);
-            dC = abs(prediction - pC);
-            if (dA <= dB && dA <= dC) prediction = pA;
-            else if (dB <= dC) prediction = pB;
-            else prediction = pC;
-            break;
-        default:
-            ASSERT(FALSE);
+    U32 factor;
+
+    ASSERT(NULL != ps.image);
+
+    if (ps.cropping) {
+        if (PNG_MU_Pixel == ps.image->offset_unit) {
+            ps.image->xoffset += ps.crop_x;
+            ps.image->yoffset += ps.crop_y;
         }
+        ps.image->width = ps.crop_width;
+        ps.image->height = ps.crop_height;
+    }
+    factor = ps.thumb_factor;
+    if (1 == factor) return;
+
+    ps.image->width = (ps.image->width + factor - 1) / factor;
+    ps.image->height = (ps.image->height + factor - 1) / factor;
+    ps.image->xres /= factor;
+    ps.image->yres /= factor;
+    if (PNG_MU_Pixel == ps.image->offset_unit) {
+        /*
+         * oFFs offsets are signed.
+         */
+        ps.image->xoffset = (U32)((S32)ps.image->xoffset /
+          (S32)factor);
+        ps.image->yoffset = (U32)((S32)ps.image->yoffset /
+          (S32)factor);
+    }
+    /*
+     * Averaged sub-byte gray comes out with 8 bits. Its
+     * transparent color, if any, has to follow.
+     */
+    if (!ps.image->is_interlaced && !ps.image->is_palette &&
+      ps.image->bits_per_sample < 8) {
+        ps.image->trans_values[0] = (ps.image->trans_values[0] *
+          255) / ((1 << ps.image->bits_per_sample) - 1);
+        ps.image->bits_per_sample = 8;
     }
-    ps.this_line[ps.line_x] = 0xFF & (inbyte + prediction);
 }
 
+/*
+ * Unfilter "count" bytes of image data from "in" into line
+ * "cur", starting at byte "x", with "prev" the line above. The
+ * filter type is the same for the whole line, so it is looked
+ * at once per call rather than once per byte, and there is a
+ * copy of the function for each pixel size (ps.byte_offset),
+ * so that the distance back to the pixel on the left is a
+ * constant the compiler can work with. The first pixel of a
+ * line has nothing to its left, and is done on its own so that
+ * the main loops needn't check for it.
+ */
+
+#define UNFILTER(name, bpp) \
+static void \
+name( \
+    U8 *cur, \
+    U8 *prev, \
+    U8 *in, \
+    size_t x, \
+    size_t count, \
+    int filter) \
+{ \
+    size_t end, first; \
+    int a, b, c, pa, pb, pc; \
+\
+    ASSERT(NULL != cur); \
+    ASSERT(NULL != prev); \
+\
+    end = x + count; \
+    first = (end < bpp) ? end : bpp; \
+\
+    switch (filter) { \
+    case PNG_PF_None: \
+        memcpy(cur + x, in, count); \
+        break; \
+    case PNG_PF_Sub: \
+        for (; x < first; ++x) cur[x] = *in++; \
+        for (; x < end; ++x) cur[x] = (U8)(*in++ + cur[x - bpp]); \
+        break; \
+    case PNG_PF_Up: \
+        for (; x < end; ++x) cur[x] = (U8)(*in++ + prev[x]); \
+        break; \
+    case PNG_PF_Average: \
+        for (; x < first; ++x) cur[x] = (U8)(*in++ + (prev[x] >> 1)); \
+        for (; x < end; ++x) { \
+            cur[x] = (U8)(*in++ + ((cur[x - bpp] + prev[x]) >> 1)); \
+        } \
+        break; \
+    case PNG_PF_Paeth: \
+        for (; x < first; ++x) cur[x] = (U8)(*in++ + prev[x]); \
+        for (; x < end; ++x) { \
+            a = cur[x - bpp]; \
+            b = prev[x]; \
+            c = prev[x - bpp]; \
+            pa = abs(b - c); \
+            pb = abs(a - c); \
+            pc = abs(a + b - c - c); \
+            if (pa <= pb && pa <= pc) cur[x] = (U8)(*in++ + a); \
+            else if (pb <= pc) cur[x] = (U8)(*in++ + b); \
+            else cur[x] = (U8)(*in++ + c); \
+        } \
+        break; \
+    default: \
+        ASSERT(FALSE); \
+    } \
+}
+
+UNFILTER(unfilter_1, 1)
+UNFILTER(unfilter_2, 2)
+UNFILTER(unfilter_3, 3)
+UNFILTER(unfilter_4, 4)
+UNFILTER(unfilter_6, 6)
+UNFILTER(unfilter_8, 8)
+
+#undef UNFILTER
+
 /*
  * Calculate how many bytes of image data will appear
  * per line of the given image, accounting for the start
@@ -255,118 +520,278 @@ new_line_size(
 
     if (BPS < 8) {
         ASSERT(1 == image->samples_per_pixel);
-        size = ((BPS * (pixels - 1)) / 8) + 1;
+        size = (((size_t)BPS * (pixels - 1)) / 8) + 1;
     } else {
         ASSERT(8 == BPS || 16 == BPS);
-        size = pixels * image->samples_per_pixel * (BPS / 8);
+        size = (size_t)pixels * image->samples_per_pixel * (BPS / 8);
     }
     return size;
 }
 
+/*
+ * Add the scanline just unfiltered into the running box sums
+ * for a non-interlaced thumbnail, and write out a row of the
+ * reduced image every thumb_factor rows (or at the bottom of
+ * the image). Palette indices can't be averaged, so for those
+ * we just keep the top left pixel of each box.
+ */
+
 static void
-write_byte(
+box_filter_row(
     void)
 {
-    U8 *temp, byte;
+    U32 col, box, factor, boxes, count;
+    int sample, spp, got_bits, value;
+    double *sp;
+    U8 *lp, byte;
+
+    factor = ps.thumb_factor;
+    spp = ps.image->samples_per_pixel;
+    boxes = (ps.image->width + factor - 1) / factor;
+    lp = ps.this_line;
+    got_bits = 0;
+
+    if (!ps.image->is_palette || 0 == ps.thumb_rows) {
+        for (col = 0; col < ps.image->width; ++col) {
+            sp = ps.thumb_sums + (col / factor) * spp;
+
+            for (sample = 0; sample < spp; ++sample) {
+                if (BPS < 8) {
+                    if (0 == got_bits) {
+                        byte = *lp++;
+                        got_bits = 8;
+                    }
+                    value = (((byte >> (8 - BPS)) & BMAX) * 255) / BMAX;
+                    byte <<= BPS;
+                    got_bits -= BPS;
+                } else if (8 == BPS) {
+                    value = *lp++;
+                } else {
+                    value = BE_GET16(lp);
+                    lp += 2;
+                }
+                if (ps.image->is_palette) {
+                    if (0 == col % factor) *sp = value;
+                } else *sp++ += value;
+            }
+        }
+    }
+    if (++ps.thumb_rows < factor &&
+      ps.current_row + 1 < ps.image->height) return;
     /*
-     * Advance pointers and handle interlacing.
+     * Box complete. Write out the averages.
      */
-    if (++ps.line_x >= ps.line_size) {
-        /*
-         * We've now received all the bytes for a single
-         * scanline. Here we write them to the tempfile,
-         * unpacking 1, 2, and 4-bit values into whole bytes.
-         */
-        if (BPS < 8) {
-            int pixel, got_bits;
-            U32 start, increment;
-
-            if (ps.image->is_interlaced) {
-                start = starting_col[ps.interlace_pass];
-                increment = col_increment[ps.interlace_pass];
-            } else {
-                start = 0;
-                increment = 1;
-            }
-            temp = ps.this_line;
-            got_bits = 0;
+    for (box = 0; box < boxes; ++box) {
+        count = ps.thumb_rows * min(factor,
+          ps.image->width - box * factor);
+        if (ps.image->is_palette) count = 1;
+        sp = ps.thumb_sums + box * spp;
+
+        for (sample = 0; sample < spp; ++sample) {
+            value = (int)((*sp / count) + 0.5);
+            *sp++ = 0.0;
+            if (16 == BPS) putc(value >> 8, ps.tf[0]);
+            putc(value & 0xFF, ps.tf[0]);
+        }
+    }
+    ps.thumb_rows = 0;
+}
 
-            for (ps.current_col = start;
-              ps.current_col < ps.image->width;
-              ps.current_col += increment) {
+/*
+ * When the image is not interlaced, cropping is done here as
+ * each row comes out of the unfilter: rows above the crop
+ * window and columns outside it are simply not written, and
+ * we tell inflate to stop once we are past the last row we
+ * want. Interlaced images are cropped in repack_tempfiles().
+ */
 
-                if (got_bits == 0) {
-                    byte = *temp++;
-                    got_bits = 8;
-                }
-                pixel = (byte >> (8 - BPS)) & BMAX;
-                pixel = (pixel * 255) / BMAX;
+#define IN_CROP_ROW (!ps.cropping || ps.image->is_interlaced || \
+  (ps.current_row >= ps.crop_y && \
+  ps.current_row < ps.crop_y + ps.crop_height))
 
-                byte <<= BPS;
-                got_bits -= BPS;
+static void
+write_row(
+    void)
+{
+    U8 *temp, byte;
+    U32 first_col, last_col;
 
-                putc(pixel, ps.tf[ps.interlace_pass]);
-            }
+    first_col = 0;
+    last_col = ps.image->width;
+    if (ps.cropping && !ps.image->is_interlaced) {
+        first_col = ps.crop_x;
+        last_col = ps.crop_x + ps.crop_width;
+    }
+    /*
+     * We've now received all the bytes for a single
+     * scanline. Here we write them to the tempfile,
+     * unpacking 1, 2, and 4-bit values into whole bytes.
+     * Rows past the bottom of the image come from surplus
+     * data at the end of the stream, and are dropped: the
+     * pass files are only made big enough for the image.
+     */
+    if (!IN_CROP_ROW || ps.current_row >= ps.image->height) {
+        /* Not wanted */
+    } else if (ps.thumb_factor > 1 && !ps.image->is_interlaced) {
+        box_filter_row();
+    } else if (BPS < 8) {
+        int pixel, got_bits;
+        U32 start, increment;
+        U8 *rp;
+
+        if (ps.image->is_interlaced) {
+            start = starting_col[ps.interlace_pass];
+            increment = col_increment[ps.interlace_pass];
         } else {
-            if (ps.line_size != fwrite(ps.this_line, 1,
-              ps.line_size, ps.tf[ps.interlace_pass]))
-              error_exit(ERR_WRITE);
+            start = 0;
+            increment = 1;
         }
-        ps.cur_filter = 255;
-        ps.line_x = 0;
-        temp = ps.last_line;
-        ps.last_line = ps.this_line;
-        ps.this_line = temp;
+        temp = ps.this_line;
+        rp = ps.row_buf;
+        got_bits = 0;
 
-        if (ps.image->is_interlaced) {
-            ps.current_row +=
-              row_increment[ps.interlace_pass];
-
-            if (ps.current_row >= ps.image->height) {
-                /*
-                 * Some odd special cases here to deal with:
-                 * First, after the last pixel has been read, the
-                 * pass will be incremented to 7; we decrement
-                 * it back to 6 so that the calculations won't
-                 * bomb. Then, we have to deal with images less
-                 * than 5 pixels wide, where pass 1 will be
-                 * absent--we check this because line_size will
-                 * computed < 1.
-                 */
-                do {
-                    if (++ps.interlace_pass > 6) {
-                        --ps.interlace_pass;
-                        return;
-                    }
-                    ps.current_row =
-                      starting_row[ps.interlace_pass];
-                    ps.line_size = new_line_size(ps.image,
-                      starting_col[ps.interlace_pass],
-                      col_increment[ps.interlace_pass]);
-                } while (ps.line_size < 1);
-
-                memset(ps.last_line, 0, ps.line_size);
+        for (ps.current_col = start;
+          ps.current_col < last_col;
+          ps.current_col += increment) {
+
+            if (got_bits == 0) {
+                byte = *temp++;
+                got_bits = 8;
             }
-        } else {
-            ++ps.current_row;
+            pixel = (byte >> (8 - BPS)) & BMAX;
+            pixel = (pixel * 255) / BMAX;
+
+            byte <<= BPS;
+            got_bits -= BPS;
+
+            if (ps.current_col >= first_col) *rp++ = (U8)pixel;
+        }
+        put_row(ps.row_buf, (size_t)(rp - ps.row_buf));
+    } else {
+        size_t skip, bytes;
+
+        skip = first_col * ps.byte_offset;
+        bytes = ps.line_size;
+        if (ps.cropping && !ps.image->is_interlaced)
+          bytes = (last_col - first_col) * ps.byte_offset;
+        ASSERT(skip + bytes <= ps.line_size);
+        put_row(ps.this_line + skip, bytes);
+    }
+    ps.cur_filter = 255;
+    ps.line_x = 0;
+    temp = ps.last_line;
+    ps.last_line = ps.this_line;
+    ps.this_line = temp;
+
+    if (ps.image->is_interlaced) {
+        ps.current_row +=
+          row_increment[ps.interlace_pass];
+
+        if (ps.current_row >= ps.image->height) {
+            /*
+             * Some odd special cases here to deal with:
+             * First, after the last pixel has been read, the
+             * pass will be incremented to 7; we decrement
+             * it back to 6 so that the calculations won't
+             * bomb. Then, we have to deal with images less
+             * than 5 pixels wide, where pass 1 will be
+             * absent--we check this because line_size will
+             * computed < 1. Likewise, images less than 5
+             * pixels high have no pass 2, and so on.
+             */
+            do {
+                if (++ps.interlace_pass > ps.last_pass) {
+                    --ps.interlace_pass;
+                    if (ps.last_pass < 6)
+                      ps.stop_inflate = TRUE;
+                    return;
+                }
+                ps.current_row =
+                  starting_row[ps.interlace_pass];
+                ps.line_size = new_line_size(ps.image,
+                  starting_col[ps.interlace_pass],
+                  col_increment[ps.interlace_pass]);
+            } while (ps.line_size < 1 ||
+              ps.current_row >= ps.image->height);
+
+            memset(ps.last_line, 0, ps.line_size);
+        }
+    } else {
+        ++ps.current_row;
+        if (ps.cropping &&
+          ps.current_row >= ps.crop_y + ps.crop_height)
+          ps.stop_inflate = TRUE;
+    }
+}
+
+#undef IN_CROP_ROW
+
+/*
+ * Write a finished row to its pass file, or hand it to the
+ * library caller. inflate() can't pass errors back, so they
+ * are kept in ps.decode_err, and inflate is told to stop.
+ */
+
+static void
+put_row(
+    U8 *row,
+    size_t bytes)
+{
+    if (0 != ps.decode_err) return;
+    if (ps.stream_rows) {
+        if (0 != ptot_callbacks->row(ptot_callbacks->user,
+          ps.current_row, row)) {
+            ps.decode_err = ERR_STOPPED;
+            ps.stop_inflate = TRUE;
         }
+    } else if (bytes != fwrite(row, 1, bytes,
+      ps.tf[ps.interlace_pass])) {
+        ps.decode_err = ERR_WRITE;
+        ps.stop_inflate = TRUE;
     }
 }
 
+/*
+ * The most a pass file can be asked to hold: every row of the
+ * pass, unpacked to a byte per sample (two for 16-bit samples).
+ * Cropping and thumbnails only make it smaller.
+ */
+
+static long
+pass_file_size(
+    int pass)
+{
+    U32 rows, pixels;
+    long bytes;
+
+    bytes = ps.image->samples_per_pixel;
+    if (16 == ps.image->bits_per_sample) bytes *= 2;
+    if (!ps.image->is_interlaced)
+      return bytes * (long)ps.image->width * (long)ps.image->height;
+
+    if (ps.image->width <= starting_col[pass] ||
+      ps.image->height <= starting_row[pass]) return 0L;
+    pixels = (ps.image->width - starting_col[pass] - 1) /
+      col_increment[pass] + 1;
+    rows = (ps.image->height - starting_row[pass] - 1) /
+      row_increment[pass] + 1;
+    return bytes * (long)pixels * (long)rows;
+}
+
 /*
  * The image has now been read into 1 or 7 temp files, at one
  * more bytes per pixel (to simplfy de-interlacing). This
  * function combines them back into a single file, pointed to
- * by the pixel_data_file member of the image structure.
+ * by the pixel_data member of the image structure. A single
+ * file is already in the right form, and is simply handed over.
  */
 
 static int
 repack_tempfiles(
     void)
 {
-    char filename[FILENAME_MAX];
     FILE *outf;
-    U32 row, col;
+    U32 row, col, step;
     size_t bytes;
     int pass, err, byte, bpp;
     U8 *line_buf, *lp;
@@ -374,38 +799,70 @@ repack_tempfiles(
     ASSERT(0 != ps.buf);
     ASSERT(0 != ps.image);
 
-    sprintf(filename, "pngdata.tmp");
-    ps.image->pixel_data_file =
-      (char *)malloc(strlen(filename) + 1);
-    if (NULL == ps.image->pixel_data_file) return ERR_MEMORY;
-    else strcpy(ps.image->pixel_data_file, filename);
-
-    outf = fopen(ps.image->pixel_data_file, "wb");
-    if (NULL == outf) return ERR_WRITE;
+    if (NULL != ps.frame) {
+        /*
+         * Animation frames go one after another into a single
+         * file, and each one remembers where it starts.
+         */
+        if (NULL == ps.image->frame_data) {
+            if (NULL == (ps.image->frame_data = new_tempfile(-1L)))
+              return ERR_WRITE;
+        }
+        outf = ps.image->frame_data;
+        if (0 != fseek(outf, 0L, SEEK_END)) return ERR_WRITE;
+        ps.frame->data_offset = ftell(outf);
+        if (ps.frame->data_offset < 0) return ERR_WRITE;
+    } else if (!ps.image->is_interlaced) {
+        if (0 != (err = open_tempfile(0))) return err;
+        ps.image->pixel_data = ps.tf[0];
+        ps.tf[0] = NULL;
+        return 0;
+    } else {
+        if (NULL == (ps.image->pixel_data =
+          new_tempfile((long)pixel_row_size(ps.image) *
+          (long)ps.image->height))) return ERR_WRITE;
+        outf = ps.image->pixel_data;
+    }
 
-    if (ps.image->is_interlaced) {
+    if (ps.adam7) {
+        if (0 != (err = scatter_adam7(outf))) return err;
+    } else if (ps.image->is_interlaced) {
         for (pass = 0; pass <= 6; ++pass) {
             if (0 != (err = open_tempfile(pass))) return err;
         }
         bpp = ps.image->samples_per_pixel;
         if (16 == ps.image->bits_per_sample) bpp *= 2;
-        bytes = bpp * ps.image->width;
+        bytes = (size_t)bpp * ps.image->width;
 
         if (NULL == (line_buf = (U8 *)malloc(bytes)))
           return ERR_MEMORY;
 
-        for (row = 0; row < ps.image->height; ++row) {
+        /*
+         * Every pass file has to be read in order, so rows
+         * above the crop window are read and thrown away. For
+         * a thumbnail, we only have the passes that make up
+         * every thumb_factor'th row and column.
+         */
+        step = ps.thumb_factor;
+        bytes = (size_t)bpp * ((ps.image->width + step - 1) / step);
+
+        for (row = 0; row < ps.crop_y + ps.crop_height; row += step) {
             lp = line_buf;
 
-            for (col = 0; col < ps.image->width; ++col) {
+            for (col = 0; col < ps.image->width; col += step) {
                 pass = interlace_pattern[row & 7][col & 7];
                 for (byte = 0; byte < bpp; ++byte) {
                     *lp++ = getc(ps.tf[pass]);
                 }
             }
             ASSERT(bytes == (lp - line_buf));
-            fwrite(line_buf, 1, bytes, outf);
+            if (row >= ps.crop_y) {
+                fwrite(line_buf + (size_t)bpp * ps.crop_x, 1,
+                  (size_t)bpp * ((ps.crop_width + step - 1) / step),
+                  outf);
+            }
         }
+        free(line_buf);
     } else {
         if (0 != (err = open_tempfile(0))) return err;
         if (NULL == (line_buf = (U8 *)malloc(IOBUF_SIZE)))
@@ -415,11 +872,10 @@ repack_tempfiles(
           fread(line_buf, 1, IOBUF_SIZE, ps.tf[0]))) {
             fwrite(line_buf, 1, bytes, outf);
         }
+        free(line_buf);
     }
-    free(line_buf);
-    close_all_tempfiles();
-    fclose(outf);
     remove_all_tempfiles();
+    if (0 != fflush(outf) || ferror(outf)) return ERR_WRITE;
     return 0;
 }
 
@@ -427,9 +883,11 @@ repack_tempfiles(
 #undef BMAX
 
 /*
- * Handle tEXt and zTXt chunks. The keywords listed in ptot.h
- * will be translated to equivalent TIFF tags. Others are just
- * passed on as unkown PNG chunks.
+ * Handle tEXt, zTXt and iTXt chunks. The keywords listed in
+ * ptot.h will be translated to equivalent TIFF tags. Others are
+ * just passed on as unkown PNG chunks. Compressed text is
+ * inflated straight into memory, as is plain text, up to the
+ * --max-text limit; anything past that is dropped.
  */
 
 #define KW_MAX 80 /* Longest possible matching keyword */
@@ -438,77 +896,200 @@ int
 decode_text(
     void)
 {
-    int i, err;
-    size_t kw_len, val_len;
-    char *srcp, *dstp, **address = NULL;
+    int i, err, compressed, failed;
+    U8 *cp, *end, *method;
+    char **address = NULL;
 
-    ASSERT(NULL != ps.inf);
     ASSERT(NULL != ps.buf);
     ASSERT(NULL != ps.image);
-    ASSERT(IS_ZTXT || IS_TEXT);
+    ASSERT(IS_ZTXT || IS_TEXT || IS_ITXT);
 
     get_chunk_data(ps.bytes_remaining);
-
-    for (i = 0; i < N_KEYWORDS; ++i) {
-        if (0 == strncmp(ps.buf, keyword_table[i], KW_MAX)) {
-            address = &ps.image->keywords[i];
-            break;
-        }
-    }
-    if (NULL != address) {
-        kw_len = strlen(ps.buf);
-        if (IS_ZTXT) {
-            if (PNG_CT_Deflate != ps.buf[kw_len + 1]) {
-                err = ERR_BAD_PNG;
-                goto dz_err_out;
+    end = ps.buf + ps.bytes_in_buf;
+
+    cp = (U8 *)memchr(ps.buf, '\0', (size_t)min(KW_MAX,
+      ps.bytes_in_buf));
+    if (NULL != cp) {
+        for (i = 0; i < N_KEYWORDS; ++i) {
+            if (0 == strcmp((char *)ps.buf, keyword_table[i])) {
+                address = &ps.image->keywords[i];
+                break;
             }
-            ps.bytes_in_buf -= (kw_len + 2);
-            ps.bufp = ps.buf + kw_len + 2;
-
-            if (0 != (err = create_tempfile(0))) goto dz_err_out;
-            zlib_start();
-            inflate();
-            zlib_end();
-            if (0 != (err = open_tempfile(0))) goto dz_err_out;
-
-            ps.buf[0] = '\0';
-            ps.buf[1] = getc(ps.tf[0]);
-            kw_len = 0;
-            ps.bytes_in_buf = 2;
-            ps.bytes_remaining = ps.inflated_chunk_size - 1;
         }
-        *address = (char *)malloc((size_t)(ps.bytes_remaining +
-          ps.bytes_in_buf - kw_len));
-
-        dstp = *address;
-        val_len = (size_t)(ps.bytes_in_buf - (kw_len + 1));
-        srcp = ps.buf + kw_len + 1;
-
-        while (0 != val_len) {
-            memcpy(dstp, srcp, val_len);
-            srcp = ps.buf;
-            dstp += val_len;
-            if (0 != ps.bytes_remaining) {
-                if (IS_ZTXT) {
-                    val_len = fread(ps.buf, 1, IOBUF_SIZE,
-                      ps.tf[0]);
-                    ps.bytes_remaining -= val_len;
-                } else {
-                    val_len = get_chunk_data(ps.bytes_remaining);
-                }
-            } else val_len = 0;
+    }
+    if (NULL == address) return copy_unknown_chunk_data();
+    /*
+     * Find the start of the text. zTXt has a compression method
+     * byte after the keyword; iTXt has a compression flag and
+     * method, then language and translated keyword strings.
+     */
+    method = ++cp;
+    compressed = IS_ZTXT;
+    if (IS_ITXT) {
+        if (end - cp < 2) goto dt_bad_out;
+        compressed = (0 != *cp++);
+        method = cp++;
+        for (i = 0; i < 2; ++i) {
+            cp = (U8 *)memchr(cp, '\0', (size_t)(end - cp));
+            if (NULL == cp) goto dt_bad_out;
+            ++cp;
         }
-        *dstp = '\0';
-        err = 0;
-    } else err = copy_unknown_chunk_data();
+    } else if (IS_ZTXT) ++cp;
 
-dz_err_out:
-    close_all_tempfiles();
+    if (compressed && (method >= end || PNG_CT_Deflate != *method))
+      goto dt_bad_out;
+    ps.text_size = 0;
+    ps.stop_inflate = FALSE;
+
+    if (compressed) {
+        ps.bytes_in_buf -= (S32)(cp - ps.buf);
+        ps.bufp = cp;
+        ps.decode_err = 0;
+
+        if (0 != zlib_start()) failed = TRUE;
+        else failed = (0 != inflate() && !ps.stop_inflate);
+        zlib_end();
+        /*
+         * Compressed text that is bad, or runs past the end of
+         * its chunk, costs us only the chunk; failing to read or
+         * store it is an error.
+         */
+        err = ps.decode_err;
+        if (0 != err && ERR_BAD_PNG != err) goto dt_err_out;
+        if (failed || 0 != err) goto dt_bad_out;
+    } else {
+        err = store_text(cp, (U32)(end - cp));
+        while (0 == err && 0 != ps.bytes_remaining) {
+            err = ERR_READ;
+            if (0 == get_chunk_data(ps.bytes_remaining))
+              goto dt_err_out;
+            err = store_text(ps.buf, (U32)ps.bytes_in_buf);
+        }
+        if (0 != err && !ps.stop_inflate) goto dt_err_out;
+    }
+    err = grow_buffer(&ps.text, &ps.text_alloc, ps.text_size, 1);
+    if (0 != err) goto dt_err_out;
+    ps.text[ps.text_size] = '\0';
+
+    if (NULL != *address) free(*address);
+    *address = (char *)ps.text;
+    ps.image->keyword_is_utf8[address - ps.image->keywords] = IS_ITXT;
+    ps.text = NULL;
+    ps.text_alloc = 0;
+    /*
+     * If the text was cut short, skip what's left of it.
+     */
+    ps.stop_inflate = FALSE;
+    return skip_chunk_data();
+
+dt_bad_out:
+    print_warning(WARN_BAD_PNG);
+    err = skip_chunk_data();
+dt_err_out:
+    ps.stop_inflate = FALSE;
+    ps.decode_err = 0;
+    if (NULL != ps.text) free(ps.text);
+    ps.text = NULL;
+    ps.text_alloc = 0;
     return err;
 }
 
 /*
- * Copy unknown but copy-safe chunk.
+ * Add to the text being decoded, as long as it stays within
+ * the limit. A nonzero return means we've reached the limit
+ * and want no more (ps.stop_inflate is set), or an error, which
+ * is also kept in ps.decode_err for when inflate() called us.
+ */
+
+static int
+store_text(
+    U8 *data,
+    U32 bytes)
+{
+    int err, full;
+
+    full = (bytes > ps.text_max - ps.text_size);
+    if (full) bytes = ps.text_max - ps.text_size;
+
+    err = grow_buffer(&ps.text, &ps.text_alloc, ps.text_size, bytes);
+    if (0 != err) return (ps.decode_err = err);
+
+    memcpy(ps.text + ps.text_size, data, (size_t)bytes);
+    ps.text_size += bytes;
+    if (full) {
+        print_warning(WARN_BIG_TEXT);
+        ps.stop_inflate = TRUE;
+    }
+    return ps.stop_inflate;
+}
+
+/*
+ * Make sure a growable buffer holding "size" bytes has room for
+ * "bytes" more, doubling it as often as it takes. The total must
+ * still fit in a U32, and in a size_t for realloc().
+ */
+
+static int
+grow_buffer(
+    U8 **data,
+    U32 *alloc,
+    U32 size,
+    U32 bytes)
+{
+    U32 needed, new_size;
+    U8 *new_data;
+
+    if (bytes > 0xFFFFFFFFL - size) return ERR_TOO_BIG;
+    needed = size + bytes;
+    if (needed <= *alloc) return 0;
+    if ((size_t)needed != needed) return ERR_TOO_BIG;
+
+    new_size = *alloc;
+    if (0 == new_size) new_size = IOBUF_SIZE;
+    while (new_size < needed) {
+        if (new_size > 0x7FFFFFFFL || (size_t)(2 * new_size) !=
+          2 * new_size) {
+            new_size = needed;
+            break;
+        }
+        new_size *= 2;
+    }
+    if (NULL == (new_data = (U8 *)realloc(*data, (size_t)new_size)))
+      return ERR_MEMORY;
+    *data = new_data;
+    *alloc = new_size;
+    return 0;
+}
+
+/*
+ * Append to the store of chunks to be copied into the output
+ * as they are. It is kept in memory, since it is usually small
+ * and always written out in one piece.
+ */
+
+static int
+store_png_data(
+    U8 *data,
+    U32 bytes)
+{
+    int err;
+
+    ASSERT(NULL != ps.image);
+
+    err = grow_buffer(&ps.image->png_data, &ps.image->png_data_alloc,
+      ps.image->png_data_size, bytes);
+    if (0 != err) return err;
+
+    memcpy(ps.image->png_data + ps.image->png_data_size, data,
+      (size_t)bytes);
+    ps.image->png_data_size += bytes;
+    return 0;
+}
+
+/*
+ * Copy unknown but copy-safe chunk. Some of it may already be
+ * in the I/O buffer; the rest we read here. The CRC is made
+ * afresh, in case we're copying a chunk whose own CRC is bad.
  */
 
 int
@@ -516,54 +1097,30 @@ copy_unknown_chunk_data(
     void)
 {
     int err;
-    U8 small_buf[10];
-    char fname[FILENAME_MAX];
+    U8 small_buf[8];
     U32 output_crc;
-    FILE *outf;
 
     ASSERT(NULL != ps.buf);
     ASSERT(NULL != ps.image);
 
-    if (NULL == ps.image->png_data_file) {
-        sprintf(fname, "pngextra.tmp");
-        ps.image->png_data_file =
-          (char *)malloc(strlen(fname) + 1);
-        if (NULL == ps.image->png_data_file) return ERR_MEMORY;
-        strcpy(ps.image->png_data_file, fname);
-    }
-    if (NULL == (outf = fopen(ps.image->png_data_file, "ab")))
-      return ERR_WRITE;
-
     BE_PUT32(small_buf, ps.bytes_remaining + ps.bytes_in_buf);
     BE_PUT32(small_buf+4, ps.current_chunk_name);
-    output_crc = 0xFFFFFFFFL;
-    output_crc = update_crc(output_crc, ps.buf+4, 4);
+    output_crc = update_crc(0xFFFFFFFFL, small_buf+4, 4);
 
-    err = ERR_WRITE;
+    if (0 != (err = store_png_data(small_buf, 8))) return err;
 
-    if (8 != (fwrite(small_buf, 1, 8, outf))) goto cu_err_out;
-
-    if (0 != ps.bytes_in_buf) {
-        output_crc = update_crc(output_crc, ps.buf,
-          ps.bytes_in_buf);
-        if (ps.bytes_in_buf != (U32)fwrite(ps.buf, 1,
-          (size_t)(ps.bytes_in_buf), outf)) goto cu_err_out;
-    }
-    while (0 != ps.bytes_remaining) {
-        get_chunk_data(ps.bytes_remaining);
-        output_crc = update_crc(output_crc, ps.buf,
-          ps.bytes_in_buf);
-        if (ps.bytes_in_buf != fwrite(ps.buf, 1,
-              (size_t)(ps.bytes_in_buf), outf)) goto cu_err_out;
-        ps.bytes_remaining -= ps.bytes_in_buf;
+    for (;;) {
+        if (0 != ps.bytes_in_buf) {
+            output_crc = update_crc(output_crc, ps.buf,
+              (U32)ps.bytes_in_buf);
+            err = store_png_data(ps.buf, (U32)ps.bytes_in_buf);
+            if (0 != err) return err;
+        }
+        if (0 == ps.bytes_remaining) break;
+        if (0 == get_chunk_data(ps.bytes_remaining)) return ERR_READ;
     }
     BE_PUT32(small_buf, output_crc ^ 0xFFFFFFFFL);
-    if (4 != (fwrite(small_buf, 1, 4, outf))) goto cu_err_out;
-
-    err = 0;
-cu_err_out:
-    fclose(outf);
-    return err;
+    return store_png_data(small_buf, 4);
 }
 
 /*
@@ -571,58 +1128,92 @@ cu_err_out:
  * Mark Adler's inflate.c.  fill_buf() is called by
  * NEXTBYTE when the I/O buffer is empty. It knows about
  * split IDATs and deals with them specially. These two
- * functions are used by zTXt as well.
+ * functions are used by zTXt and iTXt as well.
  */
 
 U8
 fill_buf(
     void)
 {
-    int err;
+    int err, image_data;
 
     ASSERT(NULL != ps.buf);
     ASSERT(-1 == ps.bytes_in_buf);
-    ASSERT(IS_ZTXT || IS_IDAT);
+    ASSERT(IS_ZTXT || IS_ITXT || IS_IDAT || IS_FDAT);
 
+    image_data = (IS_IDAT || IS_FDAT);
     if (0 == ps.bytes_remaining) {
         /*
          * Current IDAT is exhausted. Continue on to the next
-         * one. Only IDATs can be split this way.
+         * one. Only IDATs can be split this way--and fdATs,
+         * each of which starts with a sequence number.
          */
-        if (IS_ZTXT) return ERR_BAD_PNG;
-        if (0 != (err = verify_chunk_crc())) return err;
-
-        if (0 != (err = get_chunk_header())) return err;
-        if (!IS_IDAT) return ERR_EARLY_EOI;
+        err = ERR_BAD_PNG;
+        if (!image_data) goto fb_err_out;
+        if (0 != (err = verify_chunk_crc())) goto fb_err_out;
+
+        if (0 != (err = get_chunk_header())) goto fb_err_out;
+        err = ERR_EARLY_EOI;
+        if (NULL == ps.frame) {
+            if (!IS_IDAT) goto fb_err_out;
+        } else {
+            if (!IS_FDAT) goto fb_err_out;
+            err = ERR_BAD_PNG;
+            if (ps.bytes_remaining < 4) goto fb_err_out;
+            err = ERR_READ;
+            if (4 != get_chunk_data(4)) goto fb_err_out;
+            check_sequence(BE_GET32(ps.buf));
+        }
     }
-    ps.bufp = ps.buf;
-    ps.bytes_in_buf = (S32)fread(ps.buf, 1,
-      (size_t)min(IOBUF_SIZE, ps.bytes_remaining), ps.inf);
+    /*
+     * Decode straight out of the input block rather than
+     * copying into ps.buf first.
+     */
+    ps.bytes_in_buf = (S32)next_input(&ps.bufp, ps.bytes_remaining);
 
     ps.bytes_remaining -= ps.bytes_in_buf;
-    if (0 == ps.bytes_in_buf) return ERR_READ;
-    ps.crc = update_crc(ps.crc, ps.buf, ps.bytes_in_buf);
+    err = ERR_READ;
+    if (0 == ps.bytes_in_buf) goto fb_err_out;
+    ps.crc = update_crc(ps.crc, ps.bufp, ps.bytes_in_buf);
 
     --ps.bytes_in_buf;
     return *ps.bufp++;
+fb_err_out:
+    /*
+     * inflate() takes whatever we return as data, so the error
+     * is kept. For image data inflate is told to stop, and no
+     * row made from it goes any further (see put_row()).
+     */
+    if (0 == ps.decode_err) ps.decode_err = err;
+    if (image_data) ps.stop_inflate = TRUE;
+    return (U8)err;
 }
 
 /*
  * Flush uncompressed bytes from inflate window. This function
- * is used for both IDAT and zTXt chunks.
+ * is used for IDAT (and fdAT), zTXt and iTXt chunks. A nonzero return
+ * tells inflate to stop early (see FLUSH in ptot.h).
  */
 
-void
+int
 flush_window(
     U32 size)
 {
-    U8 *wp, byte;
-    U32 length, sum1, sum2;
+    U8 *wp;
+    U32 length, count, sum1, sum2;
     int loopcount;
 
+    if (0 == size) return 0;
+    /*
+     * After an error in fill_buf(), or once we want no more,
+     * the window may hold junk made from error codes: don't
+     * pass it on. The Adam7 workers would never stop taking it.
+     */
+    if (ps.stop_inflate || 0 != ps.decode_err) return 1;
+
     ASSERT(NULL != ps.inflate_window);
-    ASSERT(size > 0 && size <= ps.inflate_window_size);
-    ASSERT(IS_ZTXT || IS_IDAT);
+    ASSERT(size <= ps.inflate_window_size);
+    ASSERT(IS_ZTXT || IS_ITXT || IS_IDAT || IS_FDAT);
     /*
      * Compute Adler checksum on uncompressed data, then write.
      * We can safely delay the mod operation for 5552 bytes
@@ -654,31 +1245,49 @@ flush_window(
      * Write uncompressed bytes to output file.
      */
     ps.inflated_chunk_size += size;
-    if (IS_ZTXT) {
-        fwrite(ps.inflate_window, 1, (size_t)size, ps.tf[0]);
+    if (IS_ZTXT || IS_ITXT) {
+        if (0 != store_text(ps.inflate_window, size)) return 1;
+    } else if (ps.adam7) {
+        if (0 != adam7_bytes(ps.inflate_window, size)) return 1;
     } else {
         wp = ps.inflate_window;
         length = size;
 
-        do {
-            byte = *wp++;
-
+        while (length > 0) {
             if (255 == ps.cur_filter) {
-                ps.cur_filter = byte;
+                ps.cur_filter = *wp++;
+                --length;
 
                 if (ps.cur_filter > 4) {
                     print_warning(WARN_FILTER);
                     ps.cur_filter = 0;
                 }
-            } else {
-                unfilter(byte);
-                write_byte();
+                continue;
             }
-        } while (--length);
+            /*
+             * Unfilter as much of the line as we have, and write
+             * it out if that completes it.
+             */
+            count = (U32)min((size_t)length, ps.line_size - ps.line_x);
+            ASSERT(ps.line_x + count <= ps.line_size);
+            (*ps.unfilter)(ps.this_line, ps.last_line, wp, ps.line_x,
+              (size_t)count, ps.cur_filter);
+            wp += count;
+            length -= count;
+            ps.line_x += count;
+
+            if (ps.line_x >= ps.line_size) {
+                write_row();
+                if (ps.stop_inflate) return 1;
+            }
+        }
     }
+    return 0;
 }
 
 #undef IS_ZTXT
 #undef IS_TEXT
+#undef IS_ITXT
 #undef IS_IDAT
+#undef IS_FDAT
 